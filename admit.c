@@ -0,0 +1,171 @@
+/*
+This is the implementation of the admission policies used by the buffer cache.
+TinyLFU keeps a count-min sketch: ADMIT_ROWS rows of small saturating counters,
+each row indexed by its own hash of the block number.  The estimated frequency
+of a block is the smallest of its counters, which can only overcount.  After every
+ADMIT_SAMPLE accesses per block of capacity, all the counters are halved, so the
+sketch follows the recent past rather than everything since the cache was created.
+The counters are updated with atomic compare-and-swap, so recording needs no lock;
+a race with the halving may lose an access, which only makes an estimate a little low.
+A counter that would not change is not written at all, so hits on a block already
+at ADMIT_MAX only read the sketch.  Each thread counts its accesses in a slot of
+the sketch's own, padded out to a cache line, and adds them to the total ADMIT_BATCH
+at a time, so halvings come about as often as they would otherwise without every
+access bumping one shared counter.  Threads beyond ADMIT_SLOTS share slots, which
+is why the slots are still counted atomically.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "admit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ADMIT_ROWS 4             // Independent hashes per block
+#define ADMIT_WIDTH 4            // Counters per row for each block of capacity, before rounding up
+#define ADMIT_SAMPLE 10          // Accesses per block of capacity between halvings
+#define ADMIT_MAX 15             // Largest count a counter holds
+#define ADMIT_BATCH 16           // Accesses a thread counts by itself before adding them to a total
+#define ADMIT_SLOTS 64           // Per-thread counts of accesses not yet added to the total
+#define CACHE_LINE 64
+
+struct admit_slot {
+    unsigned long unbatched;     // Accesses recorded through this slot; updated atomically
+} __attribute__((aligned(CACHE_LINE)));
+
+struct admit {
+    admit_kind kind;             // Which policy this is
+    unsigned char *counts;       // ADMIT_ROWS rows of mask+1 counters, back to back
+    unsigned mask;               // Counters per row minus one; always a power of two minus one
+    unsigned long sample;        // Accesses between halvings
+    unsigned long accesses;      // Accesses recorded so far; updated atomically
+    struct admit_slot *slots;    // ADMIT_SLOTS counts of accesses on their way to the total
+};
+
+static int next_thread_index;
+static __thread int thread_index = -1;
+
+/* A small number naming the calling thread, handed out in order of first use. */
+static int my_thread_index(void) {
+    if (thread_index < 0) thread_index = __sync_fetch_and_add(&next_thread_index, 1);
+    return thread_index;
+}
+
+static const unsigned row_seeds[ADMIT_ROWS] = { 0x9e3779b9u, 0x85ebca6bu, 0xc2b2ae35u, 0x27d4eb2fu };
+
+/* Return the counter of row "row" that block "blocknum" maps to. */
+static unsigned char *counter(struct admit *a, int row, int blocknum) {
+    unsigned x = (unsigned)blocknum ^ row_seeds[row];
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return &a->counts[(size_t)row * (a->mask + 1) + (x & a->mask)];
+}
+
+/*
+Replace the counter at "c" by "update" of its value, retrying if another thread got there first.
+A counter the update leaves as it is stays untouched, so its cache line is not dirtied.
+*/
+static void counter_update(unsigned char *c, unsigned char (*update)(unsigned char)) {
+    unsigned char old;
+    do {
+        old = *c;
+        if (update(old) == old) return;
+    } while (!__sync_bool_compare_and_swap(c, old, update(old)));
+}
+
+static unsigned char increment(unsigned char n) {
+    return n < ADMIT_MAX ? n + 1 : n;
+}
+
+static unsigned char halve(unsigned char n) {
+    return n >> 1;
+}
+
+/* Return the estimated number of recent accesses to block "blocknum". */
+static int estimate(struct admit *a, int blocknum) {
+    int row, n, least = ADMIT_MAX;
+    for (row = 0; row < ADMIT_ROWS; row++) {
+        n = *counter(a, row, blocknum);
+        if (n < least) least = n;
+    }
+    return least;
+}
+
+struct admit *admit_create(admit_kind kind, int capacity) {
+    struct admit *a = calloc(1, sizeof(*a));
+    unsigned width = 1;
+
+    if (!a) return NULL;
+    a->kind = kind;
+    if (kind != ADMIT_TINYLFU) return a;
+
+    if (capacity < 1) capacity = 1;
+    while (width < (unsigned)capacity * ADMIT_WIDTH) width <<= 1;
+    a->mask = width - 1;
+    a->sample = (unsigned long)capacity * ADMIT_SAMPLE;
+    a->counts = calloc((size_t)ADMIT_ROWS * width, 1);
+    if (posix_memalign((void **)&a->slots, CACHE_LINE, sizeof(struct admit_slot) * ADMIT_SLOTS) != 0) a->slots = NULL;
+    if (a->slots) memset(a->slots, 0, sizeof(struct admit_slot) * ADMIT_SLOTS);
+    if (!a->counts || !a->slots) {
+        admit_delete(a);
+        return NULL;
+    }
+    return a;
+}
+
+void admit_record(struct admit *a, int blocknum) {
+    unsigned long i, old, total = (unsigned long)ADMIT_ROWS * (a->mask + 1);
+    int row;
+
+    if (a->kind != ADMIT_TINYLFU) return;
+    for (row = 0; row < ADMIT_ROWS; row++) {
+        counter_update(counter(a, row, blocknum), increment);
+    }
+    if (__sync_add_and_fetch(&a->slots[my_thread_index() % ADMIT_SLOTS].unbatched, 1) % ADMIT_BATCH != 0) return;
+    // Exactly one thread's batch takes the total past each multiple of the sample, and ages the sketch.
+    old = __sync_fetch_and_add(&a->accesses, ADMIT_BATCH);
+    if ((old + ADMIT_BATCH) / a->sample != old / a->sample) {
+        for (i = 0; i < total; i++) {
+            counter_update(&a->counts[i], halve);
+        }
+    }
+}
+
+int admit_allow(struct admit *a, int candidate, int victim) {
+    if (a->kind != ADMIT_TINYLFU) return 1;
+    // A tie goes to the victim, so a block seen once cannot displace another seen once.
+    return estimate(a, candidate) > estimate(a, victim);
+}
+
+int admit_estimate(struct admit *a, int blocknum) {
+    if (a->kind != ADMIT_TINYLFU) return 0;
+    return estimate(a, blocknum);
+}
+
+void admit_delete(struct admit *a) {
+    free(a->counts);
+    free(a->slots);
+    free(a);
+}
+
+static const char *admit_names[] = { "all", "tinylfu" };
+
+const char *admit_name(admit_kind kind) {
+    if (kind < ADMIT_ALL || kind > ADMIT_TINYLFU) return "unknown";
+    return admit_names[kind];
+}
+
+int admit_parse(const char *name, admit_kind *kind) {
+    int i;
+    for (i = ADMIT_ALL; i <= ADMIT_TINYLFU; i++) {
+        if (!strcmp(name, admit_names[i])) {
+            *kind = (admit_kind)i;
+            return 0;
+        }
+    }
+    return -1;
+}
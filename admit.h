@@ -0,0 +1,48 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+/*
+The interface to the admission policies used by the buffer cache.
+The eviction policy offers a resident block to give up; the admission policy
+first decides whether the block a miss brings in is worth more than that victim.
+A block that is turned down leaves the victim in place, but still has to be read
+into a frame, since a thread is waiting for it: it takes the frame of a block
+that was turned down before, and is handed to the eviction policy as cold, so
+the next miss takes its frame instead of another block of the working set.
+A policy only ever sees block numbers, and keeps no data.
+*/
+
+/* The admission policies that may be selected for a buffer cache. */
+typedef enum {
+    ADMIT_ALL,       // Every missed block displaces the victim.
+    ADMIT_TINYLFU    // A block displaces the victim only if it has been seen more often recently.
+} admit_kind;
+
+/* Create a policy of the given kind for a cache of "capacity" blocks. Returns null if out of memory. */
+struct admit * admit_create( admit_kind kind, int capacity );
+
+/*
+Record an access to block "blocknum", resident or not.
+This may be called from any thread without holding a lock.
+*/
+void admit_record( struct admit *a, int blocknum );
+
+/*
+Return non-zero if block "candidate" should take the place of resident block "victim".
+Like admit_record, this may be called from any thread without holding a lock.
+*/
+int admit_allow( struct admit *a, int candidate, int victim );
+
+/* Return how many recent accesses to block "blocknum" the policy has seen, or 0 if it keeps no count. */
+int admit_estimate( struct admit *a, int blocknum );
+
+/* Release the policy object. */
+void admit_delete( struct admit *a );
+
+/* Return the printable name of a policy kind. */
+const char * admit_name( admit_kind kind );
+
+/* Parse a policy name ("all", "tinylfu"). Returns 0 on success, -1 otherwise. */
+int admit_parse( const char *name, admit_kind *kind );
+
+#endif
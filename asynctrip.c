@@ -0,0 +1,111 @@
+/*
+This is a test of the asynchronous calls' round trip.
+Reads are started for blocks some of which are cached and some not, so that
+callbacks run both on the submitting thread and on the scheduler's.  Each
+request must complete exactly once, with its callback run once, and leave the
+disk's data in its buffer.  Writes started the same way must then read back
+asynchronously as written.  Last, requests freed as soon as they are submitted,
+more of them than there are frames, must each still run their callback once.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "testutil.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define DISK_BLOCKS 256
+#define MEMORY_BLOCKS 32
+#define REQUESTS 24              // Requests in flight together, fewer than the frames.
+#define CACHED 8                 // Of them, how many are read first so they hit.
+#define DETACHED 96              // Requests freed at once, more than the frames.
+#define DETACHED_WAIT_S 30       // How long to wait for their callbacks before giving up.
+
+static int calls[DISK_BLOCKS];   // Callbacks run for each block; updated atomically.
+static int total;                // Callbacks run in all; updated atomically.
+
+static void count_call(struct bcache_request *req, void *arg) {
+    (void)req;
+    __sync_fetch_and_add(&calls[(int)(long)arg], 1);
+    __sync_fetch_and_add(&total, 1);
+}
+
+/* Start reads of blocks first..first+REQUESTS-1, wait for them all, and check what they returned. */
+static int read_back(struct bcache *bc, int first, int version) {
+    static char buffers[REQUESTS][BLOCK_SIZE];
+    struct bcache_request *reqs[REQUESTS];
+    int i;
+
+    memset(calls, 0, sizeof(calls));
+    for (i = 0; i < REQUESTS; i++) {
+        reqs[i] = bcache_read_async(bc, first + i, buffers[i], count_call, (void *)(long)(first + i));
+        if (!reqs[i]) return 0;
+    }
+    for (i = 0; i < REQUESTS; i++) {
+        bcache_wait(reqs[i]);
+        if (!bcache_poll(reqs[i]) || calls[first + i] != 1) {
+            printf("FAILED: read of block %d completed %d times\n", first + i, calls[first + i]);
+            return 0;
+        }
+        if (!test_check_block("asynchronous read", first + i, version, buffers[i])) return 0;
+        bcache_request_free(reqs[i]);
+    }
+    return 1;
+}
+
+int main(void) {
+    static char data[REQUESTS][BLOCK_SIZE];
+    struct bcache_request *reqs[REQUESTS];
+    struct timespec pause = { 0, 1000000 };
+    struct bcache_config cfg;
+    int i, waited;
+
+    struct disk *d = test_open_disk("asynctripdisk", DISK_BLOCKS);
+    test_fill_disk(d, DISK_BLOCKS);
+    test_config(&cfg, MEMORY_BLOCKS);
+    struct bcache *bc = test_start_cache(d, &cfg);
+    if (!bc) return 1;
+
+    for (i = 0; i < CACHED; i++) bcache_read(bc, i, data[0]);
+    if (!read_back(bc, 0, 0)) return 1;
+
+    memset(calls, 0, sizeof(calls));
+    for (i = 0; i < REQUESTS; i++) {
+        test_fill_block(i, 1, data[i]);
+        reqs[i] = bcache_write_async(bc, i, data[i], count_call, (void *)(long)i);
+        if (!reqs[i]) return 1;
+    }
+    for (i = 0; i < REQUESTS; i++) {
+        bcache_wait(reqs[i]);
+        if (calls[i] != 1) {
+            printf("FAILED: write of block %d completed %d times\n", i, calls[i]);
+            return 1;
+        }
+        bcache_request_free(reqs[i]);
+    }
+    if (!read_back(bc, 0, 1)) return 1;
+
+    // Nobody keeps these requests, so only the callbacks tell when they are done.
+    memset(calls, 0, sizeof(calls));
+    total = 0;
+    for (i = 0; i < DETACHED; i++) {
+        int blocknum = MEMORY_BLOCKS + i;
+        struct bcache_request *req = bcache_read_async(bc, blocknum, data[i % REQUESTS], count_call, (void *)(long)blocknum);
+        if (!req) return 1;
+        bcache_request_free(req);
+    }
+    for (waited = 0; __sync_fetch_and_add(&total, 0) < DETACHED && waited < DETACHED_WAIT_S * 1000; waited++) nanosleep(&pause, NULL);
+    for (i = 0; i < DETACHED; i++) {
+        if (calls[MEMORY_BLOCKS + i] != 1) {
+            printf("FAILED: freed read of block %d completed %d times\n", MEMORY_BLOCKS + i, calls[MEMORY_BLOCKS + i]);
+            return 1;
+        }
+    }
+
+    printf("%d waited and %d freed requests each completed once\n", 3 * REQUESTS, DETACHED);
+    disk_close(d);
+    printf("ok\n");
+    return 0;
+}
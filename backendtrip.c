@@ -0,0 +1,141 @@
+/*
+This is a test of the disk backends' round trip.
+Each backend writes blocks one at a time, as a vector and as a batch of
+extents, and must read every one of them back the same three ways.  The direct
+backend keeps several of a batch's extents in flight at once, and so may finish
+them in any order.
+A cache over each backend must then write through to it and read back from it,
+and a mapped disk must do the same under a cache whose frames are its pages.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "testutil.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define DISK_BLOCKS 256
+#define MEMORY_BLOCKS 16
+#define RUN 8                    // Blocks in each vector, and in each extent of a batch.
+#define EXTENTS 4                // Extents in a batch, spaced apart.
+#define CACHED_BLOCKS 64         // Blocks written and read through each cache, more than it holds.
+
+/* The backends to try, and how many transfers each may have in flight. */
+static const struct {
+    disk_backend backend;
+    int depth;
+} backends[] = {
+    { DISK_SIM, 1 },
+    { DISK_MMAP, 1 },
+    { DISK_DIRECT, 4 },
+};
+
+/* Write every block with pass "pass" in three ways, and read each back in three ways. */
+static int check_disk(struct disk *d, int pass) {
+    static char buffers[EXTENTS * RUN][BLOCK_SIZE];
+    char *bufs[EXTENTS * RUN];
+    struct disk_extent extents[EXTENTS];
+    int i, way;
+
+    for (i = 0; i < EXTENTS * RUN; i++) bufs[i] = buffers[i];
+    for (way = 0; way < 3; way++) {
+        // Each way writes its own third of the disk's first blocks, in runs spaced a run apart.
+        int base = way * EXTENTS * RUN * 2;
+        for (i = 0; i < EXTENTS * RUN; i++) test_fill_block(base + i / RUN * RUN * 2 + i % RUN, pass, buffers[i]);
+        for (i = 0; i < EXTENTS; i++) {
+            int first = base + i * RUN * 2, j;
+            extents[i].block = first;
+            extents[i].count = RUN;
+            extents[i].data = &bufs[i * RUN];
+            extents[i].write = 1;
+            if (way == 0) {
+                for (j = 0; j < RUN; j++) disk_write(d, first + j, bufs[i * RUN + j]);
+            } else if (way == 1) {
+                disk_writev(d, first, RUN, (const char *const *)&bufs[i * RUN]);
+            }
+        }
+        if (way == 2) disk_transfer_batch(d, extents, EXTENTS);
+    }
+
+    for (way = 0; way < 3; way++) {
+        // Each way reads a third it did not write.
+        int base = (way + 1) % 3 * EXTENTS * RUN * 2;
+        memset(buffers, 0, sizeof(buffers));
+        for (i = 0; i < EXTENTS; i++) {
+            int first = base + i * RUN * 2, j;
+            extents[i].block = first;
+            extents[i].count = RUN;
+            extents[i].data = &bufs[i * RUN];
+            extents[i].write = 0;
+            if (way == 0) {
+                for (j = 0; j < RUN; j++) disk_read(d, first + j, bufs[i * RUN + j]);
+            } else if (way == 1) {
+                disk_readv(d, first, RUN, &bufs[i * RUN]);
+            }
+        }
+        if (way == 2) disk_transfer_batch(d, extents, EXTENTS);
+        for (i = 0; i < EXTENTS * RUN; i++) {
+            if (!test_check_block(disk_backend_name(disk_get_backend(d)), base + i / RUN * RUN * 2 + i % RUN, pass, buffers[i])) return 0;
+        }
+    }
+    return 1;
+}
+
+/* Write blocks through a cache over "d" with pass "pass", sync, and read them back through the cache and the disk. */
+static int check_cache(struct disk *d, int mapped, int pass) {
+    struct bcache_config cfg;
+    char data[BLOCK_SIZE];
+    int i;
+
+    test_config(&cfg, MEMORY_BLOCKS);
+    cfg.mapped = mapped;
+    struct bcache *bc = test_start_cache(d, &cfg);
+    if (!bc) return 0;
+
+    for (i = 0; i < CACHED_BLOCKS; i++) {
+        test_fill_block(i, pass, data);
+        bcache_write(bc, i, data);
+    }
+    for (i = 0; i < CACHED_BLOCKS; i++) {
+        bcache_read(bc, i, data);
+        if (!test_check_block(mapped ? "mapped cache" : "cache", i, pass, data)) return 0;
+    }
+    bcache_sync(bc);
+    for (i = 0; i < CACHED_BLOCKS; i++) {
+        disk_read(d, i, data);
+        if (!test_check_block(mapped ? "disk under a mapped cache" : "disk under a cache", i, pass, data)) return 0;
+    }
+    return 1;
+}
+
+int main(void) {
+    int i;
+
+    for (i = 0; i < (int)(sizeof(backends) / sizeof(backends[0])); i++) {
+        const char *name = disk_backend_name(backends[i].backend);
+        struct disk *d = disk_open_backend("backendtripdisk", DISK_BLOCKS, backends[i].backend, backends[i].depth);
+        if (!d) {
+            fprintf(stderr, "couldn't open backendtripdisk as %s\n", name);
+            return 1;
+        }
+        // Only what the blocks hold matters here, not how long it takes.
+        disk_set_delay(d, 0);
+        if (!check_disk(d, 1) || !check_cache(d, 0, 2)) return 1;
+        disk_close(d);
+        printf("%s disk read back every block\n", name);
+    }
+
+    struct disk *d = disk_open_mapped("backendtripdisk", DISK_BLOCKS);
+    if (!d) {
+        fprintf(stderr, "couldn't map backendtripdisk\n");
+        return 1;
+    }
+    disk_set_delay(d, 0);
+    if (!check_cache(d, 1, 3)) return 1;
+    printf("mapped cache read back every block\n");
+
+    disk_close(d);
+    printf("ok\n");
+    return 0;
+}
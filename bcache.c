@@ -4,8 +4,12 @@ You should make all of your changes here.
 Feel free to add any structures, types or helper functions that you need.
 */
 
+#define _XOPEN_SOURCE 700
+
 #include "bcache.h"
 #include "disk.h"
+#include "histo.h"
+#include "topology.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -24,6 +28,9 @@ You may add and modify this structure as needed.
 #include <pthread.h>
 #include <string.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <time.h>
+#include <errno.h>
 
 typedef enum {
     BLOCK_FREE,      // Block is free and not currently being used.
@@ -34,192 +41,2925 @@ typedef enum {
 } block_state;
 
 struct block {
-    int blocknum;                // Disk block number
+    int blocknum;                // Disk block number; protected by its bucket lock
     block_state state;           // Current state of the block
-    char data[4096];             // Data storage for the block
+    int refcount;                // Threads currently using the block; protected by its bucket lock
+    int prefetched;              // PREFETCH_AHEAD or PREFETCH_WARM if not asked for and not used yet, else 0; protected by lock
+    int cold;                    // Inserted cold, by the admission policy or read-ahead, and not hit since; protected by its bucket lock
+    char *data;                  // This frame's 4KB slot in the data arena, or with mapped frames its block's mapped page
     pthread_mutex_t lock;        // Protects this block structure
     pthread_cond_t cond;         // Condition variable for state changes
-    struct block *next;          // Next block in the linked list
+    struct evict_node evict;     // Position in the eviction policy; protected by its shard's cache_lock
+    struct shard *shard;         // Shard the frame belongs to
+    struct block *hash_next;     // Next block in the same bucket, or on the free frame list
+    int readers;                 // Read-only pins held on the frame; protected by lock
+    int writer;                  // A writable pin is held on the frame; protected by lock
+    unsigned seq;                // Odd while the data is being changed; see read_optimistic
+    struct bcache_request *async; // Asynchronous requests waiting for a read or a pin; protected by lock
+    unsigned long wb_started;    // Writebacks that have copied the data out; protected by lock
+    unsigned long wb_done;       // Writebacks that have reached the disk; protected by lock
+};
+
+/* Why a block came in without anyone asking for it. */
+#define PREFETCH_AHEAD 1         // Read-ahead of a sequential stream
+#define PREFETCH_WARM 2          // Warm-up from a saved state; its use says nothing about any stream
+
+#define EVICT_TO_BLOCK(n) ((struct block *)((char *)(n) - offsetof(struct block, evict)))
+
+/*
+A sequential stream seen by read-ahead.  "next" is the block the stream is
+expected to read next, and blocks up to "ra_end" have already been requested.
+*/
+struct ra_stream {
+    int next;                    // Block that continues the stream
+    int ra_end;                  // One past the last block already read ahead
+    int window;                  // Current read-ahead size in blocks
+    int run;                     // Consecutive sequential reads seen
+    unsigned long used;          // ra_clock value when the stream was last advanced
+};
+
+/*
+An asynchronous read or write.  It holds a reference on its block from submission
+until completion, so the frame cannot be evicted in between.
+*/
+struct bcache_request {
+    struct bcache *bc;           // Cache the request was made on
+    struct block *blk;           // Block being transferred
+    io_type type;                // Copy out of the block, or into it
+    char *buffer;                // Caller's 4KB; only read from for writes
+    bcache_callback callback;    // Called on completion, or null
+    void *arg;                   // Passed to the callback
+    int done;                    // Set once the copy has happened; protected by lock
+    int detached;                // Freed by the caller before completion; protected by lock
+    pthread_mutex_t lock;        // Protects done and detached
+    pthread_cond_t cond;         // Signalled when the request completes
+    struct bcache_request *next; // Next request waiting on the same block, or the next sync
+    struct sync_target *targets; // A sync: the writebacks it waits for, in frame order
+    int ntargets;                // Number of targets
+    int remaining;               // Targets not yet on disk; protected by sync_lock
+};
+
+/*
+A block a sync waits for, and the writeback count that puts the data it saw on disk.
+"gen" drops to 0 once that writeback has finished.
+*/
+struct sync_target {
+    struct block *blk;
+    unsigned long gen;
+};
+
+#define DIRTY_PAUSE_MS 10        // Throttling pause per block over the high watermark, about one writeback
+#define DIRTY_MAX_PAUSE_MS 200   // Longest a writer is throttled at once
+
+#define RA_STREAMS 8             // Streams tracked at once
+#define RA_TRIGGER 3             // Back-to-back sequential reads before read-ahead starts
+#define RA_MIN_WINDOW 4          // Initial read-ahead window
+
+/* The counters behind bcache_get_stats. */
+typedef enum {
+    STAT_READS,
+    STAT_WRITES,
+    STAT_HITS,
+    STAT_MISSES,
+    STAT_EVICTIONS,
+    STAT_ADMITTED,
+    STAT_REJECTED,
+    STAT_WRITEBACKS,
+    STAT_COALESCED,
+    STAT_PREFETCH_ISSUED,
+    STAT_PREFETCH_HITS,
+    STAT_PREFETCH_WASTED,
+    STAT_PREFETCH_DROPPED,
+    STAT_PREFETCH_PROMOTED,
+    STAT_LOCK_WAIT_NS,
+    STAT_JOURNALED,
+    STAT_JOURNAL_RECORDS,
+    STAT_CHECKPOINTS,
+    STAT_THROTTLED,
+    STAT_THROTTLE_NS,
+    STAT_WARMED,
+    NSTATS
+} stat_kind;
+
+/*
+Each thread adds to its own slot, padded out to whole cache lines, so counting
+never bounces a line between cores.  Threads beyond STAT_SLOTS share slots,
+which is why the adds are still atomic.
+*/
+#define STAT_SLOTS 64
+#define CACHE_LINE 64
+
+struct stat_slot {
+    long long counts[NSTATS];
+} __attribute__((aligned(CACHE_LINE)));
+
+/* The latencies the callers' own operations take, which are kept per thread in the same way. */
+#define NCALLER_LATENCY (BCACHE_LATENCY_WRITE + 1)
+
+struct latency_slot {
+    struct histo latency[NCALLER_LATENCY];
+} __attribute__((aligned(CACHE_LINE)));
+
+/* One chain of the block index, with its own lock so that hits on different buckets never contend. */
+struct bucket {
+    pthread_mutex_t lock;        // Protects the chain and the blocknum/refcount of its blocks
+    struct block *head;          // First block hashed to this bucket
+    unsigned evictions;          // Blocks given up from this bucket, so a late copy for the compressed tier can tell it is still the newest
+};
+
+/*
+One partition of the cache.  Every block number belongs to exactly one shard, which
+holds the frames, index, eviction order and counters for it in memory of its own,
+so threads working on different shards never write to a cache line in common.
+An unsharded cache is a single shard holding every frame.
+*/
+struct shard {
+    struct bcache *bc;           // Cache the shard belongs to.
+    int index;                   // Position of the shard in the cache.
+    int node;                    // Memory node the shard's memory was placed on, or -1.
+    struct block *frames;        // Metadata for the shard's frames, allocated up front.
+    char *frame_data;            // Page-aligned arena holding every frame's data, back to back; null if mapped.
+    int nframes;                 // Number of frames in the shard.
+    int first;                   // Cache-wide number of the shard's first frame; shards number their frames in turn.
+    struct block *free_frames;   // Frames that are not in the index.
+    struct bucket *buckets;      // The shard's part of the block index, hashed by block number.
+    unsigned bucket_mask;        // Number of buckets minus one; always a power of two minus one.
+    int frame_waiters;           // Threads looking for a victim frame; updated atomically.
+    int cold_frames;             // Blocks in the index that are cold; updated atomically.
+    struct evict_policy *evict;  // Chooses which block to give up when full.
+    struct admit *admit;         // Decides whether a missed block is worth its victim's place; needs no lock.
+    struct ztier *ztier;         // Compressed copies of clean blocks evicted from the shard, or null; has its own lock.
+    pthread_mutex_t cache_lock;  // Protects the frame lists and the eviction policy.
+    pthread_cond_t frame_cond;   // Signalled when a block may have become evictable.
+    struct stat_slot *stats;     // Per-thread counters of operations on the shard's blocks.
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+The journal is a superblock followed by records, each a header block and the
+data blocks it lists, appended back to back.  The superblock names the sequence
+number of the first record still to be replayed; a record is only replayed if its
+sequence number follows on from the previous one and every checksum matches, so
+a torn append or a record left over from before the last checkpoint ends the log.
+*/
+#define JOURNAL_MAGIC 0x4c4e524au // "JRNL"
+#define JOURNAL_BATCH 64          // Most data blocks in one record
+
+struct journal_header {
+    unsigned magic;              // JOURNAL_MAGIC
+    int count;                   // Data blocks following the header; 0 in the superblock
+    unsigned long long seq;      // Sequence number of this record, or of the first record in the superblock
+    unsigned long long sum;      // Checksum of the header, taken with this field zeroed
+    int blocks[JOURNAL_BATCH];   // Home block of each data block
+    unsigned long long sums[JOURNAL_BATCH]; // Checksum of each data block
+};
+
+/* Blocks waiting for the journal, on the writer's stack until they are committed. */
+struct journal_entry {
+    const int *blocks;           // Home block of each buffer
+    const char *const *buffers;  // Data as it was written into the cache
+    int count;                   // Number of blocks; at most journal_batch
+    int committed;               // The record holding the entry is on disk; protected by journal_lock
+    struct journal_entry *next;  // Next entry waiting, in arrival order
+};
+
+/* The most adjacent requests the scheduler merges into one disk transfer. */
+#define IO_MERGE_MAX 32
+
+/* The most runs a scheduler hands a disk at once, however many transfers the disk can keep in flight. */
+#define IO_DEPTH_MAX 32
+
+/* One run of adjacent requests taken off a disk's queue, and the buffers it transfers. */
+struct io_run {
+    struct io_request reqs[IO_MERGE_MAX];
+    char *data[IO_MERGE_MAX];    // Buffer of each request.
+    int valid[IO_MERGE_MAX];     // 1 if the request is transferred, 0 if dropped, -1 if queued again.
+    int n;                       // Number of requests in the run.
+};
+
+/*
+One disk of the volume, with its own request queue and scheduler thread.
+Queued requests name blocks of this disk, not of the volume, so the queue's
+policy and the merging of adjacent requests work exactly as on a single disk.
+*/
+struct spindle {
+    struct bcache *bc;           // Cache the disk belongs to.
+    int index;                   // Position of the disk in the volume.
+    struct disk *disk;           // The disk itself.
+    struct iosched *queue;       // Pending requests for this disk's scheduler, by priority class.
+    int flushing;                // The scheduler is draining writeback; protected by queue_lock.
+    struct timespec batch_start; // When the first writeback of the current batch was queued.
+    int queue_peak;              // Deepest the request queue has been; protected by queue_lock.
+    int depth;                   // Runs of requests the scheduler hands the disk at once.
+    struct io_run *runs;         // The runs of the transfer batch in progress; owned by the scheduler.
+    char *bounce;                // Block-aligned copies of the blocks being written back, IO_MERGE_MAX per run.
+    int disk_head;               // Block of the most recent disk request; protected by disk_lock.
+    long long transfers;         // Disk transfers performed; protected by disk_lock.
+    long long busy_ns;           // Time spent in those transfers; protected by disk_lock.
+    pthread_mutex_t queue_lock;  // Protects the request queue.
+    pthread_mutex_t disk_lock;   // Serializes access to the disk.
+    pthread_cond_t queue_cond;   // Signalled when the scheduler may have work to do.
 };
 
 struct bcache {
-    struct disk *disk;           // The disk object underlying the cache.
-    struct block *cache;         // Pointer to the first block in the cache.
+    struct volume *volume;       // The disks underlying the cache.
+    int nblocks;                 // Blocks of the volume in use for data, ahead of the journal.
+    int own_volume;              // The volume was made by bcache_create_config and is freed with the cache.
+    struct spindle *spindles;    // One per disk of the volume.
+    int nspindles;               // Number of disks in the volume.
+    struct shard *shards;        // The partitions holding the frames.
+    int nshards;                 // Number of shards.
+    int shard_blocks;            // Consecutive blocks given to each shard in turn, or 0 to hash them.
     int memory_blocks;           // The total number of memory blocks in the cache.
-    int nreads;                  // A running count of read operations.
-    int nwrites;                 // A running count of write operations.
-    pthread_mutex_t cache_lock;  // Mutex for protecting access to the cache.
-    pthread_mutex_t disk_lock;   // Mutex for serializing access to the disk.
+    int mapped;                  // Frames point at the disks' mapped pages instead of an arena of their own.
+    long ztier_bytes;            // Memory for the compressed tier over all shards, or 0 for none.
+    struct stat_slot *stats;     // Per-thread counters not tied to a shard, summed by bcache_get_stats.
+    struct latency_slot *latency_slots; // Per-thread histograms of reads and writes, merged by bcache_get_latency.
+    evict_kind evict_kind;       // The eviction policy selected at creation.
+    admit_kind admit_kind;       // The admission policy selected at creation.
+    int reads_first;             // Let read misses overtake writeback while frames are available.
+    int batch_blocks;            // Queued writebacks that trigger a flush.
+    int batch_ms;                // Age of the oldest queued writeback that triggers a flush.
+    int ra_max;                  // Largest read-ahead window in blocks; 0 disables read-ahead.
+    int prefetch_depth;          // Most read-ahead requests queued per disk; 0 for no limit.
+    struct ra_stream streams[RA_STREAMS]; // Recently seen sequential streams.
+    unsigned long ra_clock;      // Use counter for picking which stream to replace.
+    pthread_mutex_t ra_lock;     // Protects the stream table.
+    struct histo latency[BCACHE_NLATENCY]; // Time taken by disk transfers and requests, in ns; the rest is per thread.
+    FILE *trace;                 // Where disk transfers are logged, or null; protected by trace_lock.
+    pthread_mutex_t trace_lock;  // Serializes lines written to the trace.
+    FILE *record;                // Where block accesses are logged, or null; protected by record_lock.
+    long long record_start;      // When recording started, in ns.
+    pthread_mutex_t record_lock; // Serializes lines written to the access log.
+    int journal_blocks;          // Size of the journal at the end of the volume, or 0 for none.
+    int journal_batch;           // Most blocks one journal record holds.
+    int journal_head;            // Where the next record goes, from the superblock; owned by the leader.
+    unsigned long long journal_seq; // Sequence number of the next record; owned by the leader.
+    int journal_leader;          // A thread is appending or checkpointing; protected by journal_lock.
+    struct journal_entry *journal_pending; // Entries waiting for a record; protected by journal_lock.
+    struct journal_entry **journal_tail;   // Where the next entry is linked in.
+    pthread_mutex_t journal_lock; // Protects the entry queue and the choice of leader.
+    pthread_cond_t journal_cond; // Signalled when the leader steps down.
+    int journal_replayed;        // Blocks restored from the journal when the cache was created.
+    struct bcache_request *syncs; // Syncs waiting for writeback; protected by sync_lock.
+    int nsyncs;                  // Length of that list, read without the lock.
+    pthread_mutex_t sync_lock;   // Protects the sync list and each sync's remaining count.
+    int ndirty;                  // Frames that are dirty or being written; updated atomically.
+    int dirty_low;               // Above this many dirty frames, writeback runs regardless of batching.
+    int dirty_high;              // Above this many, writers are throttled.
+    int dirty_age_ms;            // Oldest a queued writeback may get before it is flushed, or 0 for no limit.
+    int dirty_waiters;           // Writers being throttled; updated atomically.
+    pthread_mutex_t dirty_lock;  // Pairs with dirty_cond.
+    pthread_cond_t dirty_cond;   // Signalled when the dirty count falls to dirty_high.
 };
 
+static int next_thread_index;
+static __thread int thread_index = -1;
+
+/* A small number naming the calling thread, handed out in order of first use. */
+static int my_thread_index(void) {
+    if (thread_index < 0) thread_index = __sync_fetch_and_add(&next_thread_index, 1);
+    return thread_index;
+}
+
+static void slot_add(struct stat_slot *stats, stat_kind kind, long long n) {
+    __sync_fetch_and_add(&stats[my_thread_index() % STAT_SLOTS].counts[kind], n);
+}
+
+static long long slot_sum(struct stat_slot *stats, stat_kind kind) {
+    long long total = 0;
+    int i;
+    for (i = 0; i < STAT_SLOTS; i++) {
+        total += __sync_fetch_and_add(&stats[i].counts[kind], 0);
+    }
+    return total;
+}
+
+static void stat_add(struct bcache *bc, stat_kind kind, long long n) {
+    slot_add(bc->stats, kind, n);
+}
+
+/* Record how long one of the calling thread's reads or writes took. */
+static void latency_add(struct bcache *bc, bcache_latency_kind kind, long long ns) {
+    histo_record(&bc->latency_slots[my_thread_index() % STAT_SLOTS].latency[kind], ns);
+}
+
+/* Count something that happened to one of the shard's blocks. */
+static void shard_add(struct shard *sh, stat_kind kind, long long n) {
+    slot_add(sh->stats, kind, n);
+}
+
+static long long stat_sum(struct bcache *bc, stat_kind kind) {
+    long long total = slot_sum(bc->stats, kind);
+    int i;
+    for (i = 0; i < bc->nshards; i++) total += slot_sum(bc->shards[i].stats, kind);
+    return total;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Lock a mutex, charging any time spent blocked to the lock wait counter. */
+static void lock_mutex(struct bcache *bc, pthread_mutex_t *m) {
+    long long start;
+
+    if (pthread_mutex_trylock(m) == 0) return;
+    start = now_ns();
+    pthread_mutex_lock(m);
+    stat_add(bc, STAT_LOCK_WAIT_NS, now_ns() - start);
+}
+
+void bcache_config_init(struct bcache_config *cfg, int memory_blocks) {
+    cfg->memory_blocks = memory_blocks;
+    cfg->evict_policy = EVICT_LRU;
+    cfg->admit_policy = ADMIT_ALL;
+    cfg->sched_policy = IOSCHED_CLOOK;
+    cfg->reads_first = 1;
+    cfg->batch_blocks = 1;
+    cfg->batch_ms = 0;
+    cfg->readahead_max = 32;
+    cfg->prefetch_depth = 64;
+    cfg->journal_blocks = 0;
+    cfg->dirty_low = 25;
+    cfg->dirty_high = 50;
+    cfg->dirty_age_ms = 5000;
+    cfg->shards = 1;
+    cfg->shard_blocks = 0;
+    cfg->numa = 0;
+    cfg->mapped = 0;
+    cfg->ztier_kb = 0;
+}
+
 struct bcache *bcache_create(struct disk *d, int memory_blocks) {
-    struct bcache *bc = malloc(sizeof(*bc));
+    struct bcache_config cfg;
+    bcache_config_init(&cfg, memory_blocks);
+    return bcache_create_config(d, &cfg);
+}
+
+static void bcache_free(struct bcache *bc) {
+    int i;
+    for (i = 0; bc->shards && i < bc->nshards; i++) {
+        struct shard *sh = &bc->shards[i];
+        if (sh->evict) evict_delete(sh->evict);
+        if (sh->admit) admit_delete(sh->admit);
+        if (sh->ztier) ztier_delete(sh->ztier);
+        free(sh->buckets);
+        free(sh->frames);
+        free(sh->frame_data);
+        free(sh->stats);
+    }
+    free(bc->shards);
+    for (i = 0; bc->spindles && i < bc->nspindles; i++) {
+        if (bc->spindles[i].queue) iosched_delete(bc->spindles[i].queue);
+        free(bc->spindles[i].runs);
+        free(bc->spindles[i].bounce);
+    }
+    free(bc->spindles);
+    if (bc->own_volume) volume_delete(bc->volume);
+    free(bc->stats);
+    free(bc->latency_slots);
+    free(bc);
+}
+
+/*
+Allocate "size" bytes of zeroed memory for a shard.  The memory is page-aligned,
+and placed on the shard's node before it is zeroed, since that first touch is
+what would otherwise decide where its pages live.
+*/
+static void *shard_alloc(struct shard *sh, size_t size) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    void *p;
+
+    // Frame data is also handed to O_DIRECT, so it is never aligned to less than a block.
+    if (pagesize < BLOCK_SIZE) pagesize = BLOCK_SIZE;
+    size = (size + pagesize - 1) / pagesize * pagesize;
+    if (posix_memalign(&p, pagesize, size) != 0) return NULL;
+    if (sh->node >= 0) topology_bind_memory(p, size, sh->node);
+    memset(p, 0, size);
+    return p;
+}
+
+/* Set up shard "index" with "nframes" frames, numbered from "first".  Returns 0 on success, -1 if out of memory. */
+static int shard_init(struct bcache *bc, int index, int first, int nframes, int node) {
+    struct shard *sh = &bc->shards[index];
+    unsigned nbuckets = 1;
+    int i;
+
+    sh->bc = bc;
+    sh->index = index;
+    sh->node = node;
+    sh->nframes = nframes;
+    sh->first = first;
+    sh->free_frames = NULL;
+    sh->frame_waiters = 0;
+    pthread_mutex_init(&sh->cache_lock, NULL);
+    pthread_cond_init(&sh->frame_cond, NULL);
+
+    // At least one bucket per frame keeps the chains short.
+    while (nbuckets < (unsigned)nframes) nbuckets <<= 1;
+    sh->bucket_mask = nbuckets - 1;
+
+    // Block data lives apart from the metadata, unless it lives in the disks' mappings.
+    sh->frame_data = bc->mapped ? NULL : shard_alloc(sh, (size_t)nframes * BLOCK_SIZE);
+    sh->frames = shard_alloc(sh, sizeof(struct block) * nframes);
+    sh->buckets = shard_alloc(sh, sizeof(struct bucket) * nbuckets);
+    sh->stats = shard_alloc(sh, sizeof(struct stat_slot) * STAT_SLOTS);
+    sh->evict = evict_create(bc->evict_kind, nframes);
+    sh->admit = admit_create(bc->admit_kind, nframes);
+    // Each shard gets the share of the tier's memory that it has of the frames.
+    sh->ztier = bc->ztier_bytes > 0 ? ztier_create(bc->ztier_bytes * nframes / bc->memory_blocks, BLOCK_SIZE) : NULL;
+    if ((!sh->frame_data && !bc->mapped) || !sh->frames || !sh->buckets || !sh->stats || !sh->evict || !sh->admit) return -1;
+    if (bc->ztier_bytes > 0 && !sh->ztier) return -1;
+
+    for (i = 0; i < (int)nbuckets; i++) {
+        pthread_mutex_init(&sh->buckets[i].lock, NULL);
+        sh->buckets[i].head = NULL;
+    }
+
+    // Push frames in reverse so the free list hands them out in address order.
+    for (i = nframes - 1; i >= 0; i--) {
+        struct block *blk = &sh->frames[i];
+        blk->blocknum = -1;
+        blk->state = BLOCK_FREE;
+        blk->data = bc->mapped ? NULL : sh->frame_data + (size_t)i * BLOCK_SIZE;
+        blk->shard = sh;
+        pthread_mutex_init(&blk->lock, NULL);
+        pthread_cond_init(&blk->cond, NULL);
+        blk->hash_next = sh->free_frames;
+        sh->free_frames = blk;
+    }
+    return 0;
+}
+
+static int journal_replay(struct bcache *bc);
+
+struct bcache *bcache_create_config(struct disk *d, const struct bcache_config *cfg) {
+    struct volume *v = volume_create(&d, 1, VOLUME_CONCAT, 1);
+    struct bcache *bc;
+
+    if (!v) {
+        fprintf(stderr, "Failed to allocate memory for buffer cache.\n");
+        return NULL;
+    }
+    bc = bcache_create_volume(v, cfg);
+    if (bc) bc->own_volume = 1;
+    else volume_delete(v);
+    return bc;
+}
+
+struct bcache *bcache_create_volume(struct volume *v, const struct bcache_config *cfg) {
+    void *arena = NULL;
+    int i, queues = 0, shards = 0, frames = 0, nodes = cfg->numa ? topology_nodes() : 0;
+
+    struct bcache *bc = calloc(1, sizeof(*bc));
     if (!bc) {
         fprintf(stderr, "Failed to allocate memory for buffer cache.\n");
         return NULL;
     }
 
-    bc->disk = d;
-    bc->memory_blocks = memory_blocks;
-    bc->nreads = 0;
-    bc->nwrites = 0;
-    bc->cache = NULL;
+    bc->volume = v;
+    bc->own_volume = 0;
+    bc->nspindles = volume_ndisks(v);
+    bc->journal_blocks = cfg->journal_blocks > 0 ? cfg->journal_blocks : 0;
+    bc->nblocks = volume_nblocks(v) - bc->journal_blocks;
+    // A record needs a header and a data block behind the superblock.
+    if (bc->journal_blocks > 0 && (bc->journal_blocks < 3 || bc->nblocks < 1)) {
+        fprintf(stderr, "A journal of %d blocks does not fit a volume of %d blocks.\n", bc->journal_blocks, volume_nblocks(v));
+        free(bc);
+        return NULL;
+    }
+    bc->journal_batch = bc->journal_blocks - 2 < JOURNAL_BATCH ? bc->journal_blocks - 2 : JOURNAL_BATCH;
+    // A cache that cannot hold a single block could never make progress.
+    bc->memory_blocks = cfg->memory_blocks > 0 ? cfg->memory_blocks : 1;
+    bc->evict_kind = cfg->evict_policy;
+    bc->admit_kind = cfg->admit_policy;
+    // Every shard needs a frame of its own.
+    bc->nshards = cfg->shards > 1 ? cfg->shards : 1;
+    if (bc->nshards > bc->memory_blocks) bc->nshards = bc->memory_blocks;
+    bc->shard_blocks = cfg->shard_blocks > 0 ? cfg->shard_blocks : 0;
+    bc->mapped = cfg->mapped;
+    bc->ztier_bytes = cfg->ztier_kb > 0 ? (long)cfg->ztier_kb * 1024 : 0;
+    for (i = 0; bc->mapped && i < bc->nspindles; i++) {
+        if (!disk_map(volume_disk(v, i), 0)) {
+            fprintf(stderr, "Mapped frames need every disk opened with disk_open_mapped.\n");
+            free(bc);
+            return NULL;
+        }
+    }
+
+    if (posix_memalign(&arena, CACHE_LINE, sizeof(struct stat_slot) * STAT_SLOTS) != 0) arena = NULL;
+    bc->stats = arena;
+    if (bc->stats) memset(bc->stats, 0, sizeof(struct stat_slot) * STAT_SLOTS);
+    if (posix_memalign(&arena, CACHE_LINE, sizeof(struct latency_slot) * STAT_SLOTS) != 0) arena = NULL;
+    bc->latency_slots = arena;
+    if (bc->latency_slots) memset(bc->latency_slots, 0, sizeof(struct latency_slot) * STAT_SLOTS);
+    if (posix_memalign(&arena, CACHE_LINE, sizeof(struct shard) * bc->nshards) != 0) arena = NULL;
+    bc->shards = arena;
+    if (bc->shards) memset(bc->shards, 0, sizeof(struct shard) * bc->nshards);
+    // The frames are shared out evenly, and the shards go round the memory nodes.
+    while (bc->shards && shards < bc->nshards) {
+        int nframes = bc->memory_blocks / bc->nshards + (shards < bc->memory_blocks % bc->nshards);
+        if (shard_init(bc, shards, frames, nframes, nodes > 0 ? shards % nodes : -1) < 0) break;
+        frames += nframes;
+        shards++;
+    }
+    bc->spindles = calloc(bc->nspindles, sizeof(struct spindle));
+    while (bc->spindles && queues < bc->nspindles) {
+        struct spindle *sp = &bc->spindles[queues];
+        // A disk that keeps several transfers in flight gets that many runs at a time.
+        sp->depth = disk_depth(volume_disk(v, queues)) < IO_DEPTH_MAX ? disk_depth(volume_disk(v, queues)) : IO_DEPTH_MAX;
+        if (sp->depth < 1) sp->depth = 1;
+        sp->queue = iosched_create(cfg->sched_policy);
+        sp->runs = calloc(sp->depth, sizeof(struct io_run));
+        if (posix_memalign(&arena, BLOCK_SIZE, (size_t)sp->depth * IO_MERGE_MAX * BLOCK_SIZE) != 0) arena = NULL;
+        sp->bounce = arena;
+        if (!sp->queue || !sp->runs || !sp->bounce) break;
+        queues++;
+    }
+    bc->reads_first = cfg->reads_first;
+    bc->batch_blocks = cfg->batch_blocks > 0 ? cfg->batch_blocks : 1;
+    bc->batch_ms = cfg->batch_ms > 0 ? cfg->batch_ms : 0;
+    bc->ndirty = 0;
+    bc->dirty_low = (long long)bc->memory_blocks * (cfg->dirty_low > 0 ? cfg->dirty_low : 0) / 100;
+    bc->dirty_high = (long long)bc->memory_blocks * (cfg->dirty_high > 0 ? cfg->dirty_high : 0) / 100;
+    if (bc->dirty_high < bc->dirty_low) bc->dirty_high = bc->dirty_low;
+    bc->dirty_age_ms = cfg->dirty_age_ms > 0 ? cfg->dirty_age_ms : 0;
+    // Never let read-ahead claim more than a quarter of the cache, or of a shard, since a stream may stay in one.
+    bc->ra_max = cfg->readahead_max < bc->memory_blocks / bc->nshards / 4 ? cfg->readahead_max : bc->memory_blocks / bc->nshards / 4;
+    if (bc->ra_max < 0) bc->ra_max = 0;
+    bc->prefetch_depth = cfg->prefetch_depth > 0 ? cfg->prefetch_depth : 0;
+    for (i = 0; i < RA_STREAMS; i++) {
+        bc->streams[i].next = -1;
+        bc->streams[i].used = 0;
+    }
+    if (!bc->stats || !bc->latency_slots || shards < bc->nshards || queues < bc->nspindles) {
+        fprintf(stderr, "Failed to allocate %d cache frames.\n", bc->memory_blocks);
+        bcache_free(bc);
+        return NULL;
+    }
+
+    pthread_mutex_init(&bc->ra_lock, NULL);
+    for (i = 0; i < BCACHE_NLATENCY; i++) {
+        histo_init(&bc->latency[i]);
+    }
+    bc->trace = NULL;
+    pthread_mutex_init(&bc->trace_lock, NULL);
+    bc->record = NULL;
+    pthread_mutex_init(&bc->record_lock, NULL);
+
+    // Batch deadlines are measured on the monotonic clock so wall clock steps can't stall writeback.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for (i = 0; i < bc->nspindles; i++) {
+        struct spindle *sp = &bc->spindles[i];
+        sp->bc = bc;
+        sp->index = i;
+        sp->disk = volume_disk(v, i);
+        pthread_mutex_init(&sp->queue_lock, NULL);
+        pthread_mutex_init(&sp->disk_lock, NULL);
+        pthread_cond_init(&sp->queue_cond, &attr);
+    }
+    pthread_condattr_destroy(&attr);
 
-    pthread_mutex_init(&bc->cache_lock, NULL);
-    pthread_mutex_init(&bc->disk_lock, NULL);
+    bc->journal_pending = NULL;
+    bc->journal_tail = &bc->journal_pending;
+    pthread_mutex_init(&bc->journal_lock, NULL);
+    pthread_cond_init(&bc->journal_cond, NULL);
+    bc->syncs = NULL;
+    bc->nsyncs = 0;
+    pthread_mutex_init(&bc->sync_lock, NULL);
+    bc->dirty_waiters = 0;
+    pthread_mutex_init(&bc->dirty_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&bc->dirty_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (bc->journal_blocks > 0 && journal_replay(bc) < 0) {
+        bcache_free(bc);
+        return NULL;
+    }
 
     return bc;
 }
 
-struct block *find_or_create_block(struct bcache *bc, int blocknum) {
-    struct block *blk = bc->cache;
-    while (blk) {
+/*
+The shard that owns "blocknum": runs of shard_blocks blocks go to the shards in turn,
+or without shard_blocks a hash spreads the blocks, independent of the bucket hash.
+*/
+static struct shard *shard_for(struct bcache *bc, int blocknum) {
+    unsigned h;
+
+    if (bc->nshards == 1) return &bc->shards[0];
+    if (bc->shard_blocks > 0) return &bc->shards[(unsigned)blocknum / bc->shard_blocks % bc->nshards];
+    h = (unsigned)blocknum * 0x85ebca6bu;
+    h ^= h >> 13;
+    return &bc->shards[h % bc->nshards];
+}
+
+static struct bucket *bucket_for(struct shard *sh, int blocknum) {
+    unsigned h = (unsigned)blocknum * 2654435761u;
+    h ^= h >> 16;
+    return &sh->buckets[h & sh->bucket_mask];
+}
+
+/* Must be called with the bucket's lock held. */
+static struct block *bucket_lookup(struct bucket *b, int blocknum) {
+    struct block *blk;
+    for (blk = b->head; blk; blk = blk->hash_next) {
         if (blk->blocknum == blocknum) return blk;
-        blk = blk->next;
     }
+    return NULL;
+}
 
-    // Create new block if not found
-    blk = malloc(sizeof(struct block));
-    if (!blk) {
-        fprintf(stderr, "Failed to allocate block.\n");
-        return NULL;
+static void bucket_unlink(struct bucket *b, struct block *blk) {
+    struct block **pp = &b->head;
+    while (*pp != blk) pp = &(*pp)->hash_next;
+    *pp = blk->hash_next;
+    blk->hash_next = NULL;
+}
+
+/* What a miss looking for a frame knows about the victims offered to it. */
+struct claim {
+    struct shard *sh;
+    int candidate;               // The block the frame is for, or -1 to take any victim
+    int verdict;                 // -1 until the candidate is judged, then whether it beat the block it was judged against
+    int cold_only;               // Only look at blocks that were never admitted
+    int stash;                   // Set if the block claimed was clean, and the shard has a compressed tier to keep it in
+    unsigned stamp;              // Its bucket's evictions once it was given up
+};
+
+/* Mark a block cold or not, keeping its shard's count.  Called with the block's bucket lock held. */
+static void set_cold(struct block *blk, int cold) {
+    if (blk->cold == cold) return;
+    blk->cold = cold;
+    __sync_fetch_and_add(&blk->shard->cold_frames, cold ? 1 : -1);
+}
+
+/*
+Whether a miss must pass over block "blk" rather than evict it, because the admission
+policy rates it above the block the frame is for.  Only the first block offered that was
+admitted is judged; once the newcomer has lost, only the frames of blocks that were never
+admitted are given up to it.  Called with the block's bucket lock held.
+*/
+static int passed_over(struct claim *c, struct block *blk) {
+    if (c->cold_only) return !blk->cold;
+    if (c->candidate < 0 || blk->cold) return 0;
+    if (c->verdict < 0) c->verdict = admit_allow(c->sh->admit, c->candidate, blk->blocknum);
+    return !c->verdict;
+}
+
+/*
+Claim a victim chosen by the eviction policy.  A block may only be given up
+if nobody is using it, its contents already match the disk, and the admission
+policy does not rate it above the block its frame is wanted for.  Dirty blocks
+are left for the I/O scheduler to write out; once it has, they become
+evictable on a later pass.  On success the block is removed from the index, and
+a clean one is noted for get_frame to compress once the locks are released.
+Called with the shard's cache_lock held.
+*/
+static int claim_block(struct evict_node *n, void *arg) {
+    struct claim *c = arg;
+    struct shard *sh = c->sh;
+    struct bcache *bc = sh->bc;
+    struct block *blk = EVICT_TO_BLOCK(n);
+    struct bucket *b = bucket_for(sh, blk->blocknum);
+    int ok = 0;
+
+    // Most blocks are not cold, so look before taking the bucket lock, and again after.
+    if (c->cold_only && !blk->cold) return 0;
+    lock_mutex(bc, &b->lock);
+    if (blk->refcount == 0 && !passed_over(c, blk)) {
+        lock_mutex(bc, &blk->lock);
+        ok = (blk->state == BLOCK_FREE || blk->state == BLOCK_READY);
+        if (ok && blk->state == BLOCK_READY) shard_add(sh, STAT_EVICTIONS, 1);
+        if (ok && blk->prefetched) {
+            blk->prefetched = 0;
+            shard_add(sh, STAT_PREFETCH_WASTED, 1);
+        }
+        pthread_mutex_unlock(&blk->lock);
+        if (ok) {
+            c->stash = blk->state == BLOCK_READY && sh->ztier;
+            c->stamp = ++b->evictions;
+            bucket_unlink(b, blk);
+            set_cold(blk, 0);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    return ok;
+}
+
+/*
+Judge a miss against the first block the policy offers that was admitted, without
+claiming anything.  A newcomer that recycles a cold frame is only admitted if it beats
+the block it would otherwise have pushed out, not just the cold one.
+*/
+static int judge_block(struct evict_node *n, void *arg) {
+    struct claim *c = arg;
+    struct block *blk = EVICT_TO_BLOCK(n);
+    // The block stays tracked, so its number cannot change while we hold the cache_lock.
+    if (blk->cold) return 0;
+    c->verdict = admit_allow(c->sh->admit, c->candidate, blk->blocknum);
+    return 1;
+}
+
+/*
+Take a victim of shard "sh" for block "candidate", or for no block in particular if it
+is -1.  A miss takes the frame of a block that was never admitted first, wherever the
+policy keeps it, and only then asks the policy for its victim.  A frame is only taken
+from a block the admission policy rates above the candidate if no frame of a block that
+was never admitted is free, since a miss needs a frame to read into.  "admitted" is set
+to whether the candidate beat the policy's victim, and so whether it should be inserted
+warm.  "out" is filled in with what claim_block found.  Returns null if nothing can be
+evicted right now.  Called with the shard's cache_lock held.
+*/
+static struct block *take_victim(struct shard *sh, int candidate, int *admitted, struct claim *out) {
+    struct claim c = { sh, candidate, -1, 0, 0, 0 };
+    struct evict_node *victim = NULL;
+    struct block *blk;
+
+    if (candidate >= 0 && __sync_fetch_and_add(&sh->cold_frames, 0) > 0) {
+        c.cold_only = 1;
+        victim = evict_victim(sh->evict, claim_block, &c);
+        c.cold_only = 0;
     }
-    blk->blocknum = blocknum;
-    blk->state = BLOCK_FREE;
-    pthread_mutex_init(&blk->lock, NULL);
-    pthread_cond_init(&blk->cond, NULL);
-    blk->next = bc->cache;
-    bc->cache = blk;
+    if (victim) {
+        evict_victim(sh->evict, judge_block, &c);
+    } else {
+        victim = evict_victim(sh->evict, claim_block, &c);
+        if (!victim && c.verdict == 0) {
+            c.candidate = -1;
+            victim = evict_victim(sh->evict, claim_block, &c);
+        }
+    }
+    if (!victim) return NULL;
+    blk = EVICT_TO_BLOCK(victim);
+    evict_remove(sh->evict, victim);
+    // With nothing admitted to judge against, judge the newcomer against the block it displaces.
+    if (c.verdict < 0) c.verdict = candidate < 0 || admit_allow(sh->admit, candidate, blk->blocknum);
+    if (admitted) *admitted = c.verdict;
+    *out = c;
     return blk;
 }
 
-void bcache_read(struct bcache *bc, int blocknum, char *data) {
+/* Wake every disk's scheduler, so that any writeback it is holding back is reconsidered. */
+static void kick_schedulers(struct bcache *bc) {
+    int i;
+    for (i = 0; i < bc->nspindles; i++) {
+        struct spindle *sp = &bc->spindles[i];
+        lock_mutex(bc, &sp->queue_lock);
+        pthread_cond_signal(&sp->queue_cond);
+        pthread_mutex_unlock(&sp->queue_lock);
+    }
+}
+
+/*
+Keep a compressed copy of a clean victim in its shard's tier, once no cache lock is held.
+The frame is still the caller's alone, so its data is still the victim's.  A miss on the
+victim meanwhile finds it in neither place and reads the disk, which is as current, and
+the copy is then dropped: it is only kept if the victim is not back in the index and
+nothing has left its bucket since it did, so that it cannot replace a newer copy.
+*/
+static void stash_victim(struct shard *sh, struct block *frame, unsigned stamp) {
+    struct bucket *b = bucket_for(sh, frame->blocknum);
+    char packed[BLOCK_SIZE];
+    int len = ztier_pack(sh->ztier, frame->data, packed);
+
+    lock_mutex(sh->bc, &b->lock);
+    if (b->evictions == stamp && !bucket_lookup(b, frame->blocknum)) ztier_put_packed(sh->ztier, frame->blocknum, packed, len);
+    pthread_mutex_unlock(&b->lock);
+}
+
+/*
+Take a frame of shard "sh" that is not in the index for block "candidate", or -1 for
+no block in particular: one off the free list, or an evicted one, as take_victim chooses.
+A block only ever lives in its own shard's frames.  When every frame is dirty or in use,
+waits on frame_cond if "wait" is set, and otherwise returns null.  If "admitted" is given,
+it is set to -1 if the frame was free, and otherwise to whether the candidate beat the victim.
+A clean victim is compressed into the tier on the way out, after the cache_lock is released.
+*/
+static struct block *get_frame(struct shard *sh, int wait, int candidate, int *admitted) {
+    struct bcache *bc = sh->bc;
     struct block *blk = NULL;
+    struct claim c = { sh, candidate, -1, 0, 0, 0 };
 
-    pthread_mutex_lock(&bc->cache_lock);
-    blk = find_or_create_block(bc, blocknum);
-    pthread_mutex_unlock(&bc->cache_lock);
+    lock_mutex(bc, &sh->cache_lock);
+    while (!blk) {
+        if (sh->free_frames) {
+            blk = sh->free_frames;
+            sh->free_frames = blk->hash_next;
+            if (admitted) *admitted = -1;
+            break;
+        }
 
-    pthread_mutex_lock(&blk->lock);
-    if (blk->state == BLOCK_FREE || blk->state == BLOCK_DIRTY) {
-        blk->state = BLOCK_READING;
-        pthread_mutex_unlock(&blk->lock);
+        if (!wait) {
+            blk = take_victim(sh, candidate, admitted, &c);
+            break;
+        }
 
-        pthread_mutex_lock(&bc->disk_lock);
-        disk_read(bc->disk, blocknum, blk->data);
-        pthread_mutex_unlock(&bc->disk_lock);
+        // Announce ourselves before scanning so a release during the scan will wake us.
+        __sync_fetch_and_add(&sh->frame_waiters, 1);
+        blk = take_victim(sh, candidate, admitted, &c);
+        if (!blk) {
+            // Only writeback can clean a frame for us, so don't let it sit in a batch.
+            kick_schedulers(bc);
+            pthread_cond_wait(&sh->frame_cond, &sh->cache_lock);
+        }
+        __sync_fetch_and_sub(&sh->frame_waiters, 1);
+    }
+    pthread_mutex_unlock(&sh->cache_lock);
+    if (blk && c.stash) stash_victim(sh, blk, c.stamp);
+    return blk;
+}
 
-        pthread_mutex_lock(&blk->lock);
-        blk->state = BLOCK_READY;
-        pthread_cond_broadcast(&blk->cond);
+/* Return an unused frame taken by get_frame. */
+static void put_frame(struct block *blk) {
+    struct shard *sh = blk->shard;
+    lock_mutex(sh->bc, &sh->cache_lock);
+    blk->hash_next = sh->free_frames;
+    sh->free_frames = blk;
+    if (sh->frame_waiters > 0) {
+        pthread_cond_broadcast(&sh->frame_cond);
     }
+    pthread_mutex_unlock(&sh->cache_lock);
+}
 
-    while (blk->state != BLOCK_READY) {
-        pthread_cond_wait(&blk->cond, &blk->lock);
+/* Wake threads in get_frame on the block's shard if there are any, since the block may have just become evictable. */
+static void wake_shard_waiters(struct shard *sh) {
+    if (__sync_fetch_and_add(&sh->frame_waiters, 0) > 0) {
+        lock_mutex(sh->bc, &sh->cache_lock);
+        pthread_cond_broadcast(&sh->frame_cond);
+        pthread_mutex_unlock(&sh->cache_lock);
     }
+}
 
-    memcpy(data, blk->data, 4096);
-    pthread_mutex_unlock(&blk->lock);
-    __sync_fetch_and_add(&bc->nreads, 1);
+/* Whether any thread is stuck waiting for a clean frame, in any shard. */
+static int frames_starved(struct bcache *bc) {
+    int i;
+    for (i = 0; i < bc->nshards; i++) {
+        if (__sync_fetch_and_add(&bc->shards[i].frame_waiters, 0) > 0) return 1;
+    }
+    return 0;
 }
 
-void bcache_write(struct bcache *bc, int blocknum, const char *data) {
-    pthread_mutex_lock(&bc->cache_lock);
-    struct block *blk = find_or_create_block(bc, blocknum);
-    pthread_mutex_unlock(&bc->cache_lock);
+/*
+Tell the eviction policy about a hit.  Only the block's reference bit is set, and
+the next victim scan to pass the block applies it, so a hit never goes near the
+shard's cache_lock, not even to try it.  A block still cold has only been asked for
+by the miss that brought it in, so that miss waiting for it does not count as a hit.
+*/
+static void touch_block(struct block *blk) {
+    if (!blk->cold) evict_touch_later(&blk->evict);
+}
 
-    pthread_mutex_lock(&blk->lock);
-    memcpy(blk->data, data, 4096);
-    blk->state = BLOCK_DIRTY;
-    pthread_mutex_unlock(&blk->lock);
-    __sync_fetch_and_add(&bc->nwrites, 1);
+static struct spindle *spindle_for(struct bcache *bc, int blocknum, int *pblock);
+
+/*
+Give a frame taken by get_frame to block "blocknum".  With mapped frames the
+frame's data becomes the block's page in its disk's mapping, so reads and
+writebacks of the frame leave the data where it is.
+*/
+static void bind_frame(struct bcache *bc, struct block *frame, int blocknum) {
+    int pblock;
+    frame->blocknum = blocknum;
+    if (bc->mapped) {
+        struct spindle *sp = spindle_for(bc, blocknum, &pblock);
+        frame->data = disk_map(sp->disk, pblock);
+    }
 }
 
-void bcache_sync(struct bcache *bc) {
-    struct block *blk;
-    pthread_mutex_lock(&bc->cache_lock);
-    blk = bc->cache;
-    while (blk) {
-        pthread_mutex_lock(&blk->lock);
-        if (blk->state == BLOCK_DIRTY) {
-            blk->state = BLOCK_WRITING;
-            pthread_mutex_unlock(&blk->lock);
-            pthread_mutex_lock(&bc->disk_lock);
-            disk_write(bc->disk, blk->blocknum, blk->data);
-            pthread_mutex_unlock(&bc->disk_lock);
-            pthread_mutex_lock(&blk->lock);
-            blk->state = BLOCK_READY;
-        }
-        pthread_cond_broadcast(&blk->cond);
-        pthread_mutex_unlock(&blk->lock);
-        blk = blk->next;
+/*
+Fill a frame just given to block "blocknum" from the compressed tier, if the tier has it.
+Returns 1 if the frame now holds the block's data.  Called with the block's bucket lock held,
+so nobody can see the frame before it is filled; taking the block out of the tier as it goes
+into the frame means the tier never has a copy that a write to the frame leaves stale.
+*/
+static int fill_from_tier(struct shard *sh, struct block *frame, int blocknum) {
+    return sh->ztier && ztier_take(sh->ztier, blocknum, frame->data);
+}
+
+/*
+Find the block for "blocknum", creating it if needed, and take a reference on it.
+Hits only take the lock of the block's bucket.  Misses drop that lock while they
+find a frame, then check again in case another thread inserted the block meanwhile.
+The admission policy is asked before a victim is evicted, and a new block that does
+not beat the victim it is offered takes a frame of a block that was never admitted
+instead, and is inserted cold itself, so scans and one-off accesses recycle each
+other's frames, not the working set's.
+A new block found in the compressed tier is returned READY, like a hit.
+If no frame is available and "wait" is clear, returns null instead of waiting.
+*/
+struct block *find_or_create_block(struct bcache *bc, int blocknum, int wait) {
+    struct shard *sh = shard_for(bc, blocknum);
+    struct bucket *b = bucket_for(sh, blocknum);
+    struct block *blk, *frame;
+    int admitted;
+
+    admit_record(sh->admit, blocknum);
+    lock_mutex(bc, &b->lock);
+    blk = bucket_lookup(b, blocknum);
+    if (blk) {
+        blk->refcount++;
+        set_cold(blk, 0);
+        pthread_mutex_unlock(&b->lock);
+        touch_block(blk);
+        return blk;
     }
-    pthread_mutex_unlock(&bc->cache_lock);
+    pthread_mutex_unlock(&b->lock);
+
+    frame = get_frame(sh, wait, blocknum, &admitted);
+    if (!frame) return NULL;
+
+    lock_mutex(bc, &b->lock);
+    blk = bucket_lookup(b, blocknum);
+    if (blk) {
+        blk->refcount++;
+        set_cold(blk, 0);
+        pthread_mutex_unlock(&b->lock);
+        put_frame(frame);
+        touch_block(blk);
+        return blk;
+    }
+    bind_frame(bc, frame, blocknum);
+    frame->state = fill_from_tier(sh, frame, blocknum) ? BLOCK_READY : BLOCK_FREE;
+    frame->refcount = 1;
+    frame->prefetched = 0;
+    set_cold(frame, admitted == 0);
+    frame->hash_next = b->head;
+    b->head = frame;
+    pthread_mutex_unlock(&b->lock);
+
+    // Only a block that pushes another out is judged; free frames cost nothing.
+    if (admitted >= 0) shard_add(sh, admitted ? STAT_ADMITTED : STAT_REJECTED, 1);
+    lock_mutex(bc, &sh->cache_lock);
+    if (admitted) evict_insert(sh->evict, &frame->evict);
+    else evict_insert_cold(sh->evict, &frame->evict);
+    pthread_mutex_unlock(&sh->cache_lock);
+    return frame;
 }
 
-void *bcache_io_scheduler(void *vbc) {
-    struct bcache *bc = (struct bcache *)vbc;
-    while (1) {
-        struct block *blk = NULL;
-        int found = 0;
-
-        pthread_mutex_lock(&bc->cache_lock);
-        for (blk = bc->cache; blk != NULL; blk = blk->next) {
-            pthread_mutex_lock(&blk->lock);
-            if (blk->state == BLOCK_DIRTY) {
-                blk->state = BLOCK_WRITING;
-                pthread_mutex_unlock(&blk->lock);
+/* Drop the reference taken by find_or_create_block. */
+static void release_block(struct bcache *bc, struct block *blk) {
+    struct bucket *b = bucket_for(blk->shard, blk->blocknum);
+    int idle;
 
-                pthread_mutex_lock(&bc->disk_lock);
-                disk_write(bc->disk, blk->blocknum, blk->data);
-                pthread_mutex_unlock(&bc->disk_lock);
+    lock_mutex(bc, &b->lock);
+    idle = (--blk->refcount == 0);
+    pthread_mutex_unlock(&b->lock);
 
-                pthread_mutex_lock(&blk->lock);
-                blk->state = BLOCK_READY;
-                pthread_cond_broadcast(&blk->cond);
-                found = 1;
-            }
-            pthread_mutex_unlock(&blk->lock);
-            if (found) break;
-        }
-        pthread_mutex_unlock(&bc->cache_lock);
+    if (idle) wake_shard_waiters(blk->shard);
+}
+
+/*
+Perform one transfer of "count" consecutive blocks of one disk starting at its block
+"blocknum", where data[i] is the buffer of blocknum+i, keeping track of where it leaves the head.
+"queued" is when the transfer was requested, so the trace can tell queueing from service.
+*/
+static void disk_io(struct spindle *sp, io_type type, int blocknum, int count, char *const *data, long long queued) {
+    struct bcache *bc = sp->bc;
+    long long start, end;
+
+    pthread_mutex_lock(&sp->disk_lock);
+    start = now_ns();
+    if (count == 1 && type == IO_READ) {
+        disk_read(sp->disk, blocknum, data[0]);
+    } else if (count == 1) {
+        disk_write(sp->disk, blocknum, data[0]);
+    } else if (type == IO_READ) {
+        disk_readv(sp->disk, blocknum, count, data);
+    } else {
+        disk_writev(sp->disk, blocknum, count, (const char *const *)data);
+    }
+    end = now_ns();
+    histo_record(&bc->latency[type == IO_READ ? BCACHE_LATENCY_DISK_READ : BCACHE_LATENCY_DISK_WRITE], end - start);
+    pthread_mutex_lock(&bc->trace_lock);
+    if (bc->trace) {
+        fprintf(bc->trace, "%c %d %d %d %lld %d %lld\n", type == IO_READ ? 'R' : 'W', sp->index, blocknum, count, start - queued, blocknum - sp->disk_head, end - start);
+    }
+    pthread_mutex_unlock(&bc->trace_lock);
+    sp->disk_head = blocknum + count - 1;
+    sp->transfers++;
+    sp->busy_ns += end - start;
+    pthread_mutex_unlock(&sp->disk_lock);
+}
+
+/*
+Perform "n" transfers of one disk in one batch, which a disk with a queue depth above
+one keeps in flight together.  Each transfer is traced and counted like one from disk_io,
+with the time the whole batch took; queued[i] is when extents[i] was requested.
+*/
+static void disk_io_batch(struct spindle *sp, const struct disk_extent *extents, const long long *queued, int n) {
+    struct bcache *bc = sp->bc;
+    long long start, end;
+    int i;
 
-        if (!found) {
-            sched_yield();  // Yield the processor to reduce busy waiting
+    pthread_mutex_lock(&sp->disk_lock);
+    start = now_ns();
+    disk_transfer_batch(sp->disk, extents, n);
+    end = now_ns();
+    pthread_mutex_lock(&bc->trace_lock);
+    for (i = 0; i < n; i++) {
+        const struct disk_extent *e = &extents[i];
+        histo_record(&bc->latency[e->write ? BCACHE_LATENCY_DISK_WRITE : BCACHE_LATENCY_DISK_READ], end - start);
+        if (bc->trace) {
+            fprintf(bc->trace, "%c %d %d %d %lld %d %lld\n", e->write ? 'W' : 'R', sp->index, e->block, e->count, start - queued[i], e->block - sp->disk_head, end - start);
         }
+        sp->disk_head = e->block + e->count - 1;
+    }
+    pthread_mutex_unlock(&bc->trace_lock);
+    sp->transfers += n;
+    sp->busy_ns += end - start;
+    pthread_mutex_unlock(&sp->disk_lock);
+}
+
+/* The disk holding volume block "blocknum", and where on that disk it lives. */
+static struct spindle *spindle_for(struct bcache *bc, int blocknum, int *pblock) {
+    int disk;
+    volume_map(bc->volume, blocknum, &disk, pblock);
+    return &bc->spindles[disk];
+}
+
+static void complete_async(struct bcache *bc, struct bcache_request *req);
+
+/* Complete the asynchronous requests parked on a block, in arrival order. */
+static void drain_async(struct bcache *bc, struct bcache_request *waiting) {
+    struct bcache_request *prev = NULL;
+
+    // Requests were pushed on the front, so reverse the list first.
+    while (waiting) {
+        struct bcache_request *next = waiting->next;
+        waiting->next = prev;
+        prev = waiting;
+        waiting = next;
+    }
+    while (prev) {
+        struct bcache_request *next = prev->next;
+        complete_async(bc, prev);
+        prev = next;
     }
-    return NULL;
 }
 
 /*
-These functions just return basic information about the buffer cache,
-and you shouldn't need to change them.
+Mark a block whose read has landed as READY, wake synchronous readers, and then
+complete any asynchronous requests that were waiting for it.  Read-ahead nobody
+holds becomes evictable right here, so threads waiting for a frame are told too.
 */
+static void finish_read(struct bcache *bc, struct block *blk) {
+    struct bcache_request *waiting;
 
-/* Return the number of memory blocks in the buffer cache. */
+    lock_mutex(bc, &blk->lock);
+    blk->state = BLOCK_READY;
+    waiting = blk->async;
+    blk->async = NULL;
+    pthread_cond_broadcast(&blk->cond);
+    pthread_mutex_unlock(&blk->lock);
 
-int bcache_memory_blocks( struct bcache *bc )
-{
-	return bc->memory_blocks;
+    drain_async(bc, waiting);
+    wake_shard_waiters(blk->shard);
 }
 
-/* Return the number of blocks in the underlying disk. */
+/*
+Mark a block dirty, with its lock held.  Returns 1 if a writeback must be queued for it:
+a dirty block still has its writeback queued, so new data simply rides along, but a
+block being written needs another request, since the transfer in flight has the old data.
+*/
+static int mark_dirty(struct bcache *bc, struct block *blk) {
+    int queue_write = blk->state != BLOCK_DIRTY;
+    if (blk->state != BLOCK_DIRTY && blk->state != BLOCK_WRITING) __sync_fetch_and_add(&bc->ndirty, 1);
+    blk->state = BLOCK_DIRTY;
+    return queue_write;
+}
 
-int bcache_disk_blocks( struct bcache *bc )
+/*
+Hand a batch of transfers to the schedulers with one trip through each disk's queue lock.
+Reads are queued when a miss puts a block in BLOCK_READING; writebacks when a block
+first becomes dirty.  Each request's owner is the block it transfers, its class says
+how urgent it is, and its volume block number is replaced by the block on the disk that holds it.
+*/
+static void submit_batch(struct bcache *bc, const struct io_request *reqs, int count) {
+    long long queued = now_ns();
+    int d;
+
+    for (d = 0; d < bc->nspindles; d++) {
+        struct spindle *sp = &bc->spindles[d];
+        int i, locked = 0, pushed = 0, failed = -1;
+
+        for (i = 0; i < count && failed < 0; i++) {
+            struct io_request r = reqs[i];
+            if (spindle_for(bc, r.blocknum, &r.blocknum) != sp) continue;
+            r.queued = queued;
+            if (!locked) {
+                lock_mutex(bc, &sp->queue_lock);
+                locked = 1;
+            }
+            if (r.prio == IOPRIO_WRITEBACK && iosched_pending(sp->queue, IOPRIO_WRITEBACK) == 0) {
+                clock_gettime(CLOCK_MONOTONIC, &sp->batch_start);
+            }
+            if (iosched_push(sp->queue, &r) < 0) failed = i;
+            else pushed++;
+        }
+        if (locked) {
+            int depth = iosched_length(sp->queue);
+            // Every dirty block also has a background writeback queued, so flushing those covers a sync.
+            if (failed >= 0 && reqs[failed].prio == IOPRIO_SYNC) sp->flushing = 1;
+            if (pushed > 0 || failed >= 0) pthread_cond_signal(&sp->queue_cond);
+            if (depth > sp->queue_peak) sp->queue_peak = depth;
+            pthread_mutex_unlock(&sp->queue_lock);
+        }
+
+        for (i = failed; i >= 0 && i < count; i++) {
+            struct block *blk = reqs[i].owner;
+            int pblock;
+            if (spindle_for(bc, reqs[i].blocknum, &pblock) != sp || reqs[i].prio == IOPRIO_SYNC) continue;
+            if (reqs[i].type == IO_READ) {
+                // Nobody else will complete this miss, so do it here rather than hang.
+                disk_io(sp, IO_READ, pblock, 1, &blk->data, queued);
+                finish_read(bc, blk);
+            } else {
+                // The block stays dirty, so bcache_sync will still write it.
+                fprintf(stderr, "Failed to queue writeback of block %d.\n", reqs[i].blocknum);
+            }
+        }
+    }
+}
+
+/* Reads are READ or PREFETCH requests; everything else is a write. */
+static io_type class_type(io_class prio) {
+    return prio == IOPRIO_READ || prio == IOPRIO_PREFETCH ? IO_READ : IO_WRITE;
+}
+
+static void submit_io(struct bcache *bc, struct block *blk, int blocknum, io_class prio) {
+    struct io_request r;
+    r.blocknum = blocknum;
+    r.type = class_type(prio);
+    r.prio = prio;
+    r.owner = blk;
+    submit_batch(bc, &r, 1);
+}
+
+static void sync_progress(struct bcache *bc, struct block *blk, unsigned long done);
+
+/* Let throttled writers go once writeback has brought the dirty count down to the high watermark. */
+static void wake_throttled(struct bcache *bc) {
+    if (__sync_fetch_and_add(&bc->dirty_waiters, 0) == 0) return;
+    if (__sync_fetch_and_add(&bc->ndirty, 0) > bc->dirty_high) return;
+    lock_mutex(bc, &bc->dirty_lock);
+    pthread_cond_broadcast(&bc->dirty_cond);
+    pthread_mutex_unlock(&bc->dirty_lock);
+}
+
+/*
+Hold a writer back while more than dirty_high blocks are dirty, for a pause that
+grows with the excess, so that writers settle at the rate writeback can sustain
+instead of filling every frame.  The pause ends early once writeback catches up.
+Only threads that made the call themselves are throttled, never a scheduler.
+*/
+static void throttle_writer(struct bcache *bc) {
+    int over = __sync_fetch_and_add(&bc->ndirty, 0) - bc->dirty_high;
+    long long start, pause;
+    struct timespec deadline;
+
+    if (over <= 0) return;
+    pause = (long long)over * DIRTY_PAUSE_MS;
+    if (pause > DIRTY_MAX_PAUSE_MS) pause = DIRTY_MAX_PAUSE_MS;
+    start = now_ns();
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += pause / 1000;
+    deadline.tv_nsec += (long)(pause % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    lock_mutex(bc, &bc->dirty_lock);
+    __sync_fetch_and_add(&bc->dirty_waiters, 1);
+    while (__sync_fetch_and_add(&bc->ndirty, 0) > bc->dirty_high) {
+        if (pthread_cond_timedwait(&bc->dirty_cond, &bc->dirty_lock, &deadline) == ETIMEDOUT) break;
+    }
+    __sync_fetch_and_sub(&bc->dirty_waiters, 1);
+    pthread_mutex_unlock(&bc->dirty_lock);
+
+    stat_add(bc, STAT_THROTTLED, 1);
+    stat_add(bc, STAT_THROTTLE_NS, now_ns() - start);
+}
+
+/*
+Start writing back a run of blocks of one disk sorted by block number, copying each into
+"buffers" first, so a write that lands during the I/O makes the block dirty again
+rather than tearing the data.  A mapped frame is the disk's own page, so it is handed
+to the disk as it is: a copy would be written back over any write that lands meanwhile.  Dirty blocks are never re-keyed, so a dirty frame
+still holding its request's block is still ours; any other is dropped.  A block whose
+previous writeback is still in flight in the same batch is queued again instead, since
+the two might reach the disk in either order.  Requests name blocks of the disk, not of
+the volume.  Only a disk's scheduler calls this, so writebacks of one block never overlap,
+and finish in the order they started.
+*/
+static void write_back_start(struct spindle *sp, struct io_run *run, char *buffers) {
+    struct bcache *bc = sp->bc;
+    int i;
+
+    for (i = 0; i < run->n; i++) {
+        struct block *blk = run->reqs[i].owner;
+        int blocknum = volume_logical(bc->volume, sp->index, run->reqs[i].blocknum);
+        run->data[i] = bc->mapped ? blk->data : buffers + (size_t)i * BLOCK_SIZE;
+        lock_mutex(bc, &blk->lock);
+        run->valid[i] = blk->state == BLOCK_DIRTY && blk->blocknum == blocknum;
+        if (run->valid[i] && blk->wb_started != blk->wb_done) {
+            run->valid[i] = -1;
+        } else if (run->valid[i]) {
+            blk->state = BLOCK_WRITING;
+            blk->wb_started++;
+            if (!bc->mapped) memcpy(run->data[i], blk->data, BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&blk->lock);
+    }
+}
+
+/*
+Finish the writebacks of a run once they are on disk: blocks that were not written to
+meanwhile become clean, and anyone waiting for them is told.  Requests that were held
+back by write_back_start go back on the queue, keeping their place in line, now that their
+blocks' earlier writebacks are done.
+*/
+static void write_back_finish(struct spindle *sp, struct io_run *run) {
+    struct bcache *bc = sp->bc;
+    int i, requeued = 0, cleaned = 0;
+
+    for (i = 0; i < run->n; i++) {
+        struct block *blk = run->reqs[i].owner;
+        unsigned long done;
+        if (run->valid[i] < 0) requeued = 1;
+        if (run->valid[i] <= 0) continue;
+        lock_mutex(bc, &blk->lock);
+        if (blk->state == BLOCK_WRITING) {
+            blk->state = BLOCK_READY;
+            __sync_fetch_and_sub(&bc->ndirty, 1);
+            cleaned = 1;
+        }
+        done = ++blk->wb_done;
+        pthread_cond_broadcast(&blk->cond);
+        pthread_mutex_unlock(&blk->lock);
+        sync_progress(bc, blk, done);
+        wake_shard_waiters(blk->shard);
+    }
+
+    if (cleaned) wake_throttled(bc);
+    if (!requeued) return;
+    lock_mutex(bc, &sp->queue_lock);
+    for (i = 0; i < run->n; i++) {
+        if (run->valid[i] < 0 && iosched_push(sp->queue, &run->reqs[i]) < 0) {
+            // The block stays dirty, so bcache_sync will still write it.
+            fprintf(stderr, "Failed to queue writeback of block %d.\n", volume_logical(bc->volume, sp->index, run->reqs[i].blocknum));
+        }
+    }
+    pthread_mutex_unlock(&sp->queue_lock);
+}
+
+/*
+Transfer the runs of a batch.  Each run goes out as few transfers as the adjacency of its
+valid requests allows.  A disk that keeps one transfer in flight gets them one at a time,
+exactly as they would go on their own; a deeper one gets them all in one batch.
+*/
+static void transfer_runs(struct spindle *sp, struct io_run *runs, int nruns) {
+    struct disk_extent extents[IO_DEPTH_MAX * IO_MERGE_MAX];
+    long long queued[IO_DEPTH_MAX * IO_MERGE_MAX];
+    int i, j, k, n = 0;
+
+    for (k = 0; k < nruns; k++) {
+        struct io_run *run = &runs[k];
+        for (i = 0; i < run->n; i = j) {
+            j = i + 1;
+            if (run->valid[i] <= 0) continue;
+            while (j < run->n && run->valid[j] > 0 && run->reqs[j].blocknum == run->reqs[j - 1].blocknum + 1) j++;
+            extents[n].block = run->reqs[i].blocknum;
+            extents[n].count = j - i;
+            extents[n].data = &run->data[i];
+            extents[n].write = run->reqs[i].type == IO_WRITE;
+            queued[n] = run->reqs[i].queued;
+            if (extents[n].write) stat_add(sp->bc, STAT_WRITEBACKS, j - i);
+            n++;
+        }
+    }
+
+    if (sp->depth > 1 && n > 1) {
+        disk_io_batch(sp, extents, queued, n);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        disk_io(sp, extents[i].write ? IO_WRITE : IO_READ, extents[i].block, extents[i].count, extents[i].data, queued[i]);
+    }
+}
+
+/*
+Transfer "count" consecutive volume blocks starting at "first", where data[i] is the
+buffer of first+i.  The blocks are split into runs that are contiguous on one disk,
+and each run is a single transfer.  Used for the journal, which is not cached.
+*/
+static void volume_transfer(struct bcache *bc, io_type type, int first, int count, char *const *data) {
+    while (count > 0) {
+        int pblock, next, n = 1;
+        struct spindle *sp = spindle_for(bc, first, &pblock);
+        while (n < count && spindle_for(bc, first + n, &next) == sp && next == pblock + n) n++;
+        disk_io(sp, type, pblock, n, data, now_ns());
+        first += n;
+        data += n;
+        count -= n;
+    }
+}
+
+/* FNV-1a, which is plenty to tell a torn or stale journal block from a good one. */
+static unsigned long long checksum(const void *p, size_t len) {
+    const unsigned char *c = p;
+    unsigned long long h = 14695981039346656037ULL;
+    while (len-- > 0) h = (h ^ *c++) * 1099511628211ULL;
+    return h;
+}
+
+static unsigned long long header_sum(const struct journal_header *h) {
+    struct journal_header copy = *h;
+    copy.sum = 0;
+    return checksum(&copy, sizeof(copy));
+}
+
+/* Write the superblock, so that replay starts from the record with the next sequence number. */
+static void journal_reset(struct bcache *bc) {
+    char block[BLOCK_SIZE];
+    char *data = block;
+    struct journal_header h;
+
+    memset(&h, 0, sizeof(h));
+    h.magic = JOURNAL_MAGIC;
+    h.count = 0;
+    h.seq = bc->journal_seq;
+    h.sum = header_sum(&h);
+    memset(block, 0, BLOCK_SIZE);
+    memcpy(block, &h, sizeof(h));
+    volume_transfer(bc, IO_WRITE, bc->nblocks, 1, &data);
+    bc->journal_head = 1;
+}
+
+static void sync_blocks(struct bcache *bc);
+
+/*
+Append one record holding the oldest waiting entries, and mark them committed.
+There is no reclaiming of single records: when the log is full, every dirty block
+is written home first, which makes the whole log redundant, and it starts over.
+Called by the leader with journal_lock held; the lock is dropped during the I/O.
+*/
+static void journal_commit(struct bcache *bc) {
+    char header[BLOCK_SIZE];
+    char *data[JOURNAL_BATCH + 1];
+    struct journal_entry *first = bc->journal_pending, *rest, *e;
+    struct journal_header h;
+    int i, n = 0;
+
+    memset(&h, 0, sizeof(h));
+    for (e = first; e && n + e->count <= bc->journal_batch; e = e->next) {
+        for (i = 0; i < e->count; i++, n++) {
+            h.blocks[n] = e->blocks[i];
+            data[n + 1] = (char *)e->buffers[i];
+        }
+    }
+    // Later arrivals stay queued for the next record.
+    rest = e;
+    bc->journal_pending = rest;
+    if (!rest) bc->journal_tail = &bc->journal_pending;
+    pthread_mutex_unlock(&bc->journal_lock);
+
+    if (bc->journal_head + 1 + n > bc->journal_blocks) {
+        sync_blocks(bc);
+        journal_reset(bc);
+        stat_add(bc, STAT_CHECKPOINTS, 1);
+    }
+    h.magic = JOURNAL_MAGIC;
+    h.count = n;
+    h.seq = bc->journal_seq++;
+    for (i = 0; i < n; i++) h.sums[i] = checksum(data[i + 1], BLOCK_SIZE);
+    h.sum = header_sum(&h);
+    memset(header, 0, BLOCK_SIZE);
+    memcpy(header, &h, sizeof(h));
+    data[0] = header;
+    volume_transfer(bc, IO_WRITE, bc->nblocks + bc->journal_head, 1 + n, data);
+    bc->journal_head += 1 + n;
+    stat_add(bc, STAT_JOURNALED, n);
+    stat_add(bc, STAT_JOURNAL_RECORDS, 1);
+
+    lock_mutex(bc, &bc->journal_lock);
+    for (e = first; e != rest; e = e->next) e->committed = 1;
+}
+
+/*
+Take a place in the journal for a block just written into the cache, with the block's
+lock still held.  Entries are appended in the order they are queued, so two writes of
+one block reach the log in the order they reached the frame, and the later one is
+replayed last.  "e", "blocknum" and "buffer" must stay put until journal_wait returns.
+The data must be in the cache before it is queued: a checkpoint only writes
+home what is dirty, so a write it missed has to land in a record after it.
+*/
+static void journal_enqueue(struct bcache *bc, struct journal_entry *e, const int *blocknum, const char *const *buffer) {
+    e->blocks = blocknum;
+    e->buffers = buffer;
+    e->count = 1;
+    e->committed = 0;
+    e->next = NULL;
+
+    lock_mutex(bc, &bc->journal_lock);
+    *bc->journal_tail = e;
+    bc->journal_tail = &e->next;
+    pthread_mutex_unlock(&bc->journal_lock);
+}
+
+/*
+Return once the record holding a queued entry is on disk.  Writers queue up, and
+whichever finds no leader appends one record for everybody queued so far, so
+concurrent writes share one transfer.  Never called with a block's lock held.
+*/
+static void journal_wait(struct bcache *bc, struct journal_entry *e) {
+    lock_mutex(bc, &bc->journal_lock);
+    while (!e->committed) {
+        if (bc->journal_leader) {
+            pthread_cond_wait(&bc->journal_cond, &bc->journal_lock);
+            continue;
+        }
+        bc->journal_leader = 1;
+        journal_commit(bc);
+        bc->journal_leader = 0;
+        pthread_cond_broadcast(&bc->journal_cond);
+    }
+    pthread_mutex_unlock(&bc->journal_lock);
+}
+
+/* Write every dirty block home and empty the journal, with no records being appended meanwhile. */
+static void journal_checkpoint(struct bcache *bc) {
+    lock_mutex(bc, &bc->journal_lock);
+    while (bc->journal_leader) pthread_cond_wait(&bc->journal_cond, &bc->journal_lock);
+    bc->journal_leader = 1;
+    pthread_mutex_unlock(&bc->journal_lock);
+
+    sync_blocks(bc);
+    journal_reset(bc);
+    stat_add(bc, STAT_CHECKPOINTS, 1);
+
+    lock_mutex(bc, &bc->journal_lock);
+    bc->journal_leader = 0;
+    pthread_cond_broadcast(&bc->journal_cond);
+    pthread_mutex_unlock(&bc->journal_lock);
+}
+
+/* Read the journal header at "pos" into "h", returning 1 if it is intact. */
+static int journal_read_header(struct bcache *bc, int pos, char *block, struct journal_header *h) {
+    volume_transfer(bc, IO_READ, bc->nblocks + pos, 1, &block);
+    memcpy(h, block, sizeof(*h));
+    return h->magic == JOURNAL_MAGIC && h->sum == header_sum(h) && h->count >= 0 && h->count <= JOURNAL_BATCH;
+}
+
+/*
+Copy the newest logged copy of each block written since the last checkpoint to its home.
+The records are checked in log order first, noting where the latest copy of each block
+is, since a block may be logged many times; then each of those copies is written home
+once, in block order.  Runs while the cache is created, before any scheduler thread,
+and leaves an empty journal behind.  Returns -1 if out of memory.
+*/
+static int journal_replay(struct bcache *bc) {
+    char *buffer = malloc((size_t)(JOURNAL_BATCH + 1) * BLOCK_SIZE);
+    int *latest = malloc(sizeof(int) * bc->nblocks);
+    char *data[JOURNAL_BATCH];
+    struct journal_header h;
+    int i, pos = 1;
+
+    if (!buffer || !latest) {
+        fprintf(stderr, "Failed to allocate memory to replay the journal.\n");
+        free(buffer);
+        free(latest);
+        return -1;
+    }
+    for (i = 0; i < JOURNAL_BATCH; i++) data[i] = buffer + (size_t)(i + 1) * BLOCK_SIZE;
+    for (i = 0; i < bc->nblocks; i++) latest[i] = -1;
+
+    bc->journal_seq = 1;
+    if (journal_read_header(bc, 0, buffer, &h) && h.count == 0) {
+        bc->journal_seq = h.seq;
+        while (pos + 1 < bc->journal_blocks && journal_read_header(bc, pos, buffer, &h)) {
+            int good = h.seq == bc->journal_seq && h.count > 0 && pos + 1 + h.count <= bc->journal_blocks;
+            if (!good) break;
+            volume_transfer(bc, IO_READ, bc->nblocks + pos + 1, h.count, data);
+            for (i = 0; good && i < h.count; i++) {
+                good = h.sums[i] == checksum(data[i], BLOCK_SIZE) && h.blocks[i] >= 0 && h.blocks[i] < bc->nblocks;
+            }
+            if (!good) break;
+            // Later records, and later places in one record, hold later writes.
+            for (i = 0; i < h.count; i++) latest[h.blocks[i]] = pos + 1 + i;
+            bc->journal_seq++;
+            pos += 1 + h.count;
+        }
+    }
+    for (i = 0; i < bc->nblocks; i++) {
+        if (latest[i] < 0) continue;
+        volume_transfer(bc, IO_READ, bc->nblocks + latest[i], 1, &data[0]);
+        volume_transfer(bc, IO_WRITE, i, 1, &data[0]);
+        bc->journal_replayed++;
+    }
+    free(latest);
+    free(buffer);
+    journal_reset(bc);
+    return 0;
+}
+
+/*
+Put a frame for "blocknum" in the index as read-ahead that nobody is waiting for.
+Read-ahead is only worth a frame that is free or clean right now, so this never
+waits for one.  Read-ahead goes in at the cold end of the eviction policy, and
+warm-up as if it had just been used, since it was in use when the state was saved.
+A block the compressed tier holds is filled from it at once, with no disk read.
+Returns the frame if it still has to be read, or null if the block is already present,
+there is no frame to spare, or the tier had it.
+*/
+static struct block *insert_prefetch(struct bcache *bc, int blocknum, int kind) {
+    struct shard *sh = shard_for(bc, blocknum);
+    struct bucket *b = bucket_for(sh, blocknum);
+    struct block *frame = get_frame(sh, 0, -1, NULL);
+    int filled;
+
+    if (!frame) return NULL;
+
+    lock_mutex(bc, &b->lock);
+    if (bucket_lookup(b, blocknum)) {
+        pthread_mutex_unlock(&b->lock);
+        put_frame(frame);
+        return NULL;
+    }
+    bind_frame(bc, frame, blocknum);
+    filled = fill_from_tier(sh, frame, blocknum);
+    frame->state = filled ? BLOCK_READY : BLOCK_READING;
+    frame->refcount = 0;
+    frame->prefetched = kind;
+    set_cold(frame, kind != PREFETCH_WARM);
+    frame->hash_next = b->head;
+    b->head = frame;
+    pthread_mutex_unlock(&b->lock);
+
+    lock_mutex(bc, &sh->cache_lock);
+    if (kind == PREFETCH_WARM) evict_insert(sh->evict, &frame->evict);
+    else evict_insert_cold(sh->evict, &frame->evict);
+    pthread_mutex_unlock(&sh->cache_lock);
+
+    shard_add(sh, STAT_PREFETCH_ISSUED, 1);
+    return filled ? NULL : frame;
+}
+
+/*
+Start reading "blocknum" into the cache without anyone waiting for it.
+It is skipped while the disk already has prefetch_depth read-aheads queued.
+*/
+static void prefetch_block(struct bcache *bc, int blocknum) {
+    struct shard *sh = shard_for(bc, blocknum);
+    struct bucket *b = bucket_for(sh, blocknum);
+    struct block *frame;
+    int present;
+
+    lock_mutex(bc, &b->lock);
+    present = bucket_lookup(b, blocknum) != NULL;
+    pthread_mutex_unlock(&b->lock);
+    if (present) return;
+
+    if (bc->prefetch_depth > 0) {
+        int pblock, queued;
+        struct spindle *sp = spindle_for(bc, blocknum, &pblock);
+        lock_mutex(bc, &sp->queue_lock);
+        queued = iosched_pending(sp->queue, IOPRIO_PREFETCH);
+        pthread_mutex_unlock(&sp->queue_lock);
+        if (queued >= bc->prefetch_depth) {
+            stat_add(bc, STAT_PREFETCH_DROPPED, 1);
+            return;
+        }
+    }
+
+    frame = insert_prefetch(bc, blocknum, PREFETCH_AHEAD);
+    if (frame) submit_io(bc, frame, blocknum, IOPRIO_PREFETCH);
+}
+
+/*
+Called on a read miss or on the first read of a prefetched block.  Reads that
+continue a known stream advance it; once a stream has run RA_TRIGGER blocks, the
+next "window" blocks past the read are requested, and the stream is topped up
+again when the reader gets within half a window of the end.  The window doubles
+at each top-up whose previous batch is being used, and halves whenever a read
+misses on a block that was already read ahead, i.e. one evicted before use.
+A stream whose window shrinks to nothing stops reading ahead until it is replaced.
+Nothing is read ahead while threads are waiting for frames.
+*/
+static void readahead(struct bcache *bc, int blocknum, int prefetch_hit) {
+    struct ra_stream *st = NULL;
+    int i, from = 0, to = 0, exact = 0;
+    int nblocks = bc->nblocks;
+
+    pthread_mutex_lock(&bc->ra_lock);
+    bc->ra_clock++;
+    // A read continues a stream if it is the very next block, or lands in what was read ahead.
+    for (i = 0; i < RA_STREAMS; i++) {
+        struct ra_stream *s = &bc->streams[i];
+        if (s->next < 0) continue;
+        if (blocknum == s->next || (blocknum > s->next && blocknum < s->ra_end)) {
+            st = s;
+            exact = (blocknum == s->next);
+            break;
+        }
+    }
+
+    if (!st) {
+        // Start a new stream in place of the one idle for longest.
+        st = &bc->streams[0];
+        for (i = 1; i < RA_STREAMS; i++) {
+            if (bc->streams[i].used < st->used) st = &bc->streams[i];
+        }
+        st->ra_end = blocknum + 1;
+        st->window = RA_MIN_WINDOW < bc->ra_max ? RA_MIN_WINDOW : bc->ra_max;
+        st->run = 0;
+        exact = 1;
+    } else if (!prefetch_hit && blocknum < st->ra_end) {
+        st->window /= 2;
+    }
+    st->next = blocknum + 1;
+    st->run = exact ? st->run + 1 : 1;
+    st->used = bc->ra_clock;
+
+    if ((st->run >= RA_TRIGGER || prefetch_hit) && st->window > 0 && st->ra_end - blocknum <= st->window / 2 + 1
+        && !frames_starved(bc)) {
+        if (prefetch_hit) st->window = st->window * 2 < bc->ra_max ? st->window * 2 : bc->ra_max;
+        from = st->ra_end > blocknum + 1 ? st->ra_end : blocknum + 1;
+        to = blocknum + 1 + st->window;
+        if (to > nblocks) to = nblocks;
+        if (to > st->ra_end) st->ra_end = to;
+    }
+    pthread_mutex_unlock(&bc->ra_lock);
+
+    for (i = from; i < to; i++) {
+        prefetch_block(bc, i);
+    }
+}
+
+/*
+Log accesses to the file given to bcache_record_open, in the format trace_load reads.
+The unlocked check keeps the cost to one load when nothing is being recorded.
+*/
+static void record_access(struct bcache *bc, io_type type, const int *blocks, int count) {
+    long long t;
+    int i;
+
+    if (!bc->record) return;
+    t = now_ns();
+    pthread_mutex_lock(&bc->record_lock);
+    for (i = 0; bc->record && i < count; i++) {
+        fprintf(bc->record, "%d %c %d %lld\n", my_thread_index(), type == IO_READ ? 'R' : 'W', blocks[i], t - bc->record_start);
+    }
+    pthread_mutex_unlock(&bc->record_lock);
+}
+
+/* The most blocks a vectored call pins at once. */
+#define VEC_CHUNK 64
+
+/* What happened to each block of a read, as reported to read-ahead. */
+#define READ_HIT 0
+#define READ_MISS 1
+#define READ_PREFETCH_HIT 2
+
+/*
+Take references on a run of blocks.  Only the first block may wait for a frame;
+the run ends early at the first block that would have to, so a thread never
+waits for a frame while it holds references that could free one.
+Returns the number of blocks taken, which is at least one.
+*/
+static int acquire_blocks(struct bcache *bc, const int *blocks, int count, struct block **blks) {
+    int n;
+    if (count > VEC_CHUNK) count = VEC_CHUNK;
+    blks[0] = find_or_create_block(bc, blocks[0], 1);
+    for (n = 1; n < count; n++) {
+        blks[n] = find_or_create_block(bc, blocks[n], 0);
+        if (!blks[n]) break;
+    }
+    return n;
+}
+
+/*
+The data of a referenced block only changes in two ways: a miss filling it while
+it is READING, or a writer holding its lock.  Writers make "seq" odd for the
+duration, so a hit can copy the data without the lock and keep the copy if
+"seq" is even and unchanged afterwards.
+*/
+static void seq_write_begin(struct block *blk) {
+    __sync_fetch_and_add(&blk->seq, 1);
+}
+
+static void seq_write_end(struct block *blk) {
+    __sync_fetch_and_add(&blk->seq, 1);
+}
+
+/*
+Copy a hit out of a block without taking its lock.  Returns 0, leaving the
+caller to take the lock, if the block is being read or written, or still has to
+be counted as a prefetch hit.  The caller must hold a reference on the block.
+*/
+static int read_optimistic(struct block *blk, char *data) {
+    unsigned seq = __sync_fetch_and_add(&blk->seq, 0);
+    block_state state;
+
+    if (seq & 1) return 0;
+    state = blk->state;
+    if (state == BLOCK_FREE || state == BLOCK_READING) return 0;
+    __sync_synchronize();
+    if (blk->prefetched) return 0;
+    memcpy(data, blk->data, BLOCK_SIZE);
+    return __sync_fetch_and_add(&blk->seq, 0) == seq;
+}
+
+/*
+Claim a block that read-ahead or warm-up brought in, for a caller that has now asked for it:
+count the prefetch hit and return which kind of prefetch it was.  Called with the block lock held.
+"*queued" is set if its read is still waiting; the caller passes it to promote_prefetches
+once it drops the block lock, so that it does not wait behind every other prefetch.
+*/
+static int claim_prefetch(struct block *blk, int *queued) {
+    int kind = blk->prefetched;
+
+    blk->prefetched = 0;
+    shard_add(blk->shard, STAT_PREFETCH_HITS, 1);
+    *queued = blk->state == BLOCK_READING;
+    return kind;
+}
+
+/* Move the queued read-ahead of these volume blocks up to read priority. */
+static void promote_prefetches(struct bcache *bc, const int *blocks, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        int pblock, moved;
+        struct spindle *sp = spindle_for(bc, blocks[i], &pblock);
+        lock_mutex(bc, &sp->queue_lock);
+        moved = iosched_promote(sp->queue, pblock, IOPRIO_PREFETCH, IOPRIO_READ);
+        pthread_mutex_unlock(&sp->queue_lock);
+        if (moved > 0) stat_add(bc, STAT_PREFETCH_PROMOTED, moved);
+    }
+}
+
+/*
+Read a set of blocks.  Every block is resolved in one pass, all misses are queued
+together, and then each block is copied out once its read has landed.
+*/
+static void read_blocks(struct bcache *bc, const int *blocks, char *const *buffers, int count, int *outcome) {
+    struct block *blks[VEC_CHUNK];
+    struct io_request misses[VEC_CHUNK];
+    int promote[VEC_CHUNK];
+    int waited[VEC_CHUNK];
+    int copied[VEC_CHUNK];
+
+    record_access(bc, IO_READ, blocks, count);
+    while (count > 0) {
+        int i, nmiss = 0, npromote = 0;
+        int n = acquire_blocks(bc, blocks, count, blks);
+
+        for (i = 0; i < n; i++) {
+            struct block *blk = blks[i];
+            int result = READ_HIT;
+            // Most hits on hot blocks finish here, so concurrent readers never meet on the lock.
+            copied[i] = read_optimistic(blk, buffers[i]);
+            if (copied[i]) {
+                shard_add(blk->shard, STAT_HITS, 1);
+                if (outcome) outcome[i] = result;
+                continue;
+            }
+            lock_mutex(bc, &blk->lock);
+            // Dirty and writing blocks are newer than the disk, so they are hits like READY ones.
+            if (blk->state == BLOCK_FREE) {
+                // The scheduler fills the block and wakes us once it is READY.
+                blk->state = BLOCK_READING;
+                misses[nmiss].blocknum = blocks[i];
+                misses[nmiss].type = IO_READ;
+                misses[nmiss].prio = IOPRIO_READ;
+                misses[nmiss].owner = blk;
+                nmiss++;
+                result = READ_MISS;
+            } else if (blk->prefetched) {
+                int queued;
+                // Only read-ahead tells the stream detector anything.
+                result = claim_prefetch(blk, &queued) == PREFETCH_AHEAD ? READ_PREFETCH_HIT : READ_HIT;
+                if (queued) promote[npromote++] = blocks[i];
+            }
+            pthread_mutex_unlock(&blk->lock);
+            shard_add(blk->shard, result == READ_MISS ? STAT_MISSES : STAT_HITS, 1);
+            if (outcome) outcome[i] = result;
+        }
+
+        if (nmiss > 0) submit_batch(bc, misses, nmiss);
+        if (npromote > 0) promote_prefetches(bc, promote, npromote);
+
+        for (i = 0; i < n; i++) {
+            struct block *blk = blks[i];
+            waited[i] = 0;
+            if (copied[i]) continue;
+            lock_mutex(bc, &blk->lock);
+            while (blk->state == BLOCK_READING || blk->writer) {
+                pthread_cond_wait(&blk->cond, &blk->lock);
+                waited[i] = 1;
+            }
+            memcpy(buffers[i], blk->data, BLOCK_SIZE);
+            pthread_mutex_unlock(&blk->lock);
+        }
+
+        for (i = 0; i < n; i++) {
+            // The block may have aged in the policy while queued; it was really used just now.
+            if (waited[i]) touch_block(blks[i]);
+            release_block(bc, blks[i]);
+        }
+        stat_add(bc, STAT_READS, n);
+
+        blocks += n;
+        buffers += n;
+        count -= n;
+        if (outcome) outcome += n;
+    }
+}
+
+/* Write a set of blocks into the cache, queueing writeback for those newly dirtied. */
+static void write_blocks(struct bcache *bc, const int *blocks, const char *const *buffers, int count) {
+    struct block *blks[VEC_CHUNK];
+    struct io_request dirtied[VEC_CHUNK];
+    struct journal_entry logged[VEC_CHUNK];
+
+    record_access(bc, IO_WRITE, blocks, count);
+    while (count > 0) {
+        int i, ndirty = 0;
+        int n = acquire_blocks(bc, blocks, count, blks);
+
+        for (i = 0; i < n; i++) {
+            struct block *blk = blks[i];
+            lock_mutex(bc, &blk->lock);
+            // A read in flight would land on top of this write, so let it finish first.
+            // Pinned frames must not change under their holders either.
+            while (blk->state == BLOCK_READING || blk->writer || blk->readers > 0) {
+                pthread_cond_wait(&blk->cond, &blk->lock);
+            }
+            seq_write_begin(blk);
+            memcpy(blk->data, buffers[i], BLOCK_SIZE);
+            seq_write_end(blk);
+            blk->prefetched = 0;
+            if (mark_dirty(bc, blk)) {
+                dirtied[ndirty].blocknum = blocks[i];
+                dirtied[ndirty].type = IO_WRITE;
+                dirtied[ndirty].prio = IOPRIO_WRITEBACK;
+                dirtied[ndirty].owner = blk;
+                ndirty++;
+            }
+            if (bc->journal_blocks > 0) journal_enqueue(bc, &logged[i], &blocks[i], &buffers[i]);
+            pthread_mutex_unlock(&blk->lock);
+        }
+
+        if (ndirty > 0) submit_batch(bc, dirtied, ndirty);
+        for (i = 0; bc->journal_blocks > 0 && i < n; i++) journal_wait(bc, &logged[i]);
+
+        for (i = 0; i < n; i++) {
+            release_block(bc, blks[i]);
+        }
+        stat_add(bc, STAT_WRITES, n);
+        stat_add(bc, STAT_COALESCED, n - ndirty);
+        throttle_writer(bc);
+
+        blocks += n;
+        buffers += n;
+        count -= n;
+    }
+}
+
+void bcache_read(struct bcache *bc, int blocknum, char *data) {
+    long long start = now_ns();
+    int outcome;
+    read_blocks(bc, &blocknum, &data, 1, &outcome);
+    latency_add(bc, outcome == READ_MISS ? BCACHE_LATENCY_READ_MISS : BCACHE_LATENCY_READ_HIT, now_ns() - start);
+    if (bc->ra_max > 0 && outcome != READ_HIT) readahead(bc, blocknum, outcome == READ_PREFETCH_HIT);
+}
+
+void bcache_write(struct bcache *bc, int blocknum, const char *data) {
+    long long start = now_ns();
+    write_blocks(bc, &blocknum, &data, 1);
+    latency_add(bc, BCACHE_LATENCY_WRITE, now_ns() - start);
+}
+
+void bcache_readv(struct bcache *bc, const int *blocks, char *const *buffers, int count) {
+    read_blocks(bc, blocks, buffers, count, NULL);
+}
+
+void bcache_writev(struct bcache *bc, const int *blocks, const char *const *buffers, int count) {
+    write_blocks(bc, blocks, buffers, count);
+}
+
+void bcache_read_range(struct bcache *bc, int first, int count, char *buffer) {
+    int blocks[VEC_CHUNK];
+    char *buffers[VEC_CHUNK];
+    while (count > 0) {
+        int i, n = count < VEC_CHUNK ? count : VEC_CHUNK;
+        for (i = 0; i < n; i++) {
+            blocks[i] = first + i;
+            buffers[i] = buffer + (size_t)i * BLOCK_SIZE;
+        }
+        read_blocks(bc, blocks, buffers, n, NULL);
+        first += n;
+        buffer += (size_t)n * BLOCK_SIZE;
+        count -= n;
+    }
+}
+
+void bcache_write_range(struct bcache *bc, int first, int count, const char *data) {
+    int blocks[VEC_CHUNK];
+    const char *buffers[VEC_CHUNK];
+    while (count > 0) {
+        int i, n = count < VEC_CHUNK ? count : VEC_CHUNK;
+        for (i = 0; i < n; i++) {
+            blocks[i] = first + i;
+            buffers[i] = data + (size_t)i * BLOCK_SIZE;
+        }
+        write_blocks(bc, blocks, buffers, n);
+        first += n;
+        data += (size_t)n * BLOCK_SIZE;
+        count -= n;
+    }
+}
+
+static void request_destroy(struct bcache_request *req) {
+    pthread_mutex_destroy(&req->lock);
+    pthread_cond_destroy(&req->cond);
+    free(req->targets);
+    free(req);
+}
+
+/* Run a request's callback and mark it done, freeing it if the caller has already let it go. */
+static void finish_request(struct bcache_request *req) {
+    int detached;
+
+    if (req->callback) req->callback(req, req->arg);
+
+    pthread_mutex_lock(&req->lock);
+    req->done = 1;
+    detached = req->detached;
+    pthread_cond_broadcast(&req->cond);
+    pthread_mutex_unlock(&req->lock);
+
+    if (detached) request_destroy(req);
+}
+
+/*
+Perform the copy for an asynchronous request whose block is no longer being read,
+drop its reference, and report it complete.  The callback runs before the request
+is marked done, so a waiter never frees it while the callback still uses it.
+If a pin is in the way, the request is parked again and bcache_put completes it.
+With a journal a write is logged before it completes, like any other, or a record of
+older data could be replayed over the newer data once its writeback lands.
+*/
+static void complete_async(struct bcache *bc, struct bcache_request *req) {
+    struct block *blk = req->blk;
+    int blocknum = blk->blocknum, queue_write = 0, journal = req->type == IO_WRITE && bc->journal_blocks > 0;
+    const char *logged = req->buffer;
+    struct journal_entry e;
+
+    lock_mutex(bc, &blk->lock);
+    if (blk->writer || (req->type == IO_WRITE && blk->readers > 0)) {
+        req->next = blk->async;
+        blk->async = req;
+        pthread_mutex_unlock(&blk->lock);
+        return;
+    }
+    if (req->type == IO_READ) {
+        memcpy(req->buffer, blk->data, BLOCK_SIZE);
+    } else {
+        seq_write_begin(blk);
+        memcpy(blk->data, req->buffer, BLOCK_SIZE);
+        seq_write_end(blk);
+        blk->prefetched = 0;
+        queue_write = mark_dirty(bc, blk);
+        if (journal) journal_enqueue(bc, &e, &blocknum, &logged);
+    }
+    pthread_mutex_unlock(&blk->lock);
+
+    if (queue_write) submit_io(bc, blk, blocknum, IOPRIO_WRITEBACK);
+    else if (req->type == IO_WRITE) stat_add(bc, STAT_COALESCED, 1);
+    if (journal) journal_wait(bc, &e);
+    release_block(bc, blk);
+    stat_add(bc, req->type == IO_READ ? STAT_READS : STAT_WRITES, 1);
+    finish_request(req);
+}
+
+/*
+Start an asynchronous transfer.  A miss is queued for the scheduler and completes
+on its thread; a block already in memory completes right away on the caller's.
+A write that has to be logged never waits on the scheduler's thread, which must not
+block on the journal, so it waits here for a read in flight instead.
+*/
+static struct bcache_request *submit_async(struct bcache *bc, int blocknum, io_type type, char *buffer, bcache_callback callback, void *arg) {
+    struct bcache_request *req = malloc(sizeof(*req));
+    struct block *blk;
+    int miss = 0, prefetch_hit = 0, queued = 0, pending = 0;
+
+    if (!req) return NULL;
+    record_access(bc, type, &blocknum, 1);
+    req->bc = bc;
+    req->type = type;
+    req->buffer = buffer;
+    req->callback = callback;
+    req->arg = arg;
+    req->done = 0;
+    req->detached = 0;
+    req->next = NULL;
+    req->targets = NULL;
+    pthread_mutex_init(&req->lock, NULL);
+    pthread_cond_init(&req->cond, NULL);
+
+    blk = find_or_create_block(bc, blocknum, 1);
+    req->blk = blk;
+
+    lock_mutex(bc, &blk->lock);
+    if (type == IO_WRITE && bc->journal_blocks > 0) {
+        while (blk->state == BLOCK_READING) pthread_cond_wait(&blk->cond, &blk->lock);
+    }
+    if (blk->state == BLOCK_FREE && type == IO_READ) {
+        blk->state = BLOCK_READING;
+        miss = 1;
+    } else if (blk->prefetched && type == IO_READ) {
+        prefetch_hit = claim_prefetch(blk, &queued) == PREFETCH_AHEAD;
+    }
+    // Whoever finishes the read in flight will complete the request.
+    if (blk->state == BLOCK_READING) {
+        req->next = blk->async;
+        blk->async = req;
+        pending = 1;
+    }
+    pthread_mutex_unlock(&blk->lock);
+
+    if (miss) submit_io(bc, blk, blocknum, IOPRIO_READ);
+    if (queued) promote_prefetches(bc, &blocknum, 1);
+    if (type == IO_READ) shard_add(blk->shard, miss ? STAT_MISSES : STAT_HITS, 1);
+    if (!pending) complete_async(bc, req);
+    if (bc->ra_max > 0 && (miss || prefetch_hit)) readahead(bc, blocknum, prefetch_hit);
+    return req;
+}
+
+struct bcache_request *bcache_read_async(struct bcache *bc, int blocknum, char *buffer, bcache_callback callback, void *arg) {
+    return submit_async(bc, blocknum, IO_READ, buffer, callback, arg);
+}
+
+struct bcache_request *bcache_write_async(struct bcache *bc, int blocknum, const char *data, bcache_callback callback, void *arg) {
+    // The buffer is only ever copied from for a write.
+    return submit_async(bc, blocknum, IO_WRITE, (char *)data, callback, arg);
+}
+
+int bcache_poll(struct bcache_request *req) {
+    int done;
+    pthread_mutex_lock(&req->lock);
+    done = req->done;
+    pthread_mutex_unlock(&req->lock);
+    return done;
+}
+
+void bcache_wait(struct bcache_request *req) {
+    pthread_mutex_lock(&req->lock);
+    while (!req->done) {
+        pthread_cond_wait(&req->cond, &req->lock);
+    }
+    pthread_mutex_unlock(&req->lock);
+}
+
+void bcache_request_free(struct bcache_request *req) {
+    int done;
+    pthread_mutex_lock(&req->lock);
+    done = req->done;
+    if (!done) req->detached = 1;
+    pthread_mutex_unlock(&req->lock);
+
+    // A request still in flight is freed by finish_request instead.
+    if (done) request_destroy(req);
+}
+
+/*
+Pin a block in memory and return its frame.  A writable pin is exclusive and
+read-only pins are shared, like a reader-writer lock; both wait for a read in flight.
+A writable pin also reads the block in first, since the caller may change only part of it.
+*/
+char *bcache_get(struct bcache *bc, int blocknum, bcache_pin_mode mode) {
+    struct block *blk = find_or_create_block(bc, blocknum, 1);
+    int waited = 0, miss = 0, prefetch_hit = 0, queued = 0;
+
+    record_access(bc, mode == BCACHE_PIN_WRITE ? IO_WRITE : IO_READ, &blocknum, 1);
+
+    lock_mutex(bc, &blk->lock);
+    if (blk->state == BLOCK_FREE) {
+        blk->state = BLOCK_READING;
+        miss = 1;
+        pthread_mutex_unlock(&blk->lock);
+        submit_io(bc, blk, blocknum, IOPRIO_READ);
+        lock_mutex(bc, &blk->lock);
+    } else if (blk->prefetched) {
+        prefetch_hit = claim_prefetch(blk, &queued) == PREFETCH_AHEAD;
+        if (queued) {
+            pthread_mutex_unlock(&blk->lock);
+            promote_prefetches(bc, &blocknum, 1);
+            lock_mutex(bc, &blk->lock);
+        }
+    }
+    while (blk->state == BLOCK_READING || blk->writer || (mode == BCACHE_PIN_WRITE && blk->readers > 0)) {
+        pthread_cond_wait(&blk->cond, &blk->lock);
+        waited = 1;
+    }
+    if (mode == BCACHE_PIN_WRITE) {
+        // The caller changes the frame in place until bcache_put.
+        blk->writer = 1;
+        seq_write_begin(blk);
+    } else {
+        blk->readers++;
+    }
+    pthread_mutex_unlock(&blk->lock);
+
+    if (waited) touch_block(blk);
+    stat_add(bc, mode == BCACHE_PIN_WRITE ? STAT_WRITES : STAT_READS, 1);
+    shard_add(blk->shard, miss ? STAT_MISSES : STAT_HITS, 1);
+    if (bc->ra_max > 0 && (miss || prefetch_hit)) readahead(bc, blocknum, prefetch_hit);
+    // The reference taken above is what keeps the frame from being evicted until bcache_put.
+    return blk->data;
+}
+
+/*
+The frame whose data lives at "data", found by the shard arena holding it.
+A mapped frame is found from the block whose page it is; that block is pinned, so it is in the index.
+*/
+static struct block *frame_of(struct bcache *bc, char *data) {
+    int i;
+    for (i = 0; bc->mapped && i < bc->nspindles; i++) {
+        struct disk *d = bc->spindles[i].disk;
+        char *map = disk_map(d, 0);
+        if (data >= map && data < map + (size_t)disk_nblocks(d) * BLOCK_SIZE) {
+            int blocknum = volume_logical(bc->volume, i, (data - map) / BLOCK_SIZE);
+            struct bucket *b = bucket_for(shard_for(bc, blocknum), blocknum);
+            struct block *blk;
+            lock_mutex(bc, &b->lock);
+            blk = bucket_lookup(b, blocknum);
+            pthread_mutex_unlock(&b->lock);
+            if (blk) return blk;
+        }
+    }
+    for (i = 0; i < bc->nshards; i++) {
+        struct shard *sh = &bc->shards[i];
+        if (data >= sh->frame_data && data < sh->frame_data + (size_t)sh->nframes * BLOCK_SIZE) {
+            return &sh->frames[(data - sh->frame_data) / BLOCK_SIZE];
+        }
+    }
+    abort();
+}
+
+/*
+Drop a pin taken by bcache_get.  The frame is found from its address, and
+releasing a writable pin marks the block dirty and queues its writeback.
+*/
+void bcache_put(struct bcache *bc, char *data, bcache_pin_mode mode) {
+    struct block *blk = frame_of(bc, data);
+    struct bcache_request *waiting = NULL;
+    int queue_write = 0, blocknum = blk->blocknum, journal = bc->journal_blocks > 0 && mode == BCACHE_PIN_WRITE;
+    char copy[BLOCK_SIZE];
+    const char *logged = copy;
+    struct journal_entry e;
+
+    // Once the pin is gone the frame may change again, so log what this pin wrote.
+    if (journal) memcpy(copy, data, BLOCK_SIZE);
+
+    lock_mutex(bc, &blk->lock);
+    if (mode == BCACHE_PIN_WRITE) {
+        seq_write_end(blk);
+        blk->writer = 0;
+        blk->prefetched = 0;
+        queue_write = mark_dirty(bc, blk);
+        if (journal) journal_enqueue(bc, &e, &blocknum, &logged);
+    } else {
+        blk->readers--;
+    }
+    if (!blk->writer && blk->readers == 0) {
+        waiting = blk->async;
+        blk->async = NULL;
+    }
+    pthread_cond_broadcast(&blk->cond);
+    pthread_mutex_unlock(&blk->lock);
+
+    if (queue_write) submit_io(bc, blk, blk->blocknum, IOPRIO_WRITEBACK);
+    else if (mode == BCACHE_PIN_WRITE) stat_add(bc, STAT_COALESCED, 1);
+    drain_async(bc, waiting);
+    if (journal) journal_wait(bc, &e);
+    release_block(bc, blk);
+    if (mode == BCACHE_PIN_WRITE) throttle_writer(bc);
+}
+
+/* Frame number "n" of the cache, counting through each shard in turn. */
+static struct block *frame_at(struct bcache *bc, int n) {
+    int i = 0;
+    while (n >= bc->shards[i].first + bc->shards[i].nframes) i++;
+    return &bc->shards[i].frames[n - bc->shards[i].first];
+}
+
+/* The cache-wide number of a frame. */
+static int frame_number(struct block *blk) {
+    return blk->shard->first + (int)(blk - blk->shard->frames);
+}
+
+/* The target for "blk" in a sync, or null.  Targets are in frame order. */
+static struct sync_target *find_target(struct bcache_request *req, struct block *blk) {
+    int lo = 0, hi = req->ntargets, want = frame_number(blk);
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (frame_number(req->targets[mid].blk) < want) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < req->ntargets && req->targets[lo].blk == blk ? &req->targets[lo] : NULL;
+}
+
+/*
+Count a finished writeback of "blk" towards every sync waiting for it, where "done"
+is the block's writeback count after it.  Syncs with nothing left to wait for are
+completed here, usually on the scheduler thread that did the write.
+*/
+static void sync_progress(struct bcache *bc, struct block *blk, unsigned long done) {
+    struct bcache_request *finished = NULL, **pp;
+
+    if (__sync_fetch_and_add(&bc->nsyncs, 0) == 0) return;
+
+    lock_mutex(bc, &bc->sync_lock);
+    pp = &bc->syncs;
+    while (*pp) {
+        struct bcache_request *req = *pp;
+        struct sync_target *t = find_target(req, blk);
+        if (t && t->gen && done >= t->gen) {
+            t->gen = 0;
+            req->remaining--;
+        }
+        if (req->remaining == 0) {
+            *pp = req->next;
+            req->next = finished;
+            finished = req;
+            __sync_fetch_and_sub(&bc->nsyncs, 1);
+        } else {
+            pp = &req->next;
+        }
+    }
+    pthread_mutex_unlock(&bc->sync_lock);
+
+    while (finished) {
+        struct bcache_request *next = finished->next;
+        finish_request(finished);
+        finished = next;
+    }
+}
+
+/* Order sync targets by frame number, which is how find_target looks them up. */
+static int by_frame(const void *a, const void *b) {
+    const struct sync_target *x = a, *y = b;
+    return frame_number(x->blk) - frame_number(y->blk);
+}
+
+/*
+Add "blk" to a sync's snapshot if it holds one of blocks lo..hi-1 and is dirty or being
+written, noting the writeback the sync waits for and queueing one if it has not started.
+Called with the block's lock held.
+*/
+static void sync_snapshot(struct block *blk, int lo, int hi, struct sync_target *targets, int *n, struct io_request *writes, int *nwrites) {
+    // Dirty and writing blocks are never re-keyed, so their block number is stable here.
+    if ((blk->state != BLOCK_DIRTY && blk->state != BLOCK_WRITING) || blk->blocknum < lo || blk->blocknum >= hi) return;
+    targets[*n].blk = blk;
+    targets[*n].gen = blk->wb_started;
+    if (blk->state == BLOCK_DIRTY) {
+        targets[*n].gen++;
+        writes[*nwrites].blocknum = blk->blocknum;
+        writes[*nwrites].type = IO_WRITE;
+        writes[*nwrites].prio = IOPRIO_SYNC;
+        writes[*nwrites].owner = blk;
+        (*nwrites)++;
+    }
+    (*n)++;
+}
+
+/*
+Snapshot the frames holding blocks lo..hi-1 that are dirty right now.  A block being
+written already has its data on the way; any other needs a writeback that starts
+from now on, so those are handed to the schedulers' sync queues as one batch,
+where the queue policy sorts them.  Nothing else is written, no cache-wide lock
+is held, and the caller does not wait: the returned request completes once every
+snapshotted block is on disk.  A range narrower than the cache is looked up block by
+block in the index, so its cost follows the range; a wider one walks every frame.
+Returns null if out of memory.
+*/
+static struct bcache_request *start_sync(struct bcache *bc, int lo, int hi, bcache_callback callback, void *arg) {
+    int span, i, n = 0, nwrites = 0;
+    struct bcache_request *req;
+    struct io_request *writes;
+    struct sync_target *targets;
+
+    if (lo < 0) lo = 0;
+    if (hi > bc->nblocks) hi = bc->nblocks;
+    span = hi > lo ? hi - lo : 0;
+    if (span > bc->memory_blocks) span = bc->memory_blocks;
+
+    req = malloc(sizeof(*req));
+    writes = malloc(sizeof(*writes) * (span > 0 ? span : 1));
+    targets = malloc(sizeof(*targets) * (span > 0 ? span : 1));
+    if (!req || !writes || !targets) {
+        fprintf(stderr, "Failed to allocate memory to sync the cache.\n");
+        free(req);
+        free(writes);
+        free(targets);
+        return NULL;
+    }
+    memset(req, 0, sizeof(*req));
+    req->bc = bc;
+    req->type = IO_WRITE;
+    req->callback = callback;
+    req->arg = arg;
+    pthread_mutex_init(&req->lock, NULL);
+    pthread_cond_init(&req->cond, NULL);
+
+    if (hi - lo < bc->memory_blocks) {
+        for (i = lo; i < hi; i++) {
+            struct bucket *b = bucket_for(shard_for(bc, i), i);
+            struct block *blk;
+            lock_mutex(bc, &b->lock);
+            blk = bucket_lookup(b, i);
+            if (blk) {
+                lock_mutex(bc, &blk->lock);
+                sync_snapshot(blk, lo, hi, targets, &n, writes, &nwrites);
+                pthread_mutex_unlock(&blk->lock);
+            }
+            pthread_mutex_unlock(&b->lock);
+        }
+        qsort(targets, n, sizeof(*targets), by_frame);
+    } else {
+        for (i = 0; i < bc->memory_blocks; i++) {
+            struct block *blk = frame_at(bc, i);
+            lock_mutex(bc, &blk->lock);
+            sync_snapshot(blk, lo, hi, targets, &n, writes, &nwrites);
+            pthread_mutex_unlock(&blk->lock);
+        }
+    }
+    req->targets = targets;
+    req->ntargets = n;
+    req->remaining = n;
+
+    if (n == 0) {
+        free(writes);
+        finish_request(req);
+        return req;
+    }
+
+    lock_mutex(bc, &bc->sync_lock);
+    req->next = bc->syncs;
+    bc->syncs = req;
+    __sync_fetch_and_add(&bc->nsyncs, 1);
+    pthread_mutex_unlock(&bc->sync_lock);
+
+    // The regular writeback queued for each block stays put, and is dropped once the block is clean.
+    if (nwrites > 0) submit_batch(bc, writes, nwrites);
+    free(writes);
+
+    // Writes that finished before the sync was listed were not counted, so look again.
+    for (i = 0; i < n; i++) {
+        struct block *blk = targets[i].blk;
+        unsigned long done;
+        lock_mutex(bc, &blk->lock);
+        done = blk->wb_done;
+        pthread_mutex_unlock(&blk->lock);
+        sync_progress(bc, blk, done);
+    }
+    return req;
+}
+
+struct bcache_request *bcache_sync_async(struct bcache *bc, int lo, int hi, bcache_callback callback, void *arg) {
+    return start_sync(bc, lo, hi, callback, arg);
+}
+
+void bcache_sync_range(struct bcache *bc, int lo, int hi) {
+    struct bcache_request *req = start_sync(bc, lo, hi, NULL, NULL);
+    if (!req) return;
+    bcache_wait(req);
+    bcache_request_free(req);
+}
+
+static void sync_blocks(struct bcache *bc) {
+    bcache_sync_range(bc, 0, bc->nblocks);
+}
+
+/*
+With a journal, syncing is a checkpoint: once every dirty block is home, the
+records are no longer needed, and must not be replayed over later writes.
+*/
+void bcache_sync(struct bcache *bc) {
+    if (bc->journal_blocks > 0) journal_checkpoint(bc);
+    else sync_blocks(bc);
+}
+
+/*
+Wait until a disk's scheduler has something to do, and take its next request, the
+one nearest "head" as the queue's policy sees it.  Unless "wait" is set, return 0 at once
+rather than wait when nothing is due.
+Reads, writebacks a sync is waiting for and read-ahead are served as soon as they
+arrive, in that order of priority.  Background writeback waits until a
+batch is due: batch_blocks are queued, the oldest has waited batch_ms or dirty_age_ms,
+whichever is set and shorter, more than dirty_low frames are dirty, or a thread is stuck
+waiting for a clean frame.  A due batch is drained completely.
+*/
+static int next_request(struct spindle *sp, int head, int wait, struct io_request *r) {
+    struct bcache *bc = sp->bc;
+    int n = 1;
+
+    lock_mutex(bc, &sp->queue_lock);
+    while (1) {
+        int writes = iosched_pending(sp->queue, IOPRIO_WRITEBACK);
+        int others = iosched_length(sp->queue) - writes;
+        int starved = frames_starved(bc);
+        int background = __sync_fetch_and_add(&bc->ndirty, 0) > bc->dirty_low;
+        int age = bc->batch_ms > 0 && (bc->dirty_age_ms == 0 || bc->batch_ms < bc->dirty_age_ms) ? bc->batch_ms : bc->dirty_age_ms;
+        struct timespec deadline = sp->batch_start;
+
+        deadline.tv_sec += age / 1000;
+        deadline.tv_nsec += (long)(age % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        if (writes == 0) {
+            sp->flushing = 0;
+        } else if (!sp->flushing) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            sp->flushing = writes >= bc->batch_blocks || starved || background
+                || (age > 0 && (now.tv_sec > deadline.tv_sec
+                                || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)));
+        }
+
+        if (others > 0 || sp->flushing) {
+            unsigned mask = sp->flushing ? IOPRIO_ALL : IOPRIO_ALL & ~IOPRIO_BIT(IOPRIO_WRITEBACK);
+            // Once threads are waiting for a clean frame, giving writeback the lowest priority only starves them.
+            iosched_pop(sp->queue, head, mask, !sp->flushing || (bc->reads_first && !starved), now_ns(), r);
+            // Requests for the blocks just past this one ride along in the same transfer.
+            while (n < IO_MERGE_MAX && iosched_take(sp->queue, r->type, r[n - 1].blocknum + 1, &r[n])) n++;
+            break;
+        }
+
+        if (!wait) {
+            n = 0;
+            break;
+        } else if (writes > 0 && age > 0) {
+            pthread_cond_timedwait(&sp->queue_cond, &sp->queue_lock, &deadline);
+        } else {
+            pthread_cond_wait(&sp->queue_cond, &sp->queue_lock);
+        }
+    }
+    pthread_mutex_unlock(&sp->queue_lock);
+    return n;
+}
+
+/*
+Each disk's scheduler serves its queued reads and writebacks in the order chosen by their
+classes and the queue's policy, starting from wherever the previous transfer left that disk's head.
+Requests for consecutive blocks are merged into one transfer, paying one seek.
+A disk that keeps several transfers in flight is handed up to that many runs at once,
+each taken from where the one before it leaves the head, and the scheduler waits for
+the whole batch before taking more.
+A writeback is dropped if its block is no longer dirty, e.g. because a sync
+got there first, or if the frame has since been recycled for a different block.
+Each request's time from being queued to the end of its transfer goes to its class's histogram.
+*/
+static void *spindle_scheduler(void *vsp) {
+    struct spindle *sp = vsp;
+    while (1) {
+        long long now;
+        int i, k, head, nruns = 0;
+
+        pthread_mutex_lock(&sp->disk_lock);
+        head = sp->disk_head;
+        pthread_mutex_unlock(&sp->disk_lock);
+
+        while (nruns < sp->depth) {
+            struct io_run *run = &sp->runs[nruns];
+            run->n = next_request(sp, head, nruns == 0, run->reqs);
+            if (run->n == 0) break;
+            if (run->reqs[0].type == IO_READ) {
+                // READING blocks are never evicted, so each frame still belongs to its request's block.
+                for (i = 0; i < run->n; i++) {
+                    run->data[i] = ((struct block *)run->reqs[i].owner)->data;
+                    run->valid[i] = 1;
+                }
+            } else {
+                write_back_start(sp, run, sp->bounce + (size_t)nruns * IO_MERGE_MAX * BLOCK_SIZE);
+            }
+            head = run->reqs[run->n - 1].blocknum;
+            nruns++;
+        }
+
+        transfer_runs(sp, sp->runs, nruns);
+
+        for (k = 0; k < nruns; k++) {
+            struct io_run *run = &sp->runs[k];
+            if (run->reqs[0].type == IO_READ) {
+                for (i = 0; i < run->n; i++) finish_read(sp->bc, run->reqs[i].owner);
+            } else {
+                write_back_finish(sp, run);
+            }
+        }
+
+        now = now_ns();
+        for (k = 0; k < nruns; k++) {
+            struct io_run *run = &sp->runs[k];
+            for (i = 0; i < run->n; i++) {
+                if (run->valid[i] >= 0) histo_record(&sp->bc->latency[BCACHE_LATENCY_IO_READ + run->reqs[i].prio], now - run->reqs[i].queued);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+The calling thread becomes the scheduler of the first disk, and starts one
+more thread for each other disk of the volume, so the disks work in parallel.
+*/
+void *bcache_io_scheduler(void *vbc) {
+    struct bcache *bc = (struct bcache *)vbc;
+    int i;
+
+    for (i = 1; i < bc->nspindles; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, spindle_scheduler, &bc->spindles[i]) != 0) {
+            fprintf(stderr, "Failed to start the scheduler for disk %d.\n", i);
+            abort();
+        }
+        pthread_detach(tid);
+    }
+    return spindle_scheduler(&bc->spindles[0]);
+}
+
+void bcache_get_stats(struct bcache *bc, struct bcache_stats *st) {
+    int i;
+
+    st->reads = stat_sum(bc, STAT_READS);
+    st->writes = stat_sum(bc, STAT_WRITES);
+    st->hits = stat_sum(bc, STAT_HITS);
+    st->misses = stat_sum(bc, STAT_MISSES);
+    st->evictions = stat_sum(bc, STAT_EVICTIONS);
+    st->admitted = stat_sum(bc, STAT_ADMITTED);
+    st->rejected = stat_sum(bc, STAT_REJECTED);
+    st->writebacks = stat_sum(bc, STAT_WRITEBACKS);
+    st->coalesced_writes = stat_sum(bc, STAT_COALESCED);
+    st->prefetch_issued = stat_sum(bc, STAT_PREFETCH_ISSUED);
+    st->prefetch_hits = stat_sum(bc, STAT_PREFETCH_HITS);
+    st->prefetch_wasted = stat_sum(bc, STAT_PREFETCH_WASTED);
+    st->prefetch_dropped = stat_sum(bc, STAT_PREFETCH_DROPPED);
+    st->prefetch_promoted = stat_sum(bc, STAT_PREFETCH_PROMOTED);
+    st->lock_wait_ns = stat_sum(bc, STAT_LOCK_WAIT_NS);
+    st->journaled = stat_sum(bc, STAT_JOURNALED);
+    st->journal_records = stat_sum(bc, STAT_JOURNAL_RECORDS);
+    st->checkpoints = stat_sum(bc, STAT_CHECKPOINTS);
+    st->journal_replayed = bc->journal_replayed;
+    st->throttled = stat_sum(bc, STAT_THROTTLED);
+    st->throttle_ns = stat_sum(bc, STAT_THROTTLE_NS);
+    st->warmed = stat_sum(bc, STAT_WARMED);
+    st->dirty = __sync_fetch_and_add(&bc->ndirty, 0);
+
+    memset(&st->ztier, 0, sizeof(st->ztier));
+    st->ztier.budget = bc->ztier_bytes;
+    for (i = 0; i < bc->nshards; i++) {
+        struct ztier_stats zs;
+        if (!bc->shards[i].ztier) continue;
+        ztier_get_stats(bc->shards[i].ztier, &zs);
+        st->ztier.hits += zs.hits;
+        st->ztier.misses += zs.misses;
+        st->ztier.stored += zs.stored;
+        st->ztier.incompressible += zs.incompressible;
+        st->ztier.dropped += zs.dropped;
+        st->ztier.raw_bytes += zs.raw_bytes;
+        st->ztier.packed_bytes += zs.packed_bytes;
+        st->ztier.blocks += zs.blocks;
+        st->ztier.bytes += zs.bytes;
+    }
+
+    st->queue_depth = 0;
+    st->queue_peak = 0;
+    for (i = 0; i < bc->nspindles; i++) {
+        struct spindle *sp = &bc->spindles[i];
+        pthread_mutex_lock(&sp->queue_lock);
+        st->queue_depth += iosched_length(sp->queue);
+        if (sp->queue_peak > st->queue_peak) st->queue_peak = sp->queue_peak;
+        pthread_mutex_unlock(&sp->queue_lock);
+    }
+}
+
+void bcache_get_disk_stats(struct bcache *bc, int disk, struct bcache_disk_stats *st) {
+    struct spindle *sp = &bc->spindles[disk];
+
+    pthread_mutex_lock(&sp->disk_lock);
+    st->reads = disk_nreads(sp->disk);
+    st->writes = disk_nwrites(sp->disk);
+    st->transfers = sp->transfers;
+    st->busy_ns = sp->busy_ns;
+    pthread_mutex_unlock(&sp->disk_lock);
+
+    pthread_mutex_lock(&sp->queue_lock);
+    st->queue_depth = iosched_length(sp->queue);
+    st->queue_peak = sp->queue_peak;
+    pthread_mutex_unlock(&sp->queue_lock);
+}
+
+void bcache_get_shard_stats(struct bcache *bc, int shard, struct bcache_shard_stats *st) {
+    struct shard *sh = &bc->shards[shard];
+
+    st->frames = sh->nframes;
+    st->node = sh->node;
+    st->hits = slot_sum(sh->stats, STAT_HITS);
+    st->misses = slot_sum(sh->stats, STAT_MISSES);
+    st->evictions = slot_sum(sh->stats, STAT_EVICTIONS);
+    st->prefetch_issued = slot_sum(sh->stats, STAT_PREFETCH_ISSUED);
+}
+
+int bcache_nshards(struct bcache *bc) {
+    return bc->nshards;
+}
+
+int bcache_shard_of(struct bcache *bc, int block) {
+    return shard_for(bc, block)->index;
+}
+
+int bcache_bind_thread(struct bcache *bc, int shard) {
+    return topology_bind_thread(bc->shards[shard].node);
+}
+
+/* Each thread keeps its own histograms of reads and writes, so they are added up here rather than on every operation. */
+void bcache_get_latency(struct bcache *bc, bcache_latency_kind kind, struct bcache_latency *lat) {
+    struct histo all, *h = &all;
+    int i;
+
+    histo_init(&all);
+    histo_merge(&all, &bc->latency[kind]);
+    for (i = 0; kind < NCALLER_LATENCY && i < STAT_SLOTS; i++) histo_merge(&all, &bc->latency_slots[i].latency[kind]);
+    lat->count = histo_count(h);
+    lat->p50 = histo_percentile(h, 0.5);
+    lat->p99 = histo_percentile(h, 0.99);
+    lat->p999 = histo_percentile(h, 0.999);
+    lat->max = histo_max(h);
+}
+
+static const char *latency_names[] = { "read hit", "read miss", "write", "disk read", "disk write",
+                                       "io read", "io sync", "io prefetch", "io writeback" };
+
+const char *bcache_latency_name(bcache_latency_kind kind) {
+    if (kind < 0 || kind >= BCACHE_NLATENCY) return "unknown";
+    return latency_names[kind];
+}
+
+int bcache_trace_open(struct bcache *bc, const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (!f) return -1;
+    fprintf(f, "# op disk block blocks queue_wait_ns seek service_ns\n");
+
+    pthread_mutex_lock(&bc->trace_lock);
+    if (bc->trace) fclose(bc->trace);
+    bc->trace = f;
+    pthread_mutex_unlock(&bc->trace_lock);
+    return 0;
+}
+
+void bcache_trace_close(struct bcache *bc) {
+    pthread_mutex_lock(&bc->trace_lock);
+    if (bc->trace) fclose(bc->trace);
+    bc->trace = NULL;
+    pthread_mutex_unlock(&bc->trace_lock);
+}
+
+int bcache_record_open(struct bcache *bc, const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (!f) return -1;
+    fprintf(f, "# thread op block time_ns\n");
+
+    pthread_mutex_lock(&bc->record_lock);
+    if (bc->record) fclose(bc->record);
+    bc->record_start = now_ns();
+    bc->record = f;
+    pthread_mutex_unlock(&bc->record_lock);
+    return 0;
+}
+
+void bcache_record_close(struct bcache *bc) {
+    pthread_mutex_lock(&bc->record_lock);
+    if (bc->record) fclose(bc->record);
+    bc->record = NULL;
+    pthread_mutex_unlock(&bc->record_lock);
+}
+
+/*
+A saved state is a header line followed by one line per resident block, giving the
+block, its rank in its shard's eviction order, 0 for the block that would be kept
+longest, and how often the admission policy has seen it lately.  The blocks are
+listed by rank, so the shards' hottest blocks come first.
+*/
+#define STATE_HEADER "# bcache-state 1: block rank frequency\n"
+
+struct state_entry {
+    int blocknum;
+    int rank;
+    int freq;
+};
+
+struct state_walk {
+    struct state_entry *entries;
+    int n;
+};
+
+/* Note down a block met by evict_walk if it holds data.  Called with its shard's cache_lock held. */
+static void state_visit(struct evict_node *n, void *arg) {
+    struct state_walk *w = arg;
+    struct block *blk = EVICT_TO_BLOCK(n);
+    int resident;
+
+    lock_mutex(blk->shard->bc, &blk->lock);
+    // A block still being read holds nothing yet, and may never be used.
+    resident = blk->state == BLOCK_READY || blk->state == BLOCK_DIRTY || blk->state == BLOCK_WRITING;
+    pthread_mutex_unlock(&blk->lock);
+    if (resident) w->entries[w->n++].blocknum = blk->blocknum;
+}
+
+static int compare_rank(const void *a, const void *b) {
+    const struct state_entry *x = a, *y = b;
+    if (x->rank != y->rank) return x->rank < y->rank ? -1 : 1;
+    return x->blocknum < y->blocknum ? -1 : x->blocknum > y->blocknum;
+}
+
+static int compare_request_block(const void *a, const void *b) {
+    const struct io_request *x = a, *y = b;
+    return x->blocknum < y->blocknum ? -1 : x->blocknum > y->blocknum;
+}
+
+int bcache_save_state(struct bcache *bc, const char *filename) {
+    struct state_entry *entries = malloc(sizeof(*entries) * bc->memory_blocks);
+    FILE *f;
+    int i, j, n = 0, ok;
+
+    if (!entries) return -1;
+    for (i = 0; i < bc->nshards; i++) {
+        struct shard *sh = &bc->shards[i];
+        struct state_walk w = { entries + n, 0 };
+        lock_mutex(bc, &sh->cache_lock);
+        evict_walk(sh->evict, state_visit, &w);
+        pthread_mutex_unlock(&sh->cache_lock);
+        // The walk starts from the block the policy would give up first.
+        for (j = 0; j < w.n; j++) {
+            w.entries[j].rank = w.n - 1 - j;
+            w.entries[j].freq = admit_estimate(sh->admit, w.entries[j].blocknum);
+        }
+        n += w.n;
+    }
+    qsort(entries, n, sizeof(*entries), compare_rank);
+
+    f = fopen(filename, "w");
+    if (!f) {
+        free(entries);
+        return -1;
+    }
+    ok = fputs(STATE_HEADER, f) >= 0;
+    for (i = 0; ok && i < n; i++) {
+        ok = fprintf(f, "%d %d %d\n", entries[i].blocknum, entries[i].rank, entries[i].freq) > 0;
+    }
+    if (fclose(f) != 0) ok = 0;
+    free(entries);
+    return ok ? n : -1;
+}
+
+int bcache_load_state(struct bcache *bc, const char *filename) {
+    struct state_entry *entries;
+    struct io_request *reqs;
+    char header[sizeof(STATE_HEADER)];
+    int i, j, n = 0, nreqs = 0;
+    FILE *f = fopen(filename, "r");
+
+    if (!f) return -1;
+    if (!fgets(header, sizeof(header), f) || strcmp(header, STATE_HEADER)) {
+        fclose(f);
+        errno = EINVAL;
+        return -1;
+    }
+    entries = malloc(sizeof(*entries) * bc->memory_blocks);
+    reqs = malloc(sizeof(*reqs) * bc->memory_blocks);
+    if (!entries || !reqs) {
+        free(entries);
+        free(reqs);
+        fclose(f);
+        return -1;
+    }
+    // The hottest blocks come first, so a smaller cache keeps the ones that matter most.
+    while (n < bc->memory_blocks && fscanf(f, "%d %d %d", &entries[n].blocknum, &entries[n].rank, &entries[n].freq) == 3) {
+        if (entries[n].blocknum >= 0 && entries[n].blocknum < bc->nblocks) n++;
+    }
+    fclose(f);
+
+    // Going in coldest first leaves each block ahead of those that were kept longer.
+    for (i = n - 1; i >= 0; i--) {
+        struct block *frame;
+        struct shard *sh = shard_for(bc, entries[i].blocknum);
+        for (j = 0; j < entries[i].freq; j++) admit_record(sh->admit, entries[i].blocknum);
+        frame = insert_prefetch(bc, entries[i].blocknum, PREFETCH_WARM);
+        if (!frame) continue;
+        reqs[nreqs].blocknum = entries[i].blocknum;
+        reqs[nreqs].type = IO_READ;
+        reqs[nreqs].prio = IOPRIO_PREFETCH;
+        reqs[nreqs].owner = frame;
+        nreqs++;
+    }
+
+    // Read-ahead class keeps the warm-up behind every read a thread waits for.
+    qsort(reqs, nreqs, sizeof(*reqs), compare_request_block);
+    if (nreqs > 0) submit_batch(bc, reqs, nreqs);
+    stat_add(bc, STAT_WARMED, nreqs);
+    free(entries);
+    free(reqs);
+    return nreqs;
+}
+
+/*
+These functions just return basic information about the buffer cache,
+and you shouldn't need to change them.
+*/
+
+/* Return the number of memory blocks in the buffer cache. */
+
+int bcache_memory_blocks( struct bcache *bc )
+{
+	return bc->memory_blocks;
+}
+
+/* Return the eviction policy in use by the buffer cache. */
+
+evict_kind bcache_evict_policy( struct bcache *bc )
+{
+	return bc->evict_kind;
+}
+
+/* Return the admission policy in use by the buffer cache. */
+
+admit_kind bcache_admit_policy( struct bcache *bc )
+{
+	return bc->admit_kind;
+}
+
+/* Return the request ordering policy used by the I/O scheduler. */
+
+iosched_kind bcache_sched_policy( struct bcache *bc )
+{
+	return iosched_policy(bc->spindles[0].queue);
+}
+
+/* Return the number of blocks requested by read-ahead. */
+
+int bcache_prefetch_issued( struct bcache *bc )
+{
+	return (int)stat_sum(bc,STAT_PREFETCH_ISSUED);
+}
+
+/* Return the number of prefetched blocks that were read before eviction. */
+
+int bcache_prefetch_hits( struct bcache *bc )
+{
+	return (int)stat_sum(bc,STAT_PREFETCH_HITS);
+}
+
+/* Return the number of prefetched blocks that were evicted without being read. */
+
+int bcache_prefetch_wasted( struct bcache *bc )
+{
+	return (int)stat_sum(bc,STAT_PREFETCH_WASTED);
+}
+
+/* Return the number of blocks in the underlying volume. */
+
+int bcache_disk_blocks( struct bcache *bc )
+{
+	return bc->nblocks;
+}
+
+/* Return the number of disks in the underlying volume. */
+
+int bcache_ndisks( struct bcache *bc )
 {
-	return disk_nblocks(bc->disk);
+	return bc->nspindles;
 }
 
 /* Return the number of reads performed on this buffer cache. */
 
 int bcache_nreads( struct bcache *bc )
 {
-	return bc->nreads;
+	return (int)stat_sum(bc,STAT_READS);
 }
 
 /* Return the number of writes performed on this buffer cache. */
 
 int bcache_nwrites( struct bcache *bc )
 {
-	return bc->nwrites;
+	return (int)stat_sum(bc,STAT_WRITES);
 }
\ No newline at end of file
@@ -6,33 +6,338 @@ The interface to the buffer cache module.
 You should read and understand this file, but shouldn't change it.
 */
 
+#include "admit.h"
 #include "disk.h"
+#include "evict.h"
+#include "iosched.h"
+#include "volume.h"
+#include "ztier.h"
+
+/* Tunable parameters of a buffer cache, fixed when the cache is created. */
+struct bcache_config {
+    int memory_blocks;           // Maximum number of blocks held in memory.
+    evict_kind evict_policy;     // Which policy chooses blocks to evict.
+    admit_kind admit_policy;     // Which policy decides whether a missed block may displace the evicted one.
+    iosched_kind sched_policy;   // Order in which the I/O scheduler serves requests.
+    int reads_first;             // Serve pending read misses before writeback unless frames run short.
+    int batch_blocks;            // Hold writeback until this many blocks are queued...
+    int batch_ms;                // ...or the oldest has waited this long; 0 leaves only dirty_age_ms. A batch of 1 disables batching.
+    int readahead_max;           // Largest sequential read-ahead window; 0 disables read-ahead.
+    int prefetch_depth;          // Most read-ahead requests queued per disk before more are skipped; 0 for no limit.
+    int journal_blocks;          // Blocks at the end of the disk kept for a write-ahead log; 0 disables it.
+    int dirty_low;               // Percent of memory_blocks dirty above which writeback runs despite batching.
+    int dirty_high;              // Percent dirty above which writers are slowed down; 100 disables throttling.
+    int dirty_age_ms;            // Write back dirty blocks once their writeback has waited this long, however batched; 0 for no limit.
+    int shards;                  // Independent partitions of the cache, each with its own share of the frames; 1 for none.
+    int shard_blocks;            // Hand out blocks to the shards in runs of this many; 0 hashes each block to a shard.
+    int numa;                    // Place the shards' memory on the machine's memory nodes, going round them in turn.
+    int mapped;                  // Point each frame at its block's page of a disk from disk_open_mapped, instead of copying.
+    int ztier_kb;                // Memory in KB for compressed copies of evicted clean blocks; 0 for none.
+};
+
+/* Fill in a configuration with the default settings for "memoryblocks" blocks. */
+void bcache_config_init( struct bcache_config *cfg, int memoryblocks );
 
 /* Create a new buffer cache layer with a given disk d and memory blocks. */
 struct bcache * bcache_create( struct disk *d, int memoryblocks );
 
+/*
+Create a new buffer cache layer on disk d with the given configuration.
+With a journal, the cache only uses the blocks ahead of it, and any writes
+logged before a crash are copied to their home blocks first.
+*/
+struct bcache * bcache_create_config( struct disk *d, const struct bcache_config *cfg );
+
+/*
+Create a new buffer cache layer over all the disks of volume v, which must outlive the cache.
+Block numbers are those of the volume. Each disk gets its own request queue and scheduler,
+so transfers to different disks proceed in parallel.
+*/
+struct bcache * bcache_create_volume( struct volume *v, const struct bcache_config *cfg );
+
 /* Read a block out of the buffer cache, and fill "buffer" with 4KB of data. */
 void bcache_read( struct bcache *bc, int block, char *buffer );
 
-/* Write a block in the buffer cache, filling in with 4KB of provided data. */
+/*
+Write a block in the buffer cache, filling in with 4KB of provided data.
+With a journal, the write is also appended to the log before this returns, so it survives a crash.
+The same goes for bcache_writev, bcache_write_range, bcache_put of a writable pin
+and bcache_write_async, whose request completes once its record is on disk.
+While more than dirty_high percent of the cache is dirty, these calls also pause
+before returning, for longer the further over the watermark the cache is.
+*/
 void bcache_write( struct bcache *bc, int block, const char *data );
 
-/* Block until all dirty blocks in the buffer cache have been written. */
+/*
+Read "count" blocks: blocks[i] is copied into the 4KB at buffers[i].
+Cached blocks are resolved in one pass and all misses go to the scheduler together.
+*/
+void bcache_readv( struct bcache *bc, const int *blocks, char *const *buffers, int count );
+
+/* Write "count" blocks: the 4KB at buffers[i] becomes the contents of blocks[i]. */
+void bcache_writev( struct bcache *bc, const int *blocks, const char *const *buffers, int count );
+
+/* Read blocks first..first+count-1 into the count*4KB at "buffer". */
+void bcache_read_range( struct bcache *bc, int first, int count, char *buffer );
+
+/* Write the count*4KB at "data" into blocks first..first+count-1. */
+void bcache_write_range( struct bcache *bc, int first, int count, const char *data );
+
+/* A read or write started with bcache_read_async or bcache_write_async. */
+struct bcache_request;
+
+/*
+Called once when an asynchronous request completes, either on the submitting
+thread for a block already in memory, or on the I/O scheduler thread after a miss.
+It should be short, and must not make calls that wait, such as bcache_read or bcache_wait.
+*/
+typedef void (*bcache_callback)( struct bcache_request *req, void *arg );
+
+/*
+Start reading a block into the 4KB at "buffer", which must stay valid until the request completes.
+"callback" may be null. Submission only waits if every frame is busy.
+Returns a request to poll, wait on and free, or null if out of memory.
+*/
+struct bcache_request * bcache_read_async( struct bcache *bc, int block, char *buffer, bcache_callback callback, void *arg );
+
+/*
+Start writing the 4KB at "data" into a block, which completes once the data is in the cache,
+and with a journal once it is logged too, which the submitting thread waits for.
+*/
+struct bcache_request * bcache_write_async( struct bcache *bc, int block, const char *data, bcache_callback callback, void *arg );
+
+/* Return non-zero if the request has completed. */
+int bcache_poll( struct bcache_request *req );
+
+/* Block until the request has completed. */
+void bcache_wait( struct bcache_request *req );
+
+/*
+Release a request. If it has not completed yet, it is released after completion instead,
+so callers that only want the callback may free the request right after submitting it.
+*/
+void bcache_request_free( struct bcache_request *req );
+
+/* How a block is pinned by bcache_get. */
+typedef enum {
+    BCACHE_PIN_READ,     // Shared; the frame must not be modified.
+    BCACHE_PIN_WRITE     // Exclusive; the block is marked dirty when unpinned.
+} bcache_pin_mode;
+
+/*
+Pin a block in the cache and return a pointer to its 4KB frame, without copying.
+The frame cannot be evicted or overwritten by others until bcache_put is called.
+A thread must not access a block it has write-pinned through any other call,
+and should hold only a few pins at once, since each one keeps a frame busy.
+*/
+char * bcache_get( struct bcache *bc, int block, bcache_pin_mode mode );
+
+/* Release a pin, passing the pointer and mode given to bcache_get. */
+void bcache_put( struct bcache *bc, char *data, bcache_pin_mode mode );
+
+/*
+Block until all blocks that are dirty when this is called have been written, and empty the journal.
+The writes go to the I/O scheduler as one sorted batch, and other calls carry on meanwhile.
+*/
 void bcache_sync( struct bcache *bc );
 
-/* The function containing the background I/O scheduler. */
+/*
+Like bcache_sync, but only for blocks lo..hi-1, so unrelated dirty blocks stay in memory.
+The journal is left as it is.
+*/
+void bcache_sync_range( struct bcache *bc, int lo, int hi );
+
+/*
+Start writing back blocks lo..hi-1 that are dirty right now, without waiting.
+The request completes once they are all on disk, and works like one from bcache_read_async.
+The journal is left as it is. Returns null if out of memory.
+*/
+struct bcache_request * bcache_sync_async( struct bcache *bc, int lo, int hi, bcache_callback callback, void *arg );
+
+/*
+The function containing the background I/O scheduler.
+It performs every read miss and writeback, so it must be running
+before the cache is used.  On a volume of several disks it starts
+one more scheduler thread for each disk after the first.
+*/
 void * bcache_io_scheduler( void *bc );
 
+/*
+A snapshot of the cache's counters, summed across threads when it is taken.
+Hits and misses count reads, pins and asynchronous reads by whether the block was resident.
+*/
+struct bcache_stats {
+    long long reads;             // Blocks read through the cache.
+    long long writes;            // Blocks written through the cache.
+    long long hits;              // Reads served from memory, including blocks brought back from the compressed tier.
+    long long misses;            // Reads that had to go to disk.
+    long long evictions;         // Clean blocks given up to make room.
+    long long admitted;          // Missed blocks let in as usual in place of a victim.
+    long long rejected;          // Missed blocks held as cold because the victim had been used more often.
+    long long writebacks;        // Dirty blocks written to disk.
+    long long coalesced_writes;  // Writes absorbed by a writeback already queued.
+    long long prefetch_issued;   // Blocks requested by read-ahead.
+    long long prefetch_hits;     // Prefetched blocks read before eviction.
+    long long prefetch_wasted;   // Prefetched blocks evicted unused.
+    long long prefetch_dropped;  // Read-ahead skipped because the disk already had prefetch_depth queued.
+    long long prefetch_promoted; // Queued read-ahead moved up to read priority because a thread began waiting for it.
+    long long lock_wait_ns;      // Time threads spent blocked on cache locks.
+    long long journaled;         // Blocks appended to the journal.
+    long long journal_records;   // Journal appends, each a header and the blocks of one or more writers.
+    long long checkpoints;       // Times every dirty block was written home so the journal could start over.
+    int journal_replayed;        // Blocks copied home from the journal when the cache was created.
+    long long throttled;         // Writes held back because too much of the cache was dirty.
+    long long throttle_ns;       // Time writers spent held back.
+    long long warmed;            // Blocks queued for reading by bcache_load_state.
+    int dirty;                   // Blocks dirty or being written right now.
+    int queue_depth;             // Disk requests pending right now, over all disks.
+    int queue_peak;              // Most requests ever pending at once on any one disk.
+    struct ztier_stats ztier;    // The compressed tier, over all shards; all zero without one.
+};
+
+/* Fill in "stats" with the current counters of the cache. */
+void bcache_get_stats( struct bcache *bc, struct bcache_stats *stats );
+
+/* The activity of one disk of the cache's volume. */
+struct bcache_disk_stats {
+    int reads;                   // disk_nreads of the disk.
+    int writes;                  // disk_nwrites of the disk.
+    long long transfers;         // Transfers, counting each merged run once.
+    long long busy_ns;           // Time spent in those transfers.
+    int queue_depth;             // Requests pending for the disk right now.
+    int queue_peak;              // Most requests ever pending for the disk at once.
+};
+
+/* Fill in "stats" with the counters of disk "disk" of the volume, counting from 0. */
+void bcache_get_disk_stats( struct bcache *bc, int disk, struct bcache_disk_stats *stats );
+
+/* The activity of one shard of the cache. */
+struct bcache_shard_stats {
+    int frames;                  // Memory blocks the shard holds.
+    int node;                    // Memory node its memory was placed on, or -1.
+    long long hits;              // Reads of the shard's blocks served from memory.
+    long long misses;            // Reads of the shard's blocks that had to go to disk.
+    long long evictions;         // Clean blocks the shard gave up to make room.
+    long long prefetch_issued;   // Blocks of the shard requested by read-ahead.
+};
+
+/* Fill in "stats" with the counters of shard "shard", counting from 0. */
+void bcache_get_shard_stats( struct bcache *bc, int shard, struct bcache_shard_stats *stats );
+
+/* Return the number of shards the cache is split into. */
+int bcache_nshards( struct bcache *bc );
+
+/* Return the shard that holds "block". */
+int bcache_shard_of( struct bcache *bc, int block );
+
+/*
+Let the calling thread run only on the CPUs next to the memory of shard "shard",
+so that a thread working mostly on that shard's blocks stays local to them.
+Returns 0 on success, or -1 if the shard's memory was not placed or the CPUs could not be set.
+*/
+int bcache_bind_thread( struct bcache *bc, int shard );
+
+/* The operations whose latency the cache keeps a histogram of. */
+typedef enum {
+    BCACHE_LATENCY_READ_HIT,     // bcache_read of a block already in memory.
+    BCACHE_LATENCY_READ_MISS,    // bcache_read that waited for the disk.
+    BCACHE_LATENCY_WRITE,        // bcache_write.
+    BCACHE_LATENCY_DISK_READ,    // One disk_read, excluding time queued.
+    BCACHE_LATENCY_DISK_WRITE,   // One disk_write, excluding time queued.
+    BCACHE_LATENCY_IO_READ,      // A read miss request, from being queued until its transfer ends.
+    BCACHE_LATENCY_IO_SYNC,      // The same for a writeback a sync waits for...
+    BCACHE_LATENCY_IO_PREFETCH,  // ...a read-ahead request...
+    BCACHE_LATENCY_IO_WRITEBACK, // ...and a background writeback; one per io_class, in the same order.
+    BCACHE_NLATENCY
+} bcache_latency_kind;
+
+/* Percentiles of one latency histogram, in nanoseconds, each within about 12% of the true value. */
+struct bcache_latency {
+    long long count;             // Operations recorded.
+    long long p50;
+    long long p99;
+    long long p999;
+    long long max;
+};
+
+/* Fill in "lat" with the latency percentiles of one kind of operation. */
+void bcache_get_latency( struct bcache *bc, bcache_latency_kind kind, struct bcache_latency *lat );
+
+/* Return the printable name of a latency kind. */
+const char * bcache_latency_name( bcache_latency_kind kind );
+
+/*
+Start logging every disk transfer to "filename", one line per transfer giving
+the direction, the disk, its first block on that disk, number of blocks,
+time spent queued, seek distance and service time.
+Returns 0 on success, -1 if the file cannot be created.
+*/
+int bcache_trace_open( struct bcache *bc, const char *filename );
+
+/* Stop logging disk transfers and close the trace file. */
+void bcache_trace_close( struct bcache *bc );
+
+/*
+Start logging every block access made through the cache to "filename", one line
+per block giving the calling thread, the operation, the block and the time since
+recording started.  The log can be replayed with the functions in replay.h.
+Returns 0 on success, -1 if the file cannot be created.
+*/
+int bcache_record_open( struct bcache *bc, const char *filename );
+
+/* Stop logging block accesses and close the log. */
+void bcache_record_close( struct bcache *bc );
+
+/*
+Save the blocks resident in the cache to "filename", with their place in the
+eviction order and how often they have been used lately, so that a later
+cache can be warmed with them by bcache_load_state.  The data is not saved;
+dirty blocks should be synced first, since the next cache reads them from disk.
+Returns the number of blocks saved, or -1 if the file cannot be written.
+*/
+int bcache_save_state( struct bcache *bc, const char *filename );
+
+/*
+Warm the cache with the blocks saved by bcache_save_state to "filename".
+As many as fit are given frames in their saved order and handed to the disks as
+read-ahead in block order, so the reads go out as an elevator sweep in the
+background, behind any read a thread is waiting for.  A thread that reads a
+block still on its way waits for it as for any read-ahead.  Nothing is written.
+Returns the number of blocks queued, or -1 if the file cannot be read or is not a saved state.
+*/
+int bcache_load_state( struct bcache *bc, const char *filename );
+
 /* Return the number of memory blocks in the buffer cache. */
 int bcache_memory_blocks( struct bcache *bc );
 
-/* Return the number of blocks in the disk underlying the cache. */
+/* Return the eviction policy in use by the buffer cache. */
+evict_kind bcache_evict_policy( struct bcache *bc );
+
+/* Return the admission policy in use by the buffer cache. */
+admit_kind bcache_admit_policy( struct bcache *bc );
+
+/* Return the request ordering policy used by the I/O scheduler. */
+iosched_kind bcache_sched_policy( struct bcache *bc );
+
+/* Return the number of blocks in the disk or volume underlying the cache, not counting the journal. */
 int bcache_disk_blocks( struct bcache *bc );
 
+/* Return the number of disks underlying the cache. */
+int bcache_ndisks( struct bcache *bc );
+
 /* Return the total number of reads performed on this cache. */
 int bcache_nreads( struct bcache *bc );
 
 /* Return the total number of writes performed on this cache. */
 int bcache_nwrites( struct bcache *bc );
 
+/* Return the number of blocks requested by read-ahead. */
+int bcache_prefetch_issued( struct bcache *bc );
+
+/* Return the number of prefetched blocks that were read before eviction. */
+int bcache_prefetch_hits( struct bcache *bc );
+
+/* Return the number of prefetched blocks that were evicted without being read. */
+int bcache_prefetch_wasted( struct bcache *bc );
+
 #endif
\ No newline at end of file
@@ -0,0 +1,390 @@
+/*
+This is a benchmark driver for the buffer cache.
+Unlike the fixed alpha/beta/gamma mix in program.c, every run is described by a
+workload spec and seeded, so results can be reproduced and compared over time.
+Each point of the threads x memory blocks x disk blocks sweep runs in its own
+process on a freshly filled disk, and emits one CSV row or JSON object.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "program.h"
+#include "bcache.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAX_SWEEP 16
+
+typedef enum {
+    WORKLOAD_UNIFORM,            // Every block of the working set is equally likely.
+    WORKLOAD_ZIPF,               // Block k of the working set is chosen with weight 1/(k+1)^theta.
+    WORKLOAD_SEQ                 // Each thread walks the working set in order from its own offset.
+} workload_kind;
+
+static const char *workload_names[] = { "uniform", "zipf", "seq" };
+
+struct workload {
+    workload_kind kind;
+    double theta;                // Zipf skew.
+    int read_pct;                // Percentage of operations that are reads.
+    int working_set;             // Blocks at the start of the disk that are accessed; 0 means all.
+    int ops;                     // Operations per thread; 0 means only the duration applies.
+    double duration;             // Seconds each point may run; 0 means only the op count applies.
+    unsigned long long seed;     // Base seed; thread i uses a stream derived from seed and i.
+};
+
+/* How the disk is reached, which matters once its seek delay is off. */
+typedef enum {
+    BACKEND_COPY,                // pread and pwrite into the cache's own frames.
+    BACKEND_DISK,                // The image is mapped, and blocks are copied to and from the mapping.
+    BACKEND_FRAMES,              // The cache's frames are the mapped pages themselves.
+    BACKEND_DIRECT               // O_DIRECT transfers with the real device's timing, several in flight.
+} backend_kind;
+
+static const char *backend_names[] = { "copy", "disk", "frames", "direct" };
+
+struct backend {
+    backend_kind kind;
+    int delay;                   // Keep the disk's simulated seek delay.
+    int depth;                   // Transfers the direct backend may keep in flight.
+};
+
+struct bench_thread {
+    struct bcache *bc;
+    const struct workload *w;
+    const double *zipf_cdf;      // Cumulative Zipf weights over the working set, or null.
+    int working_set;
+    int id;
+    int nthreads;
+    long long ops;               // Operations completed.
+    double deadline;             // Stop time on the monotonic clock, or 0.
+    int bind;                    // Move next to the memory of shard id % shards first.
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* splitmix64: small, fast, and good enough to drive a workload; each thread has its own state. */
+static unsigned long long next_random(unsigned long long *state) {
+    unsigned long long z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double next_unit(unsigned long long *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double *zipf_table(int n, double theta) {
+    double *cdf = malloc(sizeof(double) * n);
+    double total = 0;
+    int i;
+    if (!cdf) return NULL;
+    for (i = 0; i < n; i++) {
+        total += 1.0 / pow(i + 1, theta);
+        cdf[i] = total;
+    }
+    for (i = 0; i < n; i++) cdf[i] /= total;
+    return cdf;
+}
+
+static int zipf_pick(const double *cdf, int n, double u) {
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* The disk is filled by program_fill_disk, so the first byte of every 16 names the block. */
+static void check_block(const char *data, int blocknum) {
+    int i;
+    for (i = 0; i < BLOCK_SIZE; i += 16) {
+        if (data[i] != (char)blocknum) {
+            printf("CRASH: bcache_read of block %d returned incorrect data from block %d instead!\n", blocknum, data[i]);
+            abort();
+        }
+    }
+}
+
+static void *bench_thread(void *arg) {
+    struct bench_thread *t = arg;
+    const struct workload *w = t->w;
+    unsigned long long rng = w->seed ^ (0x632be59bd9b4e019ULL * (t->id + 1));
+    char data[BLOCK_SIZE];
+    int seq = (int)((long long)t->working_set * t->id / t->nthreads);
+    int i;
+
+    // Writes keep the pattern of program_fill_disk, so every read can still be checked.
+    for (i = 0; i < BLOCK_SIZE; i++) data[i] = (char)i;
+    if (t->bind) bcache_bind_thread(t->bc, t->id % bcache_nshards(t->bc));
+
+    while ((w->ops == 0 || t->ops < w->ops) && (t->deadline == 0 || now_seconds() < t->deadline)) {
+        int blocknum;
+        switch (w->kind) {
+        case WORKLOAD_ZIPF:
+            blocknum = zipf_pick(t->zipf_cdf, t->working_set, next_unit(&rng));
+            break;
+        case WORKLOAD_SEQ:
+            blocknum = seq;
+            seq = (seq + 1) % t->working_set;
+            break;
+        default:
+            blocknum = (int)(next_random(&rng) % t->working_set);
+            break;
+        }
+
+        if ((int)(next_random(&rng) % 100) < w->read_pct) {
+            bcache_read(t->bc, blocknum, data);
+            check_block(data, blocknum);
+        } else {
+            for (i = 0; i < BLOCK_SIZE; i += 16) data[i] = (char)blocknum;
+            bcache_write(t->bc, blocknum, data);
+        }
+        t->ops++;
+    }
+    return NULL;
+}
+
+/* Run one point of the sweep and print its result. Returns 0 on success. */
+static int bench_point(const struct workload *w, const struct backend *be, const struct bcache_config *base, int nthreads, int mblocks, int dblocks, int json, int index) {
+    struct bcache_config config = *base;
+    struct bcache_stats stats;
+    struct bcache_latency hit, miss, write;
+    struct bench_thread *threads;
+    pthread_t scheduler, *tids;
+    double *cdf = NULL, start, elapsed, ratio;
+    long long ops = 0;
+    int i, working_set = w->working_set > 0 && w->working_set < dblocks ? w->working_set : dblocks;
+
+    disk_backend kind = be->kind == BACKEND_COPY ? DISK_SIM : be->kind == BACKEND_DIRECT ? DISK_DIRECT : DISK_MMAP;
+    struct disk *d = disk_open_backend("benchdisk", dblocks, kind, be->depth);
+    if (!d) {
+        fprintf(stderr, "couldn't open benchdisk\n");
+        return -1;
+    }
+    disk_set_delay(d, be->delay);
+    program_fill_disk(d);
+    disk_reset_stats(d);
+
+    config.memory_blocks = mblocks;
+    config.mapped = be->kind == BACKEND_FRAMES;
+    struct bcache *bc = bcache_create_config(d, &config);
+    if (!bc) return -1;
+    if (w->kind == WORKLOAD_ZIPF && !(cdf = zipf_table(working_set, w->theta))) return -1;
+
+    pthread_create(&scheduler, 0, bcache_io_scheduler, bc);
+
+    threads = calloc(nthreads, sizeof(*threads));
+    tids = malloc(sizeof(*tids) * nthreads);
+    if (!threads || !tids) return -1;
+
+    start = now_seconds();
+    for (i = 0; i < nthreads; i++) {
+        threads[i].bc = bc;
+        threads[i].w = w;
+        threads[i].zipf_cdf = cdf;
+        threads[i].working_set = working_set;
+        threads[i].id = i;
+        threads[i].nthreads = nthreads;
+        threads[i].deadline = w->duration > 0 ? start + w->duration : 0;
+        threads[i].bind = config.numa;
+        pthread_create(&tids[i], 0, bench_thread, &threads[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], 0);
+        ops += threads[i].ops;
+    }
+    bcache_sync(bc);
+    elapsed = now_seconds() - start;
+
+    bcache_get_stats(bc, &stats);
+    bcache_get_latency(bc, BCACHE_LATENCY_READ_HIT, &hit);
+    bcache_get_latency(bc, BCACHE_LATENCY_READ_MISS, &miss);
+    bcache_get_latency(bc, BCACHE_LATENCY_WRITE, &write);
+    ratio = stats.ztier.packed_bytes ? (double)stats.ztier.raw_bytes / stats.ztier.packed_bytes : 0;
+
+    if (json) {
+        printf("%s  {\"threads\": %d, \"memory_blocks\": %d, \"disk_blocks\": %d, \"evict\": \"%s\", \"sched\": \"%s\", "
+               "\"workload\": \"%s\", \"read_pct\": %d, \"working_set\": %d, \"seed\": %llu, \"ops\": %lld, "
+               "\"elapsed_s\": %.3f, \"ops_per_s\": %.2f, \"hits\": %lld, \"misses\": %lld, "
+               "\"disk_reads\": %d, \"disk_writes\": %d, \"read_hit_p99_ms\": %.3f, "
+               "\"read_miss_p50_ms\": %.3f, \"read_miss_p99_ms\": %.3f, \"write_p99_ms\": %.3f, \"shards\": %d, "
+               "\"admit\": \"%s\", \"rejected\": %lld, \"backend\": \"%s\", \"delay\": %d, \"depth\": %d, "
+               "\"ztier_kb\": %d, \"ztier_hits\": %lld, \"ztier_ratio\": %.2f}",
+               index > 0 ? ",\n" : "", nthreads, mblocks, dblocks, evict_name(config.evict_policy), iosched_name(config.sched_policy),
+               workload_names[w->kind], w->read_pct, working_set, w->seed, ops,
+               elapsed, ops / elapsed, stats.hits, stats.misses,
+               disk_nreads(d), disk_nwrites(d), hit.p99 / 1e6,
+               miss.p50 / 1e6, miss.p99 / 1e6, write.p99 / 1e6, bcache_nshards(bc),
+               admit_name(config.admit_policy), stats.rejected, backend_names[be->kind], be->delay, disk_depth(d),
+               config.ztier_kb, stats.ztier.hits, ratio);
+    } else {
+        printf("%d,%d,%d,%s,%s,%s,%d,%d,%llu,%lld,%.3f,%.2f,%lld,%lld,%d,%d,%.3f,%.3f,%.3f,%.3f,%d,%s,%lld,%s,%d,%d,%d,%lld,%.2f\n",
+               nthreads, mblocks, dblocks, evict_name(config.evict_policy), iosched_name(config.sched_policy),
+               workload_names[w->kind], w->read_pct, working_set, w->seed, ops,
+               elapsed, ops / elapsed, stats.hits, stats.misses,
+               disk_nreads(d), disk_nwrites(d), hit.p99 / 1e6,
+               miss.p50 / 1e6, miss.p99 / 1e6, write.p99 / 1e6, bcache_nshards(bc),
+               admit_name(config.admit_policy), stats.rejected, backend_names[be->kind], be->delay, disk_depth(d),
+               config.ztier_kb, stats.ztier.hits, ratio);
+    }
+    fflush(stdout);
+    disk_close(d);
+    return 0;
+}
+
+/* Parse a comma separated list of positive integers. Returns the count, or -1. */
+static int parse_list(const char *s, int *values) {
+    int n = 0;
+    while (*s) {
+        char *end;
+        long v = strtol(s, &end, 10);
+        if (end == s || v <= 0 || n == MAX_SWEEP) return -1;
+        values[n++] = (int)v;
+        s = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') return -1;
+    }
+    return n;
+}
+
+static void usage(const char *prog) {
+    printf("use: %s [-w uniform|zipf|seq] [-z theta] [-p read-percent] [-k working-set]\n"
+           "          [-n ops-per-thread] [-T seconds] [-S seed] [-t threads,...] [-m memory-blocks,...]\n"
+           "          [-D disk-blocks,...] [-e lru|clock|2q] [-s fifo|sstf|scan|clook] [-f csv|json]\n"
+           "          [-x shards] [-N 0|1] [-A all|tinylfu] [-M copy|disk|frames|direct]\n"
+           "          [-d 0|1] [-q queue-depth] [-Z ztier-kb]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    struct workload w = { WORKLOAD_ZIPF, 0.99, 70, 0, 100, 0, 1 };
+    struct backend be = { BACKEND_COPY, 1, 1 };
+    struct bcache_config config;
+    int threads[MAX_SWEEP] = { 1, 4 }, nthreads = 2;
+    int memory[MAX_SWEEP] = { 20, 50 }, nmemory = 2;
+    int disks[MAX_SWEEP] = { 200 }, ndisks = 1;
+    int json = 0, i, j, k, index = 0;
+
+    bcache_config_init(&config, 0);
+
+    for (i = 1; i < argc; i++) {
+        const char *opt = argv[i], *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!val || opt[0] != '-' || strlen(opt) != 2) {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+        switch (opt[1]) {
+        case 'w':
+            for (k = 0; k < 3 && strcmp(val, workload_names[k]); k++);
+            if (k == 3) {
+                printf("unknown workload: %s\n", val);
+                return 1;
+            }
+            w.kind = (workload_kind)k;
+            break;
+        case 'z': w.theta = atof(val); break;
+        case 'p': w.read_pct = atoi(val); break;
+        case 'k': w.working_set = atoi(val); break;
+        case 'n': w.ops = atoi(val); break;
+        case 'T': w.duration = atof(val); break;
+        case 'S': w.seed = strtoull(val, NULL, 10); break;
+        case 't': nthreads = parse_list(val, threads); break;
+        case 'm': nmemory = parse_list(val, memory); break;
+        case 'D': ndisks = parse_list(val, disks); break;
+        case 'x': config.shards = atoi(val); break;
+        case 'Z': config.ztier_kb = atoi(val); break;
+        case 'N': config.numa = atoi(val); break;
+        case 'd': be.delay = atoi(val); break;
+        case 'q': be.depth = atoi(val); break;
+        case 'M':
+            for (k = 0; k < 4 && strcmp(val, backend_names[k]); k++);
+            if (k == 4) {
+                printf("unknown backend: %s\n", val);
+                return 1;
+            }
+            be.kind = (backend_kind)k;
+            break;
+        case 'f':
+            if (strcmp(val, "csv") && strcmp(val, "json")) {
+                printf("unknown format: %s\n", val);
+                return 1;
+            }
+            json = !strcmp(val, "json");
+            break;
+        case 'e':
+            if (evict_parse(val, &config.evict_policy) < 0) {
+                printf("unknown eviction policy: %s\n", val);
+                return 1;
+            }
+            break;
+        case 'A':
+            if (admit_parse(val, &config.admit_policy) < 0) {
+                printf("unknown admission policy: %s\n", val);
+                return 1;
+            }
+            break;
+        case 's':
+            if (iosched_parse(val, &config.sched_policy) < 0) {
+                printf("unknown scheduling policy: %s\n", val);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads < 0 || nmemory < 0 || ndisks < 0) {
+        printf("sweep lists must be comma separated positive numbers\n");
+        return 1;
+    }
+    if (w.ops <= 0 && w.duration <= 0) {
+        printf("one of -n and -T must be positive\n");
+        return 1;
+    }
+
+    if (json) {
+        printf("[\n");
+    } else {
+        printf("threads,memory_blocks,disk_blocks,evict,sched,workload,read_pct,working_set,seed,ops,"
+               "elapsed_s,ops_per_s,hits,misses,disk_reads,disk_writes,read_hit_p99_ms,"
+               "read_miss_p50_ms,read_miss_p99_ms,write_p99_ms,shards,admit,rejected,backend,delay,depth,ztier_kb,ztier_hits,ztier_ratio\n");
+    }
+    fflush(stdout);
+
+    // The cache has no teardown, so each point gets a fresh process.
+    for (i = 0; i < nthreads; i++) {
+        for (j = 0; j < nmemory; j++) {
+            for (k = 0; k < ndisks; k++) {
+                int status;
+                pid_t pid = fork();
+                if (pid == 0) {
+                    exit(bench_point(&w, &be, &config, threads[i], memory[j], disks[k], json, index) == 0 ? 0 : 1);
+                }
+                if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    fprintf(stderr, "benchmark point %d/%d/%d failed\n", threads[i], memory[j], disks[k]);
+                    return 1;
+                }
+                index++;
+            }
+        }
+    }
+
+    if (json) printf("\n]\n");
+    return 0;
+}
@@ -3,9 +3,10 @@ Do not modify this file.
 Make all of your changes to main.c instead.
 */
 
-#define _XOPEN_SOURCE 500L
+#define _GNU_SOURCE
 
 #include "disk.h"
+#include "uring.h"
 
 #include <unistd.h>
 #include <stdio.h>
@@ -13,10 +14,35 @@ Make all of your changes to main.c instead.
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define ABS(x) ( (x)<(0) ? -(x) : (x) )
 
+/* One extent of a transfer, as the backends see it. */
+
+struct disk_xfer {
+	int block;
+	int count;
+	struct iovec *iov;
+	int iovcnt;
+	int write;
+};
+
+/*
+What makes one backend different from another.  "transfer" moves every extent
+of a batch, in order unless the backend can overlap them, and returns 0,
+or -1 with errno set.  The checks and counters are common to all backends.
+*/
+
+struct disk_ops {
+	int (*transfer)( struct disk *d, struct disk_xfer *x, int n );
+};
+
 struct disk {
+	const struct disk_ops *ops;
+	disk_backend backend;
 	int fd;
 	int block_size;
 	int nblocks;
@@ -24,91 +50,412 @@ struct disk {
 	int nwrites;
 	int last_request;
 	int threads_inside;
+	int delay;
+	int depth;
+	char *map;
+	struct uring *ring;
 };
 
-struct disk * disk_open( const char *diskname, int nblocks )
+/*
+Pay the simulated delay for an extent of "count" blocks starting at "block":
+one positioning delay, then the time the head takes to stream over the extent.
+*/
+
+static void disk_delay( struct disk *d, int block, int count )
+{
+	// delay for 10ms minimum plus 10ms per 100 blocks moved, once for the extent,
+	// and the same 0.1ms for each block streamed past the first
+	if(d->delay) usleep(10000 + 100*ABS(d->last_request-block) + 100*(count-1));
+}
+
+/*
+Move one extent with as few pwritev/preadv calls as possible, stepping past
+whatever each call transferred, which may end part way through a buffer.
+*/
+
+static int fd_transfer( struct disk *d, struct disk_xfer *x )
+{
+	struct iovec *iov = x->iov;
+	int iovcnt = x->iovcnt;
+	off_t offset = (off_t)x->block*d->block_size;
+
+	while(iovcnt>0) {
+		ssize_t actual;
+		if(x->write) {
+			actual = pwritev(d->fd,iov,iovcnt,offset);
+		} else {
+			actual = preadv(d->fd,iov,iovcnt,offset);
+		}
+		if(actual<=0) {
+			if(actual==0) errno = EIO;
+			return -1;
+		}
+		offset += actual;
+		while(iovcnt>0 && (size_t)actual>=iov->iov_len) {
+			actual -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt>0) {
+			iov->iov_base = (char*)iov->iov_base + actual;
+			iov->iov_len -= actual;
+		}
+	}
+	return 0;
+}
+
+/* The simulated disk: a seek and streaming delay for every extent, then system calls on the image. */
+
+static int sim_transfer( struct disk *d, struct disk_xfer *x, int n )
+{
+	int i;
+	for(i=0;i<n;i++) {
+		disk_delay(d,x[i].block,x[i].count);
+		if(fd_transfer(d,&x[i])<0) return -1;
+		d->last_request = x[i].block+x[i].count-1;
+	}
+	return 0;
+}
+
+/*
+The mapped disk: the same delay, but blocks are copied to or from the mapping,
+and nothing is copied at all for a buffer that is already the block's own page,
+as it is for a cache frame mapped by disk_map.
+*/
+
+static int mmap_transfer( struct disk *d, struct disk_xfer *x, int n )
+{
+	int i,j;
+	for(i=0;i<n;i++) {
+		char *page = d->map + (size_t)x[i].block*d->block_size;
+		disk_delay(d,x[i].block,x[i].count);
+		for(j=0;j<x[i].iovcnt;j++) {
+			if(x[i].iov[j].iov_base!=page) {
+				if(x[i].write) memcpy(page,x[i].iov[j].iov_base,x[i].iov[j].iov_len);
+				else memcpy(x[i].iov[j].iov_base,page,x[i].iov[j].iov_len);
+			}
+			page += x[i].iov[j].iov_len;
+		}
+		d->last_request = x[i].block+x[i].count-1;
+	}
+	return 0;
+}
+
+/* Whether O_DIRECT can take the buffers of an extent as they are. */
+
+static int aligned( struct disk *d, struct disk_xfer *x )
+{
+	int i;
+	for(i=0;i<x->iovcnt;i++) {
+		if((size_t)x->iov[i].iov_base%d->block_size || x->iov[i].iov_len%d->block_size) return 0;
+	}
+	return 1;
+}
+
+/*
+The direct disk: no simulated delay, and the whole batch goes to the kernel at once
+through the ring, up to the queue depth at a time, so a real device can overlap them.
+O_DIRECT needs block-aligned buffers, so an extent with any other goes through a bounce buffer.
+Without a ring the extents are transferred one after the other.
+*/
+
+static int direct_transfer( struct disk *d, struct disk_xfer *x, int n )
+{
+	struct uring_op *ops = malloc(sizeof(*ops)*n);
+	struct iovec *bounced = malloc(sizeof(*bounced)*n);
+	char *bounce = 0;
+	size_t size = 0, at = 0, off;
+	int i,j,result = 0;
+
+	if(!ops || !bounced) {
+		free(ops);
+		free(bounced);
+		errno = ENOMEM;
+		return -1;
+	}
+	for(i=0;i<n;i++) {
+		if(!aligned(d,&x[i])) size += (size_t)x[i].count*d->block_size;
+	}
+	if(size>0 && posix_memalign((void**)&bounce,d->block_size,size)!=0) {
+		free(ops);
+		free(bounced);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for(i=0;i<n;i++) {
+		ops[i].iov = x[i].iov;
+		ops[i].iovcnt = x[i].iovcnt;
+		ops[i].offset = (off_t)x[i].block*d->block_size;
+		ops[i].write = x[i].write;
+		bounced[i].iov_base = 0;
+		if(aligned(d,&x[i])) continue;
+		bounced[i].iov_base = bounce+at;
+		bounced[i].iov_len = (size_t)x[i].count*d->block_size;
+		at += bounced[i].iov_len;
+		for(j=0,off=0;x[i].write && j<x[i].iovcnt;j++) {
+			memcpy((char*)bounced[i].iov_base+off,x[i].iov[j].iov_base,x[i].iov[j].iov_len);
+			off += x[i].iov[j].iov_len;
+		}
+		ops[i].iov = &bounced[i];
+		ops[i].iovcnt = 1;
+	}
+
+	if(d->ring) {
+		result = uring_transfer(d->ring,d->fd,ops,n);
+	} else {
+		for(i=0;i<n && result==0;i++) {
+			struct disk_xfer one = { x[i].block, x[i].count, ops[i].iov, ops[i].iovcnt, x[i].write };
+			result = fd_transfer(d,&one);
+		}
+	}
+
+	// The bounce iovecs were advanced by the transfer, so copy out from where they started.
+	for(i=0,at=0;result==0 && i<n;i++) {
+		char *from;
+		if(!bounced[i].iov_base) continue;
+		from = bounce+at;
+		at += (size_t)x[i].count*d->block_size;
+		for(j=0;!x[i].write && j<x[i].iovcnt;j++) {
+			memcpy(x[i].iov[j].iov_base,from,x[i].iov[j].iov_len);
+			from += x[i].iov[j].iov_len;
+		}
+	}
+	if(n>0) d->last_request = x[n-1].block+x[n-1].count-1;
+
+	free(bounce);
+	free(bounced);
+	free(ops);
+	return result;
+}
+
+static const struct disk_ops sim_ops = { sim_transfer };
+static const struct disk_ops mmap_ops = { mmap_transfer };
+static const struct disk_ops direct_ops = { direct_transfer };
+
+/*
+Open the image for a backend, make it "nblocks" blocks long, and size the disk.
+A block device is used as it is, as long as it is big enough.
+*/
+
+static int disk_attach( struct disk *d, const char *diskname )
+{
+	struct stat info;
+	int flags = O_CREAT|O_RDWR;
+
+	if(d->backend==DISK_DIRECT) {
+		d->fd = open(diskname,flags|O_DIRECT,0777);
+		// Some file systems have no direct I/O, but the ring still keeps requests in flight there.
+		if(d->fd<0 && errno==EINVAL) d->fd = open(diskname,flags,0777);
+	} else {
+		d->fd = open(diskname,flags,0777);
+	}
+	if(d->fd<0) return -1;
+
+	if(fstat(d->fd,&info)==0 && S_ISBLK(info.st_mode)) {
+		off_t size = lseek(d->fd,0,SEEK_END);
+		if(size<(off_t)d->nblocks*d->block_size) {
+			errno = ENOSPC;
+			return -1;
+		}
+	} else if(ftruncate(d->fd,(off_t)d->nblocks*d->block_size)<0) {
+		return -1;
+	}
+
+	if(d->backend==DISK_MMAP && d->nblocks>0) {
+		void *map = mmap(0,(size_t)d->nblocks*d->block_size,PROT_READ|PROT_WRITE,MAP_SHARED,d->fd,0);
+		if(map==MAP_FAILED) return -1;
+		d->map = map;
+	}
+	if(d->backend==DISK_DIRECT && d->depth>1) {
+		d->ring = uring_create(d->depth);
+		d->depth = d->ring ? (int)uring_entries(d->ring) : 1;
+	}
+	return 0;
+}
+
+struct disk * disk_open_backend( const char *diskname, int nblocks, disk_backend backend, int depth )
 {
 	struct disk *d;
 
-	d = malloc(sizeof(*d));
+	d = calloc(1,sizeof(*d));
 	if(!d) return 0;
 
-	d->fd = open(diskname,O_CREAT|O_RDWR,0777);
-	if(d->fd<0) {
-		free(d);
-		return 0;
+	switch(backend) {
+	case DISK_MMAP:   d->ops = &mmap_ops; break;
+	case DISK_DIRECT: d->ops = &direct_ops; break;
+	default:          d->ops = &sim_ops; backend = DISK_SIM; break;
 	}
-
+	d->backend = backend;
+	d->fd = -1;
 	d->block_size = BLOCK_SIZE;
 	d->nblocks = nblocks;
 	d->last_request = 0;
 	d->threads_inside = 0;
 	d->nreads = 0;
 	d->nwrites = 0;
-	
-	if(ftruncate(d->fd,d->nblocks*d->block_size)<0) {
-		close(d->fd);
-		free(d);
+	d->delay = backend!=DISK_DIRECT;
+	d->depth = backend==DISK_DIRECT && depth>1 ? depth : 1;
+
+	if(disk_attach(d,diskname)<0) {
+		int saved = errno;
+		disk_close(d);
+		errno = saved;
 		return 0;
 	}
 
 	return d;
 }
 
-void disk_write( struct disk *d, int block, const char *data )
+struct disk * disk_open( const char *diskname, int nblocks )
+{
+	return disk_open_backend(diskname,nblocks,DISK_SIM,1);
+}
+
+struct disk * disk_open_mapped( const char *diskname, int nblocks )
+{
+	return disk_open_backend(diskname,nblocks,DISK_MMAP,1);
+}
+
+/*
+Check and perform a batch of extents, then count them.
+Every public transfer comes through here, whichever the backend.
+*/
+
+static void disk_run( struct disk *d, struct disk_xfer *x, int n, const char *name )
 {
+	int i;
+
 	d->threads_inside++;
-	
+
 	if(d->threads_inside>1) {
-		fprintf(stderr,"disk-read: CRASH: multiple threads in disk at once!\n");
+		fprintf(stderr,"%s: CRASH: multiple threads in disk at once!\n",name);
 		abort();
 	}
-	
-	if(block<0 || block>=d->nblocks) {
-		fprintf(stderr,"disk_write: CRASH: invalid block #%d\n",block);
-		abort();
+
+	for(i=0;i<n;i++) {
+		if(x[i].block<0 || x[i].count<0 || x[i].block+x[i].count>d->nblocks) {
+			if(x[i].count==1) fprintf(stderr,"%s: CRASH: invalid block #%d\n",name,x[i].block);
+			else fprintf(stderr,"%s: CRASH: invalid blocks #%d-%d\n",name,x[i].block,x[i].block+x[i].count-1);
+			abort();
+		}
 	}
 
-	// delay for 10ms minimum plus 10ms per 100 blocks moved
-	usleep(10000 + 100*ABS(d->last_request-block));
-	
-	int actual = pwrite(d->fd,(char*)data,d->block_size,block*d->block_size);
-	if(actual!=d->block_size) {
-		fprintf(stderr,"disk_write: CRASH: failed to write block #%d: %s\n",block,strerror(errno));
+	if(d->ops->transfer(d,x,n)<0) {
+		fprintf(stderr,"%s: CRASH: failed to transfer blocks #%d-%d: %s\n",name,x[0].block,x[n-1].block+x[n-1].count-1,strerror(errno));
 		abort();
 	}
 
-	d->last_request = block;
 	d->threads_inside--;
-	d->nwrites++;
+	for(i=0;i<n;i++) {
+		if(x[i].write) {
+			d->nwrites += x[i].count;
+		} else {
+			d->nreads += x[i].count;
+		}
+	}
+}
+
+static void disk_contiguous( struct disk *d, int block, int count, char *data, int write, const char *name )
+{
+	struct iovec iov;
+	struct disk_xfer x;
+	iov.iov_base = data;
+	iov.iov_len = (size_t)count*d->block_size;
+	x.block = block;
+	x.count = count;
+	x.iov = &iov;
+	x.iovcnt = 1;
+	x.write = write;
+	disk_run(d,&x,1,name);
+}
+
+void disk_write( struct disk *d, int block, const char *data )
+{
+	disk_contiguous(d,block,1,(char*)data,1,"disk_write");
 }
 
 void disk_read( struct disk *d, int block, char *data )
 {
-	d->threads_inside++;
+	disk_contiguous(d,block,1,data,0,"disk_read");
+}
 
-	if(d->threads_inside>1) {
-		fprintf(stderr,"disk-read: CRASH: multiple threads in disk at once!\n");
+void disk_write_range( struct disk *d, int block, int count, const char *data )
+{
+	disk_contiguous(d,block,count,(char*)data,1,"disk_write_range");
+}
+
+void disk_read_range( struct disk *d, int block, int count, char *data )
+{
+	disk_contiguous(d,block,count,data,0,"disk_read_range");
+}
+
+/* Gather one BLOCK_SIZE buffer per block of every extent into iovecs, then transfer them all at once. */
+
+static void disk_vector( struct disk *d, const struct disk_extent *e, int n, const char *name )
+{
+	struct disk_xfer *x = malloc(sizeof(*x)*(n>0 ? n : 1));
+	struct iovec *iov;
+	int i,j,total = 0;
+
+	for(i=0;i<n;i++) total += e[i].count;
+	iov = malloc(sizeof(*iov)*(total>0 ? total : 1));
+	if(!x || !iov) {
+		fprintf(stderr,"%s: CRASH: out of memory\n",name);
 		abort();
 	}
-	
-	if(block<0 || block>=d->nblocks) {
-		fprintf(stderr,"disk_read: CRASH: invalid block #%d\n",block);
-		abort();
+	for(i=0,total=0;i<n;i++) {
+		x[i].block = e[i].block;
+		x[i].count = e[i].count;
+		x[i].iov = &iov[total];
+		x[i].iovcnt = e[i].count;
+		x[i].write = e[i].write;
+		for(j=0;j<e[i].count;j++,total++) {
+			iov[total].iov_base = e[i].data[j];
+			iov[total].iov_len = d->block_size;
+		}
 	}
+	disk_run(d,x,n,name);
+	free(iov);
+	free(x);
+}
 
-	// delay for 10ms minimum plus 10ms per 100 blocks moved
-	usleep(10000 + 100*ABS(d->last_request-block));
-	
-	int actual = pread(d->fd,(char*)data,d->block_size,block*d->block_size);
-	if(actual!=d->block_size) {
-		fprintf(stderr,"disk_read: CRASH: failed to read block #%d: %s\n",block,strerror(errno));
-		abort();
-	}
+void disk_writev( struct disk *d, int block, int count, const char * const *data )
+{
+	struct disk_extent e = { block, count, (char * const *)data, 1 };
+	disk_vector(d,&e,1,"disk_writev");
+}
 
-	d->last_request = block;
-	d->threads_inside--;
-	d->nreads++;
+void disk_readv( struct disk *d, int block, int count, char * const *data )
+{
+	struct disk_extent e = { block, count, data, 0 };
+	disk_vector(d,&e,1,"disk_readv");
+}
+
+void disk_transfer_batch( struct disk *d, const struct disk_extent *extents, int n )
+{
+	if(n>0) disk_vector(d,extents,n,"disk_transfer_batch");
+}
+
+char * disk_map( struct disk *d, int block )
+{
+	if(!d->map || block<0 || block>=d->nblocks) return 0;
+	return d->map + (size_t)block*d->block_size;
+}
+
+void disk_set_delay( struct disk *d, int delay )
+{
+	if(d->backend!=DISK_DIRECT) d->delay = delay;
+}
+
+disk_backend disk_get_backend( struct disk *d )
+{
+	return d->backend;
+}
+
+int disk_depth( struct disk *d )
+{
+	return d->depth;
 }
 
 int disk_nblocks( struct disk *d )
@@ -133,6 +480,28 @@ void disk_reset_stats( struct disk *d )
 
 void disk_close( struct disk *d )
 {
-	close(d->fd);
+	if(d->ring) uring_delete(d->ring);
+	if(d->map) munmap(d->map,(size_t)d->nblocks*d->block_size);
+	if(d->fd>=0) close(d->fd);
 	free(d);
-}
\ No newline at end of file
+}
+
+static const char *backend_names[] = { "sim", "mmap", "direct" };
+
+const char * disk_backend_name( disk_backend backend )
+{
+	if(backend<DISK_SIM || backend>DISK_DIRECT) return "unknown";
+	return backend_names[backend];
+}
+
+int disk_backend_parse( const char *name, disk_backend *backend )
+{
+	int i;
+	for(i=DISK_SIM;i<=DISK_DIRECT;i++) {
+		if(!strcmp(name,backend_names[i])) {
+			*backend = (disk_backend)i;
+			return 0;
+		}
+	}
+	return -1;
+}
@@ -8,6 +8,26 @@ You should read and understand this file, but shouldn't change it.
 
 #define BLOCK_SIZE 4096
 
+/*
+The ways a disk may reach its image.  Every backend sits behind the same calls,
+counts the same way, and still only admits one thread at a time.
+*/
+
+typedef enum {
+	DISK_SIM,        // pread and pwrite, after a simulated seek delay. Deterministic; the default.
+	DISK_MMAP,       // The image is mapped, and blocks are copied to and from it, after the same delay.
+	DISK_DIRECT      // O_DIRECT through io_uring with no simulated delay, for a real file or block device.
+} disk_backend;
+
+/* One extent of a batch: "count" blocks from "block", where data[i] is the BLOCK_SIZE buffer of block+i. */
+
+struct disk_extent {
+	int block;
+	int count;
+	char * const *data;
+	int write;       // Non-zero to write the buffers to the disk, zero to read into them.
+};
+
 /*
 Create a new virtual disk in the file "filename", with the given number of blocks.
 Returns a pointer to a new disk object, or null on failure.
@@ -15,6 +35,24 @@ Returns a pointer to a new disk object, or null on failure.
 
 struct disk * disk_open( const char *filename, int blocks );
 
+/*
+Like disk_open, but the image is also mapped into memory, and blocks are copied
+to and from the mapping instead of going through a system call each.
+The delay, the counters and the one-thread-at-a-time rule stay the same.
+*/
+
+struct disk * disk_open_mapped( const char *filename, int blocks );
+
+/*
+Open a disk of the given number of blocks on "filename" through one of the backends.
+A DISK_DIRECT disk may also use an existing block device, which is not resized, and
+keeps up to "depth" transfers in flight at once; the others ignore "depth".
+Where io_uring is not available, a direct disk still works, one transfer at a time.
+Returns null on failure, with errno set.
+*/
+
+struct disk * disk_open_backend( const char *filename, int blocks, disk_backend backend, int depth );
+
 /*
 Write exactly BLOCK_SIZE bytes to a given block on the virtual disk.
 "d" must be a pointer to a virtual disk, "block" is the block number,
@@ -31,6 +69,79 @@ and "data" is a pointer to where the data will be placed.
 
 void disk_read( struct disk *d, int block, char *data );
 
+/*
+Write "count" consecutive blocks starting at "block" from BLOCK_SIZE*count bytes of "data".
+The whole extent pays a single positioning delay, plus a small streaming
+delay per block, so this is the fast way to initialize a disk. Each block counts as one write.
+*/
+
+void disk_write_range( struct disk *d, int block, int count, const char *data );
+
+/*
+Read "count" consecutive blocks starting at "block" into BLOCK_SIZE*count bytes of "data".
+Like disk_write_range, the whole extent pays a single positioning delay
+and the streaming delay of its blocks.
+*/
+
+void disk_read_range( struct disk *d, int block, int count, char *data );
+
+/*
+Write "count" consecutive blocks starting at "block", where data[i] holds the
+BLOCK_SIZE bytes of block+i.  Like disk_write_range, the extent pays one
+positioning delay and the streaming delay of its blocks, and the buffers go to the disk in a single vectored write.
+*/
+
+void disk_writev( struct disk *d, int block, int count, const char * const *data );
+
+/*
+Read "count" consecutive blocks starting at "block", placing block+i in data[i].
+*/
+
+void disk_readv( struct disk *d, int block, int count, char * const *data );
+
+/*
+Perform "n" extents in one call.  A backend with a queue depth above one has up
+to that many of them in flight together, and the call returns once all are done.
+The others transfer them in order, each paying its own positioning delay.
+*/
+
+void disk_transfer_batch( struct disk *d, const struct disk_extent *extents, int n );
+
+/*
+Return the address of block "block" in the mapping of a disk made by disk_open_mapped,
+or null if the disk is not mapped or has no such block.  Stores through the pointer
+change the image directly, without counting as a write.  A read or write whose
+buffer is this very pointer copies nothing, and only pays the delay and counts.
+Any other buffer is copied, so writing a copy of the page puts that copy back
+over whatever was stored through the pointer since it was taken.
+*/
+
+char * disk_map( struct disk *d, int block );
+
+/*
+Turn the simulated positioning delay on or off; it is on when the disk is opened.
+With it off, transfers take only as long as the copying and any system calls.
+A direct disk never has the delay.
+*/
+
+void disk_set_delay( struct disk *d, int delay );
+
+/* Return the backend the disk was opened with. */
+
+disk_backend disk_get_backend( struct disk *d );
+
+/* Return how many transfers the disk can have in flight at once; 1 unless it is direct. */
+
+int disk_depth( struct disk *d );
+
+/* Return the printable name of a backend. */
+
+const char * disk_backend_name( disk_backend backend );
+
+/* Parse a backend name ("sim", "mmap", "direct"). Returns 0 on success, -1 otherwise. */
+
+int disk_backend_parse( const char *name, disk_backend *backend );
+
 /*
 Return the number of blocks in the virtual disk.
 */
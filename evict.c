@@ -0,0 +1,272 @@
+/*
+This is the implementation of the eviction policies used by the buffer cache.
+Each policy keeps one or two circular lists of evict_nodes with a sentinel head.
+The most recently inserted node sits just after the head, so the oldest node
+is always at head.prev.
+*/
+
+#include "evict.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct evict_list {
+    struct evict_node head;      // Sentinel; head.next is newest, head.prev is oldest
+    int count;                   // Number of nodes on the list
+};
+
+struct evict_ops {
+    void (*insert)(struct evict_policy *p, struct evict_node *n);
+    void (*insert_cold)(struct evict_policy *p, struct evict_node *n);
+    void (*touch)(struct evict_policy *p, struct evict_node *n);
+    void (*remove)(struct evict_policy *p, struct evict_node *n);
+    struct evict_node *(*victim)(struct evict_policy *p, evict_filter can_evict, void *arg);
+};
+
+struct evict_policy {
+    const struct evict_ops *ops; // Policy specific behaviour
+    int capacity;                // Number of frames in the cache
+    struct evict_list lists[2];  // LRU/CLOCK use lists[0]; 2Q uses A1in and Am
+    struct evict_node *hand;     // CLOCK hand, or the sentinel when idle
+    int kin;                     // 2Q: target size of the A1in queue
+};
+
+#define Q_A1IN 0
+#define Q_AM   1
+
+static void list_init(struct evict_list *l) {
+    l->head.next = l->head.prev = &l->head;
+    l->count = 0;
+}
+
+/* Link "n" so that it sits just after "at" in next-order, i.e. just newer than at's successor. */
+static void list_insert_after(struct evict_list *l, struct evict_node *at, struct evict_node *n) {
+    n->next = at->next;
+    n->prev = at;
+    at->next->prev = n;
+    at->next = n;
+    l->count++;
+}
+
+static void list_push_front(struct evict_list *l, struct evict_node *n) {
+    list_insert_after(l, &l->head, n);
+}
+
+static void list_push_back(struct evict_list *l, struct evict_node *n) {
+    list_insert_after(l, l->head.prev, n);
+}
+
+static void list_unlink(struct evict_list *l, struct evict_node *n) {
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->next = n->prev = NULL;
+    l->count--;
+}
+
+/*
+Walk from the oldest node towards the newest and return the first evictable one.
+Nodes with a deferred access are touched on the way past, which moves them out of the way.
+*/
+static struct evict_node *list_oldest(struct evict_policy *p, struct evict_list *l, evict_filter can_evict, void *arg) {
+    struct evict_node *n = l->head.prev;
+    int steps = 2 * l->count + 1;
+
+    while (n != &l->head && steps-- > 0) {
+        struct evict_node *newer = n->prev;
+        if (n->referenced) {
+            p->ops->touch(p, n);
+        } else if (can_evict(n, arg)) {
+            return n;
+        }
+        n = newer;
+    }
+    return NULL;
+}
+
+/* LRU: touch moves the node to the front, the victim is the oldest evictable node. */
+
+static void lru_insert(struct evict_policy *p, struct evict_node *n) {
+    n->queue = 0;
+    list_push_front(&p->lists[0], n);
+}
+
+static void lru_insert_cold(struct evict_policy *p, struct evict_node *n) {
+    n->queue = 0;
+    list_push_back(&p->lists[0], n);
+}
+
+static void lru_touch(struct evict_policy *p, struct evict_node *n) {
+    n->referenced = 0;
+    list_unlink(&p->lists[0], n);
+    list_push_front(&p->lists[0], n);
+}
+
+static void lru_remove(struct evict_policy *p, struct evict_node *n) {
+    list_unlink(&p->lists[n->queue], n);
+}
+
+static struct evict_node *lru_victim(struct evict_policy *p, evict_filter can_evict, void *arg) {
+    return list_oldest(p, &p->lists[0], can_evict, arg);
+}
+
+/*
+CLOCK: the hand sweeps from old to new, clearing reference bits,
+and stops at the first unreferenced evictable node.
+*/
+
+static void clock_insert(struct evict_policy *p, struct evict_node *n) {
+    n->queue = 0;
+    n->referenced = 0;
+    list_push_front(&p->lists[0], n);
+}
+
+/* A cold node goes right under the hand, so the next sweep looks at it first. */
+static void clock_insert_cold(struct evict_policy *p, struct evict_node *n) {
+    n->queue = 0;
+    n->referenced = 0;
+    list_insert_after(&p->lists[0], p->hand, n);
+    p->hand = n;
+}
+
+static void clock_touch(struct evict_policy *p, struct evict_node *n) {
+    (void)p;
+    n->referenced = 1;
+}
+
+static void clock_remove(struct evict_policy *p, struct evict_node *n) {
+    if (p->hand == n) p->hand = n->prev;
+    list_unlink(&p->lists[0], n);
+}
+
+static struct evict_node *clock_victim(struct evict_policy *p, evict_filter can_evict, void *arg) {
+    struct evict_list *l = &p->lists[0];
+    int steps;
+
+    // Two full turns are enough: the first clears every bit, the second finds a victim.
+    for (steps = 0; steps < 2 * l->count + 1; steps++) {
+        struct evict_node *n = p->hand;
+        if (n == &l->head) n = n->prev;
+        p->hand = n->prev;
+        if (n == &l->head) continue;
+        if (n->referenced) {
+            n->referenced = 0;
+        } else if (can_evict(n, arg)) {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+/*
+Simplified 2Q: new blocks enter the FIFO A1in queue, and are promoted
+to the LRU Am queue when they are touched again.  Blocks that are only
+seen once therefore leave before they can push out the re-referenced set.
+*/
+
+static void twoq_insert(struct evict_policy *p, struct evict_node *n) {
+    n->queue = Q_A1IN;
+    list_push_front(&p->lists[Q_A1IN], n);
+}
+
+static void twoq_insert_cold(struct evict_policy *p, struct evict_node *n) {
+    n->queue = Q_A1IN;
+    list_push_back(&p->lists[Q_A1IN], n);
+}
+
+static void twoq_touch(struct evict_policy *p, struct evict_node *n) {
+    n->referenced = 0;
+    list_unlink(&p->lists[n->queue], n);
+    n->queue = Q_AM;
+    list_push_front(&p->lists[Q_AM], n);
+}
+
+static struct evict_node *twoq_victim(struct evict_policy *p, evict_filter can_evict, void *arg) {
+    struct evict_node *n = NULL;
+    if (p->lists[Q_A1IN].count > p->kin || p->lists[Q_AM].count == 0) {
+        n = list_oldest(p, &p->lists[Q_A1IN], can_evict, arg);
+        if (!n) n = list_oldest(p, &p->lists[Q_AM], can_evict, arg);
+    } else {
+        n = list_oldest(p, &p->lists[Q_AM], can_evict, arg);
+        if (!n) n = list_oldest(p, &p->lists[Q_A1IN], can_evict, arg);
+    }
+    return n;
+}
+
+static const struct evict_ops lru_ops = { lru_insert, lru_insert_cold, lru_touch, lru_remove, lru_victim };
+static const struct evict_ops clock_ops = { clock_insert, clock_insert_cold, clock_touch, clock_remove, clock_victim };
+static const struct evict_ops twoq_ops = { twoq_insert, twoq_insert_cold, twoq_touch, lru_remove, twoq_victim };
+
+struct evict_policy *evict_create(evict_kind kind, int capacity) {
+    struct evict_policy *p = malloc(sizeof(*p));
+    if (!p) return NULL;
+
+    switch (kind) {
+    case EVICT_CLOCK: p->ops = &clock_ops; break;
+    case EVICT_2Q:    p->ops = &twoq_ops; break;
+    default:          p->ops = &lru_ops; break;
+    }
+    p->capacity = capacity;
+    list_init(&p->lists[0]);
+    list_init(&p->lists[1]);
+    p->hand = &p->lists[0].head;
+    // The 2Q paper recommends giving roughly a quarter of the frames to A1in.
+    p->kin = capacity / 4 > 0 ? capacity / 4 : 1;
+    return p;
+}
+
+void evict_insert(struct evict_policy *p, struct evict_node *n) {
+    p->ops->insert(p, n);
+}
+
+void evict_insert_cold(struct evict_policy *p, struct evict_node *n) {
+    p->ops->insert_cold(p, n);
+}
+
+void evict_touch(struct evict_policy *p, struct evict_node *n) {
+    if (!n->prev) return;
+    p->ops->touch(p, n);
+}
+
+void evict_touch_later(struct evict_node *n) {
+    n->referenced = 1;
+}
+
+void evict_remove(struct evict_policy *p, struct evict_node *n) {
+    if (!n->prev) return;
+    p->ops->remove(p, n);
+}
+
+struct evict_node *evict_victim(struct evict_policy *p, evict_filter can_evict, void *arg) {
+    return p->ops->victim(p, can_evict, arg);
+}
+
+void evict_walk(struct evict_policy *p, evict_visit visit, void *arg) {
+    int i;
+    // Only 2Q uses the second list, and it gives up its first list's nodes first.
+    for (i = 0; i < 2; i++) {
+        struct evict_node *n;
+        for (n = p->lists[i].head.prev; n != &p->lists[i].head; n = n->prev) visit(n, arg);
+    }
+}
+
+void evict_delete(struct evict_policy *p) {
+    free(p);
+}
+
+static const char *evict_names[] = { "lru", "clock", "2q" };
+
+const char *evict_name(evict_kind kind) {
+    if (kind < EVICT_LRU || kind > EVICT_2Q) return "unknown";
+    return evict_names[kind];
+}
+
+int evict_parse(const char *name, evict_kind *kind) {
+    int i;
+    for (i = EVICT_LRU; i <= EVICT_2Q; i++) {
+        if (!strcmp(name, evict_names[i])) {
+            *kind = (evict_kind)i;
+            return 0;
+        }
+    }
+    return -1;
+}
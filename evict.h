@@ -0,0 +1,81 @@
+#ifndef EVICT_H
+#define EVICT_H
+
+/*
+The interface to the pluggable eviction policies used by the buffer cache.
+Every cached block embeds a struct evict_node, and a policy only ever sees
+those nodes, never the blocks themselves.  Callers must serialize all calls
+made on the same policy object, except for evict_touch_later.
+Nodes must start out zeroed; touching or removing an untracked node does nothing.
+*/
+
+/* The eviction policies that may be selected for a buffer cache. */
+typedef enum {
+    EVICT_LRU,       // Least recently used block goes first.
+    EVICT_CLOCK,     // Second-chance sweep over a circular list.
+    EVICT_2Q         // FIFO probation queue in front of an LRU main queue.
+} evict_kind;
+
+struct evict_node {
+    struct evict_node *prev;     // Previous node in the policy list
+    struct evict_node *next;     // Next node in the policy list
+    int queue;                   // Which policy list currently holds the node
+    int referenced;              // Access recorded but not yet applied to the lists
+};
+
+/*
+Returns non-zero if the node may be evicted right now.
+The first node accepted becomes the victim, so the filter may also claim it.
+*/
+typedef int (*evict_filter)( struct evict_node *n, void *arg );
+
+/* Called by evict_walk for each tracked node. */
+typedef void (*evict_visit)( struct evict_node *n, void *arg );
+
+/* Create a policy of the given kind for a cache of "capacity" blocks. */
+struct evict_policy * evict_create( evict_kind kind, int capacity );
+
+/* Start tracking a node that has just become resident. */
+void evict_insert( struct evict_policy *p, struct evict_node *n );
+
+/*
+Start tracking a node that is only speculatively resident, such as a prefetched block.
+It is placed where the policy will give it up first unless it is touched.
+*/
+void evict_insert_cold( struct evict_policy *p, struct evict_node *n );
+
+/* Record an access to a resident node. */
+void evict_touch( struct evict_policy *p, struct evict_node *n );
+
+/*
+Record an access without holding the policy's lock.
+The access is applied the next time a victim scan passes the node.
+*/
+void evict_touch_later( struct evict_node *n );
+
+/* Stop tracking a node. */
+void evict_remove( struct evict_policy *p, struct evict_node *n );
+
+/*
+Choose the node the policy would give up first, skipping any node
+for which "can_evict" returns zero.  Returns null if nothing qualifies.
+The victim stays tracked until the caller removes it.
+*/
+struct evict_node * evict_victim( struct evict_policy *p, evict_filter can_evict, void *arg );
+
+/*
+Call "visit" on every tracked node, starting with the one the policy would give up
+first and ending with the one it would keep longest, without changing anything.
+*/
+void evict_walk( struct evict_policy *p, evict_visit visit, void *arg );
+
+/* Release the policy object. */
+void evict_delete( struct evict_policy *p );
+
+/* Return the printable name of a policy kind. */
+const char * evict_name( evict_kind kind );
+
+/* Parse a policy name ("lru", "clock", "2q"). Returns 0 on success, -1 otherwise. */
+int evict_parse( const char *name, evict_kind *kind );
+
+#endif
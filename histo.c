@@ -0,0 +1,78 @@
+/*
+This is the implementation of the latency histograms.
+Values below HISTO_SUB_BUCKETS get a bucket each; above that, the position of the
+highest set bit picks a power of two and the next HISTO_SUB_BITS bits pick the
+part of it, so bucket boundaries grow geometrically with the value.
+*/
+
+#include "histo.h"
+
+#include <string.h>
+
+void histo_init(struct histo *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+static int bucket_of(long long value) {
+    unsigned long long v = (unsigned long long)value;
+    int top;
+
+    if (v < HISTO_SUB_BUCKETS) return (int)v;
+    top = 63 - __builtin_clzll(v);
+    return (top - HISTO_SUB_BITS + 1) * HISTO_SUB_BUCKETS + (int)((v >> (top - HISTO_SUB_BITS)) & (HISTO_SUB_BUCKETS - 1));
+}
+
+/* The largest value that falls in bucket "b". */
+static long long bucket_top(int b) {
+    int top;
+    if (b < HISTO_SUB_BUCKETS) return b;
+    top = b / HISTO_SUB_BUCKETS + HISTO_SUB_BITS - 1;
+    return (long long)((((unsigned long long)HISTO_SUB_BUCKETS + b % HISTO_SUB_BUCKETS + 1) << (top - HISTO_SUB_BITS)) - 1);
+}
+
+void histo_record(struct histo *h, long long value) {
+    long long max;
+
+    if (value < 0) value = 0;
+    __sync_fetch_and_add(&h->counts[bucket_of(value)], 1);
+    __sync_fetch_and_add(&h->count, 1);
+    max = h->max;
+    while (value > max && !__sync_bool_compare_and_swap(&h->max, max, value)) {
+        max = h->max;
+    }
+}
+
+void histo_merge(struct histo *h, struct histo *from) {
+    long long max = histo_max(from);
+    int b;
+
+    for (b = 0; b < HISTO_BUCKETS; b++) h->counts[b] += __sync_fetch_and_add(&from->counts[b], 0);
+    h->count += histo_count(from);
+    if (max > h->max) h->max = max;
+}
+
+long long histo_count(struct histo *h) {
+    return __sync_fetch_and_add(&h->count, 0);
+}
+
+long long histo_max(struct histo *h) {
+    return __sync_fetch_and_add(&h->max, 0);
+}
+
+long long histo_percentile(struct histo *h, double fraction) {
+    long long total = 0, seen = 0, rank, max = histo_max(h);
+    int b;
+
+    for (b = 0; b < HISTO_BUCKETS; b++) total += __sync_fetch_and_add(&h->counts[b], 0);
+    if (total == 0) return 0;
+
+    // The smallest value with at least "fraction" of the values at or below it.
+    rank = (long long)(fraction * total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > total) rank = total;
+    for (b = 0; b < HISTO_BUCKETS; b++) {
+        seen += __sync_fetch_and_add(&h->counts[b], 0);
+        if (seen >= rank) break;
+    }
+    return bucket_top(b) < max ? bucket_top(b) : max;
+}
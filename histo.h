@@ -0,0 +1,43 @@
+#ifndef HISTO_H
+#define HISTO_H
+
+/*
+The interface to the latency histograms kept by the buffer cache.
+Values are counted in log-spaced buckets, HDR style: each power of two is split
+into HISTO_SUB_BUCKETS equal parts, so any recorded value is reported to within
+about 1/HISTO_SUB_BUCKETS of its true size, using a fixed amount of memory.
+Recording is lock-free and may be done from any number of threads at once.
+*/
+
+#define HISTO_SUB_BITS 3
+#define HISTO_SUB_BUCKETS (1 << HISTO_SUB_BITS)
+#define HISTO_BUCKETS (64 * HISTO_SUB_BUCKETS)
+
+struct histo {
+    long long counts[HISTO_BUCKETS]; // Values seen in each bucket
+    long long count;             // Values recorded
+    long long max;               // Largest value recorded
+};
+
+/* Reset a histogram to empty. */
+void histo_init( struct histo *h );
+
+/* Count one value, which must not be negative. */
+void histo_record( struct histo *h, long long value );
+
+/* Add every value recorded in "from" to "h", e.g. to report several histograms as one. */
+void histo_merge( struct histo *h, struct histo *from );
+
+/* Return the number of values recorded. */
+long long histo_count( struct histo *h );
+
+/* Return the largest value recorded, or 0 if there are none. */
+long long histo_max( struct histo *h );
+
+/*
+Return the value below which "fraction" of the recorded values fall, e.g. 0.99 for p99.
+The answer is the top of the bucket holding that value, capped at the maximum.
+*/
+long long histo_percentile( struct histo *h, double fraction );
+
+#endif
@@ -0,0 +1,256 @@
+/*
+This is the implementation of the disk request queue.
+Each priority class waits in its own array sorted by block number (ties broken
+by arrival), so every positional policy only needs a binary search around the head.
+Deadlines are checked by scanning for the oldest request of each class, which is
+cheap next to a disk transfer.
+*/
+
+#include "iosched.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The pending requests of one class, sorted by (blocknum, seq). */
+struct ioq {
+    struct io_request *reqs;     // Pending requests
+    int count;                   // Number of pending requests
+    int capacity;                // Allocated length of reqs
+};
+
+struct iosched {
+    iosched_kind kind;           // Ordering policy
+    struct ioq queues[IOPRIO_NCLASSES]; // Pending requests, indexed by io_class
+    int direction;               // SCAN: +1 while sweeping up, -1 while sweeping down
+    unsigned long next_seq;      // Sequence number for the next arrival
+};
+
+struct iosched *iosched_create(iosched_kind kind) {
+    struct iosched *q = calloc(1, sizeof(*q));
+    if (!q) return NULL;
+    q->kind = kind;
+    q->direction = 1;
+    q->next_seq = 0;
+    return q;
+}
+
+/* Index of the first request whose block number is at least "blocknum". */
+static int lower_bound(struct ioq *q, int blocknum) {
+    int lo = 0, hi = q->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (q->reqs[mid].blocknum < blocknum) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* How long a request of each class may wait before it overtakes every other, in ms. */
+static const long long class_expire_ms[IOPRIO_NCLASSES] = { 500, 1000, 2000, 5000 };
+
+/* Add "r" to "q" as it is, sequence number included. */
+static int insert(struct ioq *q, const struct io_request *r) {
+    int pos;
+
+    if (q->count == q->capacity) {
+        int ncap = q->capacity ? q->capacity * 2 : 16;
+        struct io_request *n = realloc(q->reqs, sizeof(*n) * ncap);
+        if (!n) return -1;
+        q->reqs = n;
+        q->capacity = ncap;
+    }
+
+    // Insert after any requests for the same block, keeping arrival order among them.
+    pos = lower_bound(q, r->blocknum + 1);
+    memmove(&q->reqs[pos + 1], &q->reqs[pos], sizeof(*r) * (q->count - pos));
+    q->reqs[pos] = *r;
+    q->count++;
+    return 0;
+}
+
+int iosched_push(struct iosched *s, const struct io_request *r) {
+    struct io_request n = *r;
+    n.seq = s->next_seq;
+    if (insert(&s->queues[r->prio], &n) < 0) return -1;
+    s->next_seq++;
+    return 0;
+}
+
+/* Remove request i of "q", copying it into "r". */
+static void dequeue(struct ioq *q, int i, struct io_request *r) {
+    *r = q->reqs[i];
+    memmove(&q->reqs[i], &q->reqs[i + 1], sizeof(*r) * (q->count - i - 1));
+    q->count--;
+}
+
+/* The first request of the run of requests for the block at index i. */
+static int run_start(struct ioq *q, int i) {
+    return lower_bound(q, q->reqs[i].blocknum);
+}
+
+/* Requests behind the sweep sort after every request ahead of it. */
+#define SWEEP_WRAP (1LL << 32)
+
+/* How soon the policy wants to serve a request; the lowest key goes next. */
+static long long request_key(struct iosched *s, const struct io_request *r, int head) {
+    long long d = (long long)r->blocknum - head;
+    switch (s->kind) {
+    case IOSCHED_SSTF:
+        return d >= 0 ? d : -d;
+    case IOSCHED_SCAN:
+        d *= s->direction;
+        return d >= 0 ? d : SWEEP_WRAP - d;
+    case IOSCHED_CLOOK:
+        return d >= 0 ? d : SWEEP_WRAP + r->blocknum;
+    default:
+        return (long long)r->seq;
+    }
+}
+
+/* Index of the request in "q" with the lowest key. "q" must not be empty. */
+static int candidate(struct iosched *s, struct ioq *q, int head) {
+    int i, best, up = lower_bound(q, head);
+
+    switch (s->kind) {
+    case IOSCHED_SSTF:
+        if (up >= q->count) return run_start(q, up - 1);
+        if (up == 0) return up;
+        return request_key(s, &q->reqs[up - 1], head) < request_key(s, &q->reqs[up], head) ? run_start(q, up - 1) : up;
+    case IOSCHED_SCAN:
+        if (s->direction > 0) return up < q->count ? up : run_start(q, up - 1);
+        if (up < q->count && q->reqs[up].blocknum == head) return up;
+        return up > 0 ? run_start(q, up - 1) : up;
+    case IOSCHED_CLOOK:
+        return up < q->count ? up : 0;
+    default:
+        for (i = 1, best = 0; i < q->count; i++) {
+            if (q->reqs[i].seq < q->reqs[best].seq) best = i;
+        }
+        return best;
+    }
+}
+
+/*
+An overdue request is served where it lies, and the sweep carries on from there.
+Otherwise classes are considered most urgent first: in strict mode the first
+non-empty one wins, and if not, the policy serves whichever candidate has the lowest key.
+*/
+int iosched_pop(struct iosched *s, int head, unsigned mask, int strict, long long now, struct io_request *r) {
+    struct ioq *q = NULL;
+    long long key = 0, overdue = 0;
+    int c, j, i = 0;
+
+    for (c = 0; c < IOPRIO_NCLASSES; c++) {
+        struct ioq *cq = &s->queues[c];
+        int oldest = 0;
+        long long late;
+        if (!(mask & IOPRIO_BIT(c)) || cq->count == 0) continue;
+        for (j = 1; j < cq->count; j++) {
+            if (cq->reqs[j].queued < cq->reqs[oldest].queued) oldest = j;
+        }
+        late = now - cq->reqs[oldest].queued - class_expire_ms[c] * 1000000;
+        if (late > overdue) {
+            q = cq;
+            i = oldest;
+            overdue = late;
+        }
+    }
+    if (q) {
+        dequeue(q, i, r);
+        return 1;
+    }
+
+    for (c = 0; c < IOPRIO_NCLASSES && !(q && strict); c++) {
+        struct ioq *cq = &s->queues[c];
+        long long ckey;
+        if (!(mask & IOPRIO_BIT(c)) || cq->count == 0) continue;
+        j = candidate(s, cq, head);
+        ckey = request_key(s, &cq->reqs[j], head);
+        if (!q || ckey < key) {
+            q = cq;
+            i = j;
+            key = ckey;
+        }
+    }
+    if (!q) return 0;
+
+    // Nothing was left ahead of the sweep, so this request starts the return trip.
+    if (s->kind == IOSCHED_SCAN && key >= SWEEP_WRAP) s->direction = -s->direction;
+
+    dequeue(q, i, r);
+    return 1;
+}
+
+int iosched_take(struct iosched *s, io_type type, int blocknum, struct io_request *r) {
+    int c, i;
+
+    for (c = 0; c < IOPRIO_NCLASSES; c++) {
+        struct ioq *q = &s->queues[c];
+        for (i = lower_bound(q, blocknum); i < q->count && q->reqs[i].blocknum == blocknum; i++) {
+            if (q->reqs[i].type == type) {
+                dequeue(q, i, r);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int iosched_promote(struct iosched *s, int blocknum, io_class from, io_class to) {
+    struct ioq *q = &s->queues[from];
+    int moved = 0;
+
+    if (from == to) return 0;
+    while (1) {
+        struct io_request r;
+        int i = lower_bound(q, blocknum);
+        if (i >= q->count || q->reqs[i].blocknum != blocknum) return moved;
+        dequeue(q, i, &r);
+        r.prio = to;
+        if (insert(&s->queues[to], &r) < 0) {
+            // Put it back where it was; the queue had room for it a moment ago.
+            r.prio = from;
+            insert(q, &r);
+            return -1;
+        }
+        moved++;
+    }
+}
+
+int iosched_length(struct iosched *q) {
+    int c, n = 0;
+    for (c = 0; c < IOPRIO_NCLASSES; c++) n += q->queues[c].count;
+    return n;
+}
+
+int iosched_pending(struct iosched *q, io_class prio) {
+    return q->queues[prio].count;
+}
+
+iosched_kind iosched_policy(struct iosched *q) {
+    return q->kind;
+}
+
+void iosched_delete(struct iosched *q) {
+    int c;
+    for (c = 0; c < IOPRIO_NCLASSES; c++) free(q->queues[c].reqs);
+    free(q);
+}
+
+static const char *iosched_names[] = { "fifo", "sstf", "scan", "clook" };
+
+const char *iosched_name(iosched_kind kind) {
+    if (kind < IOSCHED_FIFO || kind > IOSCHED_CLOOK) return "unknown";
+    return iosched_names[kind];
+}
+
+int iosched_parse(const char *name, iosched_kind *kind) {
+    int i;
+    for (i = IOSCHED_FIFO; i <= IOSCHED_CLOOK; i++) {
+        if (!strcmp(name, iosched_names[i])) {
+            *kind = (iosched_kind)i;
+            return 0;
+        }
+    }
+    return -1;
+}
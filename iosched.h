@@ -0,0 +1,98 @@
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+/*
+The interface to the disk request queue used by the buffer cache's I/O scheduler.
+Pending requests are kept sorted by block number, and the queue's policy decides
+which one to serve next given the current position of the disk head.
+Every request belongs to a priority class: the policy orders requests within a
+class, more urgent classes go first, and a request that has waited past its
+class's deadline overtakes the rest, so nothing starves.
+Callers must serialize all calls made on the same queue.
+*/
+
+/* The ordering policies that may be selected for the request queue. */
+typedef enum {
+    IOSCHED_FIFO,    // Serve requests in arrival order.
+    IOSCHED_SSTF,    // Serve the request closest to the head.
+    IOSCHED_SCAN,    // Sweep up and down, reversing at the last pending request.
+    IOSCHED_CLOOK    // Sweep upwards only, then jump back to the lowest request.
+} iosched_kind;
+
+typedef enum {
+    IO_READ,
+    IO_WRITE
+} io_type;
+
+/* The priority classes of requests, most urgent first. */
+typedef enum {
+    IOPRIO_READ,       // A read miss that a thread is waiting for.
+    IOPRIO_SYNC,       // A writeback that a sync is waiting for.
+    IOPRIO_PREFETCH,   // A speculative read-ahead.
+    IOPRIO_WRITEBACK,  // Background writeback of a dirty block.
+    IOPRIO_NCLASSES
+} io_class;
+
+/* The set of classes iosched_pop may choose from, as a bit mask. */
+#define IOPRIO_BIT(c) (1u << (c))
+#define IOPRIO_ALL (IOPRIO_BIT(IOPRIO_NCLASSES) - 1)
+
+struct io_request {
+    int blocknum;                // Disk block to transfer
+    io_type type;                // Direction of the transfer
+    io_class prio;               // Priority class the request is queued in
+    void *owner;                 // Opaque pointer for the submitter, usually the cache block
+    unsigned long seq;           // Arrival order, assigned by iosched_push
+    long long queued;            // When the request was submitted, in ns; ages the request
+};
+
+/* Create an empty request queue using the given policy. */
+struct iosched * iosched_create( iosched_kind kind );
+
+/* Add a request to the queue, in class r->prio. Returns 0 on success, -1 if out of memory. */
+int iosched_push( struct iosched *q, const struct io_request *r );
+
+/*
+Remove the next request to serve with the head at block "head", and copy it into "r".
+Only the classes in "mask" are considered.  If one of their requests queued more than
+its class's deadline before "now", the most overdue such request goes first.
+Otherwise, with "strict" the most urgent non-empty class is served in the policy's
+order; without it all the classes in "mask" are ordered together by the policy.
+Returns 1 if a request was removed, or 0 if none of those classes has one.
+*/
+int iosched_pop( struct iosched *q, int head, unsigned mask, int strict, long long now, struct io_request *r );
+
+/*
+Remove the earliest pending request of the given type for exactly block "blocknum",
+from the most urgent class holding one, and copy it into "r", regardless of the policy.
+Used to grow a popped request into a run of adjacent blocks, so a transfer may mix
+classes.  Returns 1 if a request was removed, or 0 if there is none.
+*/
+int iosched_take( struct iosched *q, io_type type, int blocknum, struct io_request *r );
+
+/*
+Move the pending requests of class "from" for block "blocknum" into class "to",
+keeping their age, e.g. when a thread starts waiting for a prefetch.
+Returns the number of requests moved, or -1 if out of memory.
+*/
+int iosched_promote( struct iosched *q, int blocknum, io_class from, io_class to );
+
+/* Return the number of pending requests. */
+int iosched_length( struct iosched *q );
+
+/* Return the number of pending requests of the given class. */
+int iosched_pending( struct iosched *q, io_class prio );
+
+/* Return the policy of the queue. */
+iosched_kind iosched_policy( struct iosched *q );
+
+/* Release the queue and any requests still in it. */
+void iosched_delete( struct iosched *q );
+
+/* Return the printable name of a policy kind. */
+const char * iosched_name( iosched_kind kind );
+
+/* Parse a policy name ("fifo", "sstf", "scan", "clook"). Returns 0 on success, -1 otherwise. */
+int iosched_parse( const char *name, iosched_kind *kind );
+
+#endif
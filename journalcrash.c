@@ -0,0 +1,89 @@
+/*
+This is a test of journal replay after a crash.
+Two threads keep overwriting the same block of a cache that has a journal, each
+write carrying the thread and a count.  No scheduler runs, so nothing is ever
+written home: when the writers stop, the block's only durable copies are in the
+journal, which is what a crash would leave behind.  A second cache created on the
+same disk replays the journal, and the block at home must then hold exactly what
+the first cache held, the last value written, however the two threads' log
+records were ordered.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "testutil.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define DATA_BLOCKS 64
+#define WRITES 400               // Writes by each thread in each round.
+#define WRITERS 2
+#define JOURNAL_BLOCKS (WRITERS * WRITES * 2 + 2) // Room for every write in a record of its own, so the log never fills.
+#define MEMORY_BLOCKS 8
+#define TARGET 5                 // The block both threads write.
+#define ROUNDS 10
+
+struct writer {
+    struct bcache *bc;
+    int id;
+};
+
+static void *writer_thread(void *arg) {
+    struct writer *w = arg;
+    char data[BLOCK_SIZE];
+    int i;
+
+    for (i = 0; i < WRITES; i++) {
+        // Every write differs all through the block, so no two log records match.
+        memset(data, w->id * WRITES + i, BLOCK_SIZE);
+        snprintf(data, BLOCK_SIZE, "writer %d write %d", w->id, i);
+        bcache_write(w->bc, TARGET, data);
+    }
+    return NULL;
+}
+
+int main(void) {
+    struct bcache_config cfg;
+    char last[BLOCK_SIZE], home[BLOCK_SIZE];
+    int round, i;
+
+    struct disk *d = test_open_disk("journalcrashdisk", DATA_BLOCKS + JOURNAL_BLOCKS);
+    bcache_config_init(&cfg, MEMORY_BLOCKS);
+    cfg.journal_blocks = JOURNAL_BLOCKS;
+
+    for (round = 0; round < ROUNDS; round++) {
+        struct writer writers[WRITERS];
+        pthread_t tids[WRITERS];
+        struct bcache *bc, *after;
+
+        // Each cache replays whatever the previous round left in the journal, and so starts clean.
+        bc = bcache_create_config(d, &cfg);
+        if (!bc) return 1;
+        for (i = 0; i < WRITERS; i++) {
+            writers[i].bc = bc;
+            writers[i].id = i;
+            pthread_create(&tids[i], 0, writer_thread, &writers[i]);
+        }
+        for (i = 0; i < WRITERS; i++) pthread_join(tids[i], 0);
+
+        // Without a scheduler nothing was written home, so the cache has the only copy of the last write.
+        bcache_read(bc, TARGET, last);
+
+        // The crash: the cache is abandoned, and a new one recovers from the journal.
+        after = bcache_create_config(d, &cfg);
+        if (!after) return 1;
+        disk_read(d, TARGET, home);
+        if (memcmp(home, last, BLOCK_SIZE) != 0) {
+            printf("round %d: cache held \"%s\" but replay left \"%.32s\"\n", round, last, home);
+            printf("FAILED: replay restored an older write\n");
+            return 1;
+        }
+    }
+
+    printf("%d rounds of %d writes by %d threads, last write survived each crash\n", ROUNDS, WRITES, WRITERS);
+    disk_close(d);
+    printf("ok\n");
+    return 0;
+}
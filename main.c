@@ -6,6 +6,7 @@ You should read and understand this file, but shouldn't change it.
 #include "program.h"
 #include "bcache.h"
 #include "disk.h"
+#include "replay.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,10 +15,23 @@ You should read and understand this file, but shouldn't change it.
 #include <pthread.h>
 #include <sys/time.h>
 
+/* A program thread that first moves next to the memory of one shard of the cache. */
+struct bound_program {
+	struct bcache *cache;
+	int shard;
+};
+
+static void * bound_program_thread( void *arg )
+{
+	struct bound_program *p = arg;
+	bcache_bind_thread(p->cache,p->shard);
+	return program_thread(p->cache);
+}
+
 int main( int argc, char *argv[] )
 {
-	if(argc!=4) {
-		printf("use: %s <nthreads> <buffer-blocks> <disk-blocks>\n",argv[0]);
+	if(argc<4) {
+		printf("use: %s <nthreads> <buffer-blocks> <disk-blocks> [-e lru|clock|2q] [-A all|tinylfu] [-s fifo|sstf|scan|clook] [-b batch-blocks] [-d batch-ms] [-r readahead-max] [-a prefetch-depth] [-t tracefile]\n          [-c capture-log] [-p|-P|-S replay-log] [-k] [-n ndisks] [-v stripe|concat] [-u stripe-blocks] [-j journal-blocks]\n          [-w dirty-low-percent] [-W dirty-high-percent] [-g dirty-age-ms] [-x shards] [-y shard-blocks] [-N] [-m] [-F] [-z]\n          [-B sim|mmap|direct] [-q queue-depth] [-Z ztier-kb] [-l state-file]\n",argv[0]);
 		return 1;
 	}
 
@@ -25,22 +39,218 @@ int main( int argc, char *argv[] )
 	int bblocks = atoi(argv[2]);
 	int dblocks = atoi(argv[3]);
 	int i;
+	const char *tracefile = 0;
+	const char *capturefile = 0;
+	const char *replayfile = 0;
+	const char *statefile = 0;
+	char replaymode = 0;
+	int keepdisk = 0;
+	disk_backend backend = DISK_SIM;
+	int depth = 1;
+	int nodelay = 0;
+	int ndisks = 1;
+	volume_kind layout = VOLUME_STRIPE;
+	int stripe_blocks = 16;
+	struct trace *replay = 0;
+
+	struct bcache_config config;
+	bcache_config_init(&config,bblocks);
+
+	for(i=4;i<argc;i++) {
+		if(!strcmp(argv[i],"-e") && i+1<argc) {
+			if(evict_parse(argv[++i],&config.evict_policy)<0) {
+				printf("unknown eviction policy: %s\n",argv[i]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i],"-A") && i+1<argc) {
+			if(admit_parse(argv[++i],&config.admit_policy)<0) {
+				printf("unknown admission policy: %s\n",argv[i]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i],"-s") && i+1<argc) {
+			if(iosched_parse(argv[++i],&config.sched_policy)<0) {
+				printf("unknown scheduling policy: %s\n",argv[i]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i],"-b") && i+1<argc) {
+			config.batch_blocks = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-d") && i+1<argc) {
+			config.batch_ms = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-r") && i+1<argc) {
+			config.readahead_max = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-a") && i+1<argc) {
+			config.prefetch_depth = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-t") && i+1<argc) {
+			tracefile = argv[++i];
+		} else if(!strcmp(argv[i],"-n") && i+1<argc) {
+			ndisks = atoi(argv[++i]);
+			if(ndisks<1) {
+				printf("need at least one disk\n");
+				return 1;
+			}
+		} else if(!strcmp(argv[i],"-v") && i+1<argc) {
+			if(volume_parse(argv[++i],&layout)<0) {
+				printf("unknown volume layout: %s\n",argv[i]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i],"-u") && i+1<argc) {
+			stripe_blocks = atoi(argv[++i]);
+			if(stripe_blocks<1) stripe_blocks = 1;
+		} else if(!strcmp(argv[i],"-w") && i+1<argc) {
+			config.dirty_low = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-W") && i+1<argc) {
+			config.dirty_high = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-g") && i+1<argc) {
+			config.dirty_age_ms = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-x") && i+1<argc) {
+			config.shards = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-y") && i+1<argc) {
+			config.shard_blocks = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-N")) {
+			config.numa = 1;
+		} else if(!strcmp(argv[i],"-B") && i+1<argc) {
+			if(disk_backend_parse(argv[++i],&backend)<0) {
+				printf("unknown disk backend: %s\n",argv[i]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i],"-q") && i+1<argc) {
+			depth = atoi(argv[++i]);
+			if(depth<1) depth = 1;
+		} else if(!strcmp(argv[i],"-m")) {
+			backend = DISK_MMAP;
+		} else if(!strcmp(argv[i],"-F")) {
+			backend = DISK_MMAP;
+			config.mapped = 1;
+		} else if(!strcmp(argv[i],"-Z") && i+1<argc) {
+			config.ztier_kb = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-z")) {
+			nodelay = 1;
+		} else if(!strcmp(argv[i],"-j") && i+1<argc) {
+			config.journal_blocks = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-l") && i+1<argc) {
+			statefile = argv[++i];
+		} else if(!strcmp(argv[i],"-k")) {
+			keepdisk = 1;
+		} else if(!strcmp(argv[i],"-c") && i+1<argc) {
+			capturefile = argv[++i];
+		} else if((!strcmp(argv[i],"-p") || !strcmp(argv[i],"-P") || !strcmp(argv[i],"-S")) && i+1<argc) {
+			replaymode = argv[i][1];
+			replayfile = argv[++i];
+		} else {
+			printf("unknown option: %s\n",argv[i]);
+			return 1;
+		}
+	}
 	
-	printf("Creating disk image %s with %d disk blocks\n","myvirtualdisk",dblocks);
-	struct disk *thedisk = disk_open("myvirtualdisk",dblocks);
-	if(!thedisk) {
-		printf("couldn't open %s: %s\n","myvirtualdisk",strerror(errno));
+	if(replayfile) {
+		replay = trace_load(replayfile);
+		if(!replay) {
+			printf("couldn't load access log %s\n",replayfile);
+			return 1;
+		}
+		if(trace_nblocks(replay)>dblocks) {
+			printf("access log %s touches %d blocks, more than the disk has\n",replayfile,trace_nblocks(replay));
+			return 1;
+		}
+	}
+
+	if(replaymode=='S') {
+		struct trace_sim sim;
+		printf("Simulating %d accesses from %s with %d memory blocks (%s eviction, %s admission, %s order)\n",trace_length(replay),replayfile,bblocks,evict_name(config.evict_policy),admit_name(config.admit_policy),iosched_name(config.sched_policy));
+		trace_simulate(replay,&config,&sim);
+		printf("Simulated Performance:\n");
+		printf("----------------------\n");
+		printf("bcache   hits: %lld\n",sim.hits);
+		printf("bcache misses: %lld\n",sim.misses);
+		printf("bcache  admit: %lld rejected\n",sim.rejected);
+		printf("  disk  reads: %lld\n",sim.disk_reads);
+		printf("  disk writes: %lld\n",sim.disk_writes);
+		printf("  disk   seek: %lld blocks\n",sim.seek);
+		printf("  disk   time: %.2lfs\n",sim.disk_seconds);
+		trace_delete(replay);
+		return 0;
+	}
+
+	/*
+	The disk blocks are shared out evenly over the disks.  A stripe is
+	rounded up to whole stripe units, so it may hold a few more blocks.
+	A single disk is used whole, whatever the layout.
+	*/
+	if(ndisks==1) layout = VOLUME_CONCAT;
+	struct disk **disks = malloc(sizeof(struct disk *)*ndisks);
+	int disk_blocks = (dblocks+ndisks-1)/ndisks;
+	if(layout==VOLUME_STRIPE) disk_blocks = (disk_blocks+stripe_blocks-1)/stripe_blocks*stripe_blocks;
+	for(i=0;i<ndisks;i++) {
+		char name[64];
+		int blocks = disk_blocks;
+		if(i) sprintf(name,"myvirtualdisk.%d",i);
+		else strcpy(name,"myvirtualdisk");
+		if(layout==VOLUME_CONCAT && i==ndisks-1) blocks = dblocks-disk_blocks*(ndisks-1);
+		printf("Creating %s disk image %s with %d disk blocks%s\n",disk_backend_name(backend),name,blocks,nodelay && backend!=DISK_DIRECT ? ", no seek delay" : "");
+		disks[i] = disk_open_backend(name,blocks,backend,depth);
+		if(!disks[i]) {
+			printf("couldn't open %s: %s\n",name,strerror(errno));
+			return 1;
+		}
+		if(disk_depth(disks[i])>1) printf("  up to %d transfers in flight\n",disk_depth(disks[i]));
+		if(nodelay) disk_set_delay(disks[i],0);
+	}
+
+	struct volume *thevolume = volume_create(disks,ndisks,layout,stripe_blocks);
+	if(!thevolume) {
+		printf("couldn't create volume\n");
 		return 1;
 	}
+	if(ndisks>1) printf("Arranging %d disks as a %s volume of %d blocks\n",ndisks,volume_name(layout),volume_nblocks(thevolume));
 
-	printf("Writing known values to the disk...\n");
-	program_fill_disk(thedisk);
-	disk_reset_stats(thedisk);
+	if(keepdisk && program_check_volume(thevolume,volume_nblocks(thevolume)-config.journal_blocks)) {
+		printf("Reusing the known values already on the disk\n");
+	} else {
+		printf("Writing known values to the disk...\n");
+		program_fill_volume(thevolume);
+	}
+	for(i=0;i<ndisks;i++) disk_reset_stats(disks[i]);
 		
-	printf("Creating buffer/cache with %d memory blocks\n",bblocks);
-	struct bcache *thecache = bcache_create(thedisk,bblocks);
+	printf("Creating buffer/cache with %d memory blocks (%s eviction, %s admission)\n",bblocks,evict_name(config.evict_policy),admit_name(config.admit_policy));
+	struct bcache_stats stats;
+	struct bcache *thecache = bcache_create_volume(thevolume,&config);
+	if(!thecache) {
+		printf("couldn't create buffer cache\n");
+		return 1;
+	}
+	if(config.mapped) printf("Mapping the cache frames onto the disk images\n");
+	if(config.ztier_kb>0) printf("Keeping up to %dKB of evicted clean blocks compressed\n",config.ztier_kb);
+	if(bcache_nshards(thecache)>1) printf("Splitting the cache into %d shards%s\n",bcache_nshards(thecache),config.numa ? " over the memory nodes" : "");
+	if(config.journal_blocks>0) {
+		bcache_get_stats(thecache,&stats);
+		printf("Keeping a %d block journal, %d blocks replayed from it\n",config.journal_blocks,stats.journal_replayed);
+	}
 	
-	printf("Starting I/O scheduler thread\n");
+	if(tracefile && bcache_trace_open(thecache,tracefile)<0) {
+		printf("couldn't create %s: %s\n",tracefile,strerror(errno));
+		return 1;
+	}
+
+	/*
+	The blocks resident at the end of the last run with the same state file are
+	read back in while the programs run, so they do not start from a cold cache.
+	*/
+	if(statefile) {
+		int warmed = bcache_load_state(thecache,statefile);
+		if(warmed>=0) {
+			printf("Warming the cache with %d blocks saved in %s\n",warmed,statefile);
+		} else if(errno!=ENOENT) {
+			printf("couldn't load cache state %s: %s\n",statefile,strerror(errno));
+			return 1;
+		}
+	}
+
+	if(capturefile && bcache_record_open(thecache,capturefile)<0) {
+		printf("couldn't create %s: %s\n",capturefile,strerror(errno));
+		return 1;
+	}
+
+	printf("Starting I/O scheduler thread (%s order)\n",iosched_name(config.sched_policy));
 	pthread_t scheduler_tid;
 	pthread_create(&scheduler_tid,0,bcache_io_scheduler,thecache);
 
@@ -49,15 +259,24 @@ int main( int argc, char *argv[] )
 	
 	gettimeofday(&starttime,0);
 
-	printf("Starting %d program threads...\n",nthreads);
-	pthread_t *program_tid = malloc(sizeof(pthread_t)*nthreads);
-	for(i=0;i<nthreads;i++) {
-		pthread_create(&program_tid[i],0,program_thread,thecache);
-	}
+	if(replay) {
+		printf("Replaying %d accesses from %s on %d threads (%s)...\n",trace_length(replay),replayfile,trace_nthreads(replay),replaymode=='p' ? "recorded pacing" : "as fast as possible");
+		trace_replay(replay,thecache,replaymode=='p');
+	} else {
+		printf("Starting %d program threads...\n",nthreads);
+		pthread_t *program_tid = malloc(sizeof(pthread_t)*nthreads);
+		struct bound_program *bound = malloc(sizeof(struct bound_program)*nthreads);
+		for(i=0;i<nthreads;i++) {
+			// With the shards spread over the memory nodes, the threads are spread the same way.
+			bound[i].cache = thecache;
+			bound[i].shard = i%bcache_nshards(thecache);
+			pthread_create(&program_tid[i],0,config.numa ? bound_program_thread : program_thread,config.numa ? (void *)&bound[i] : (void *)thecache);
+		}
 
-	printf("Waiting for programs to complete...\n");
-	for(i=0;i<nthreads;i++) {
-		pthread_join(program_tid[i],0);
+		printf("Waiting for programs to complete...\n");
+		for(i=0;i<nthreads;i++) {
+			pthread_join(program_tid[i],0);
+		}
 	}
 
 	printf("Syncing buffer cache...\n");
@@ -65,9 +284,22 @@ int main( int argc, char *argv[] )
 		      
 	gettimeofday(&stoptime,0);
 
+	if(statefile) {
+		int saved = bcache_save_state(thecache,statefile);
+		if(saved<0) printf("couldn't save cache state %s: %s\n",statefile,strerror(errno));
+		else printf("Saved %d resident blocks to %s\n",saved,statefile);
+	}
+
 	double elapsed = stoptime.tv_sec - starttime.tv_sec + stoptime.tv_usec/1000000.0 - starttime.tv_usec/1000000.0;
 
-	int disk_ops = disk_nreads(thedisk)+disk_nwrites(thedisk);
+	bcache_get_stats(thecache,&stats);
+
+	int disk_reads = 0, disk_writes = 0;
+	for(i=0;i<ndisks;i++) {
+		disk_reads += disk_nreads(disks[i]);
+		disk_writes += disk_nwrites(disks[i]);
+	}
+	int disk_ops = disk_reads+disk_writes;
 	int bcache_ops = bcache_nreads(thecache)+bcache_nwrites(thecache);
 
 	printf("System Performance:\n");
@@ -76,11 +308,54 @@ int main( int argc, char *argv[] )
 	printf("bcache  reads: %d\n",bcache_nreads(thecache));
 	printf("bcache writes: %d\n",bcache_nwrites(thecache));
 	printf("bcache   perf: %.2lf ops/s\n",(double)bcache_ops/elapsed);
-	printf("  disk  reads: %d\n",disk_nreads(thedisk));
-	printf("  disk writes: %d\n",disk_nwrites(thedisk));
+	printf("bcache  ahead: %d issued, %d hit, %d wasted, %lld dropped, %lld promoted\n",bcache_prefetch_issued(thecache),bcache_prefetch_hits(thecache),bcache_prefetch_wasted(thecache),stats.prefetch_dropped,stats.prefetch_promoted);
+	printf("bcache   hits: %lld (%.1lf%%)\n",stats.hits,stats.hits+stats.misses ? 100.0*stats.hits/(stats.hits+stats.misses) : 0.0);
+	printf("bcache misses: %lld\n",stats.misses);
+	printf("bcache  admit: %lld admitted, %lld rejected\n",stats.admitted,stats.rejected);
+	printf("bcache evicts: %lld\n",stats.evictions);
+	printf("bcache wbacks: %lld written, %lld coalesced\n",stats.writebacks,stats.coalesced_writes);
+	printf("bcache  queue: %d pending, %d peak\n",stats.queue_depth,stats.queue_peak);
+	printf("bcache  locks: %.2lfms waiting\n",stats.lock_wait_ns/1000000.0);
+	printf("bcache  dirty: %lld writes throttled for %.2lfms\n",stats.throttled,stats.throttle_ns/1000000.0);
+	if(stats.warmed>0) printf("bcache   warm: %lld blocks read back from %s\n",stats.warmed,statefile);
+	if(config.ztier_kb>0) {
+		long long lookups = stats.ztier.hits+stats.ztier.misses;
+		printf("bcache  ztier: %lld hits of %lld lookups (%.1lf%%), %lld stored, %lld dropped, %lld incompressible\n",stats.ztier.hits,lookups,lookups ? 100.0*stats.ztier.hits/lookups : 0.0,stats.ztier.stored,stats.ztier.dropped,stats.ztier.incompressible);
+		printf("bcache  ztier: %d blocks in %.1lfKB, %.1lfx compression\n",stats.ztier.blocks,stats.ztier.bytes/1024.0,stats.ztier.packed_bytes ? (double)stats.ztier.raw_bytes/stats.ztier.packed_bytes : 0.0);
+	}
+	if(config.journal_blocks>0) printf("bcache   jrnl: %lld blocks in %lld records, %lld checkpoints\n",stats.journaled,stats.journal_records,stats.checkpoints);
+	printf("  disk  reads: %d\n",disk_reads);
+	printf("  disk writes: %d\n",disk_writes);
 	printf("  disk   perf: %.2lf ops/s\n",(double)disk_ops/elapsed);
+	for(i=0;ndisks>1 && i<ndisks;i++) {
+		struct bcache_disk_stats ds;
+		bcache_get_disk_stats(thecache,i,&ds);
+		printf("  disk %5d: %d reads, %d writes, %lld transfers, %.0lf%% busy, %d peak queue\n",i,ds.reads,ds.writes,ds.transfers,100.0*ds.busy_ns/1e9/elapsed,ds.queue_peak);
+	}
+
+	for(i=0;bcache_nshards(thecache)>1 && i<bcache_nshards(thecache);i++) {
+		struct bcache_shard_stats ss;
+		bcache_get_shard_stats(thecache,i,&ss);
+		printf(" shard %5d: %d frames, %lld hits, %lld misses, %lld evicts",i,ss.frames,ss.hits,ss.misses,ss.evictions);
+		if(ss.node>=0) printf(", node %d",ss.node);
+		printf("\n");
+	}
+
+	printf("Latency (ms):      count      p50      p99     p999      max\n");
+	printf("------------------------------------------------------------\n");
+	for(i=0;i<BCACHE_NLATENCY;i++) {
+		struct bcache_latency lat;
+		bcache_get_latency(thecache,i,&lat);
+		printf("%12s %10lld %8.3lf %8.3lf %8.3lf %8.3lf\n",bcache_latency_name(i),lat.count,lat.p50/1e6,lat.p99/1e6,lat.p999/1e6,lat.max/1e6);
+	}
+
+	if(tracefile) bcache_trace_close(thecache);
+	if(capturefile) bcache_record_close(thecache);
+	if(replay) trace_delete(replay);
 	
-	disk_close(thedisk);
+	volume_delete(thevolume);
+	for(i=0;i<ndisks;i++) disk_close(disks[i]);
+	free(disks);
 
 	return 0;
 }
\ No newline at end of file
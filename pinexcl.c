@@ -0,0 +1,133 @@
+/*
+This is a test of the exclusion between pins.
+A writer keeps write-pinning one block and filling its frame with a new byte in
+two halves, pausing in between, while readers read the block by copy and by
+read pin.  No reader may ever see a frame holding two different bytes, and a
+read pin must see the frame stay as it was until it is released.
+Then a pinned block must keep its frame while many other blocks pass through
+the cache, and a write pin's change must reach the disk after a sync.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "testutil.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DISK_BLOCKS 256
+#define MEMORY_BLOCKS 16
+#define TARGET 3                 // The block the writer and readers share.
+#define WRITES 200               // Times the writer refills the frame.
+#define READERS 2
+#define PAUSE_NS 20000           // Time the writer leaves a half-filled frame, and a read pin holds one.
+#define PINNED 5                 // The block pinned while others churn the cache.
+
+struct shared {
+    struct bcache *bc;
+    volatile int done;           // The writer has finished.
+    int torn;                    // Frames seen holding two bytes; updated atomically.
+    int changed;                 // Read pins that saw the frame change under them; updated atomically.
+    long long reads;             // Reads of each kind, to show the readers ran; updated atomically.
+    long long pins;
+};
+
+static struct timespec pause_time = { 0, PAUSE_NS };
+
+/* Whether all of a frame holds the same byte. */
+static int uniform(const char *data) {
+    int i;
+    for (i = 1; i < BLOCK_SIZE; i++) {
+        if (data[i] != data[0]) return 0;
+    }
+    return 1;
+}
+
+static void *writer_thread(void *arg) {
+    struct shared *s = arg;
+    int i;
+
+    for (i = 1; i <= WRITES; i++) {
+        char *frame = bcache_get(s->bc, TARGET, BCACHE_PIN_WRITE);
+        memset(frame, i, BLOCK_SIZE / 2);
+        nanosleep(&pause_time, NULL);
+        memset(frame + BLOCK_SIZE / 2, i, BLOCK_SIZE / 2);
+        bcache_put(s->bc, frame, BCACHE_PIN_WRITE);
+    }
+    __atomic_store_n(&s->done, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void *reader_thread(void *arg) {
+    struct shared *s = arg;
+    char data[BLOCK_SIZE], first;
+
+    while (!__atomic_load_n(&s->done, __ATOMIC_SEQ_CST)) {
+        const char *frame;
+
+        bcache_read(s->bc, TARGET, data);
+        if (!uniform(data)) __sync_fetch_and_add(&s->torn, 1);
+        __sync_fetch_and_add(&s->reads, 1);
+
+        frame = bcache_get(s->bc, TARGET, BCACHE_PIN_READ);
+        first = frame[0];
+        if (!uniform(frame)) __sync_fetch_and_add(&s->torn, 1);
+        nanosleep(&pause_time, NULL);
+        if (frame[0] != first || frame[BLOCK_SIZE - 1] != first) __sync_fetch_and_add(&s->changed, 1);
+        bcache_put(s->bc, (char *)frame, BCACHE_PIN_READ);
+        __sync_fetch_and_add(&s->pins, 1);
+    }
+    return NULL;
+}
+
+int main(void) {
+    struct bcache_config cfg;
+    struct shared s;
+    pthread_t writer, readers[READERS];
+    char data[BLOCK_SIZE], *frame;
+    int i;
+
+    struct disk *d = test_open_disk("pinexcldisk", DISK_BLOCKS);
+    memset(data, 0, sizeof(data));
+    for (i = 0; i < DISK_BLOCKS; i++) disk_write(d, i, data);
+
+    test_config(&cfg, MEMORY_BLOCKS);
+    struct bcache *bc = test_start_cache(d, &cfg);
+    if (!bc) return 1;
+
+    memset(&s, 0, sizeof(s));
+    s.bc = bc;
+    for (i = 0; i < READERS; i++) pthread_create(&readers[i], 0, reader_thread, &s);
+    pthread_create(&writer, 0, writer_thread, &s);
+    pthread_join(writer, 0);
+    for (i = 0; i < READERS; i++) pthread_join(readers[i], 0);
+    printf("%d pinned writes against %lld reads and %lld read pins\n", WRITES, s.reads, s.pins);
+    if (s.torn > 0 || s.changed > 0) {
+        printf("FAILED: %d frames seen half written, %d read pins saw the frame change\n", s.torn, s.changed);
+        return 1;
+    }
+
+    // Many times the cache's worth of other blocks pass through while the pin is held.
+    frame = bcache_get(bc, PINNED, BCACHE_PIN_WRITE);
+    memset(frame, 'p', BLOCK_SIZE);
+    for (i = 0; i < DISK_BLOCKS; i++) {
+        if (i != PINNED) bcache_read(bc, i, data);
+    }
+    if (!uniform(frame) || frame[0] != 'p') {
+        printf("FAILED: the pinned frame was reused while pinned\n");
+        return 1;
+    }
+    bcache_put(bc, frame, BCACHE_PIN_WRITE);
+    bcache_sync(bc);
+    disk_read(d, PINNED, data);
+    if (!uniform(data) || data[0] != 'p') {
+        printf("FAILED: a write pin's change did not reach the disk\n");
+        return 1;
+    }
+
+    disk_close(d);
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+This is a test that a thread waiting on a queued prefetch is served at read priority.
+A cache is warmed from a saved state of scattered blocks, which queues them all
+behind any read a thread waits for.  Pinning the last of them must move it to the
+front, so it comes back while most of the warm-up is still queued.  Then a
+sequential stream is read through the same backlog, and an asynchronous read of a
+block its read-ahead queued must overtake the warm-up in the same way.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "testutil.h"
+
+#include <stdio.h>
+
+#define DISK_BLOCKS 512
+#define MEMORY_BLOCKS 256
+#define WARM_BLOCKS 32           // Blocks saved, then queued as warm-up.
+#define WARM_STRIDE 7            // Gap between them, so no two go out in one transfer.
+#define STREAM_START (DISK_BLOCKS - 8) // First block of the sequential stream; the disk's end bounds its read-ahead.
+#define STREAM_READS 3           // Reads that start read-ahead.
+#define STATE_FILE "prefetchwaitstate"
+
+/* Make a cache of MEMORY_BLOCKS over "d" serving requests in arrival order, with read-ahead as given. */
+static struct bcache *make_cache(struct disk *d, int readahead) {
+    struct bcache_config cfg;
+    test_config(&cfg, MEMORY_BLOCKS);
+    cfg.sched_policy = IOSCHED_FIFO;
+    cfg.readahead_max = readahead;
+    return test_start_cache(d, &cfg);
+}
+
+/* Load the saved state into "bc" with the disk's delay on, so the warm-up is still queued when this returns. */
+static int load_backlog(struct bcache *bc, struct disk *d) {
+    disk_set_delay(d, 1);
+    disk_reset_stats(d);
+    if (bcache_load_state(bc, STATE_FILE) == WARM_BLOCKS) return 1;
+    printf("FAILED: couldn't load %d warm blocks\n", WARM_BLOCKS);
+    return 0;
+}
+
+/*
+Read every warm block from "bc", and every block the stream could read ahead, and check them,
+so that nothing is left queued for the disk.  Returns 0 if any was wrong.
+*/
+static int drain_backlog(struct bcache *bc) {
+    char data[BLOCK_SIZE];
+    int i;
+
+    for (i = 0; i < WARM_BLOCKS; i++) {
+        bcache_read(bc, i * WARM_STRIDE, data);
+        if (!test_check_block("read", i * WARM_STRIDE, 0, data)) return 0;
+    }
+    for (i = STREAM_START; i < DISK_BLOCKS; i++) {
+        bcache_read(bc, i, data);
+        if (!test_check_block("read", i, 0, data)) return 0;
+    }
+    return 1;
+}
+
+/* Return 1 if "bc" promoted a prefetch and fewer than half of the warm blocks were read before "what" was served. */
+static int served_first(struct bcache *bc, struct disk *d, const char *what) {
+    struct bcache_stats stats;
+    int reads = disk_nreads(d);
+
+    bcache_get_stats(bc, &stats);
+    if (stats.prefetch_promoted > 0 && reads < WARM_BLOCKS / 2) return 1;
+    printf("FAILED: %s was served after %d disk reads with %lld prefetches promoted\n", what, reads, stats.prefetch_promoted);
+    return 0;
+}
+
+int main(void) {
+    struct bcache_request *req;
+    struct bcache_stats stats;
+    struct bcache *bc;
+    char data[BLOCK_SIZE];
+    char *pinned;
+    int i, last = (WARM_BLOCKS - 1) * WARM_STRIDE, ahead = STREAM_START + STREAM_READS;
+
+    struct disk *d = test_open_disk("prefetchwaitdisk", DISK_BLOCKS);
+    test_fill_disk(d, DISK_BLOCKS);
+
+    bc = make_cache(d, 0);
+    if (!bc) return 1;
+    for (i = 0; i < WARM_BLOCKS; i++) bcache_read(bc, i * WARM_STRIDE, data);
+    if (bcache_save_state(bc, STATE_FILE) != WARM_BLOCKS) {
+        printf("FAILED: couldn't save %d warm blocks\n", WARM_BLOCKS);
+        return 1;
+    }
+
+    // The warm-up goes out in block order, so the last block would come back last.
+    bc = make_cache(d, 0);
+    if (!bc || !load_backlog(bc, d)) return 1;
+    pinned = bcache_get(bc, last, BCACHE_PIN_READ);
+    if (!served_first(bc, d, "a pin") || !test_check_block("pin", last, 0, pinned)) return 1;
+    bcache_put(bc, pinned, BCACHE_PIN_READ);
+    if (!drain_backlog(bc)) return 1;
+
+    bc = make_cache(d, 8);
+    if (!bc || !load_backlog(bc, d)) return 1;
+    // Misses overtake the warm-up, but what they read ahead queues behind it.
+    for (i = 0; i < STREAM_READS; i++) bcache_read(bc, STREAM_START + i, data);
+    bcache_get_stats(bc, &stats);
+    if (stats.prefetch_issued == 0) {
+        printf("FAILED: %d sequential reads read nothing ahead\n", STREAM_READS);
+        return 1;
+    }
+    req = bcache_read_async(bc, ahead, data, NULL, NULL);
+    if (!req) return 1;
+    bcache_wait(req);
+    bcache_request_free(req);
+    if (!served_first(bc, d, "an asynchronous read") || !test_check_block("async read", ahead, 0, data)) return 1;
+    if (!drain_backlog(bc)) return 1;
+
+    printf("a pin and an asynchronous read overtook a backlog of %d warm blocks\n", WARM_BLOCKS);
+    disk_close(d);
+    printf("ok\n");
+    return 0;
+}
@@ -9,6 +9,7 @@ You are welcome to read this file, but don't change it.
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #define ITERATIONS 100
 
@@ -30,21 +31,111 @@ static void check_data( const char *data, int expected_block )
 
 /*
 Fill up the disk with known values so we can check them later.
+The disk is written in large extents, each paying a single seek,
+or straight into the image when the disk is mapped.
+Every block is marked with its number in the volume "v", where it is disk
+"index", or with its own number when there is no volume.
 */
 
+#define FILL_EXTENT 256
+
+static int fill_value( struct volume *v, int index, int block )
+{
+	return v ? volume_logical(v,index,block) : block;
+}
+
+static void fill_disk( struct disk *d, struct volume *v, int index )
+{
+	char *data;
+	int i,j,k;
+
+	if(disk_map(d,0)) {
+		for(i=0;i<disk_nblocks(d);i++) {
+			char *page = disk_map(d,i);
+			memset(page,0,BLOCK_SIZE);
+			for(j=0;j<BLOCK_SIZE;j+=16) {
+				page[j] = (char)fill_value(v,index,i);
+			}
+		}
+		return;
+	}
+
+	data = calloc(FILL_EXTENT,BLOCK_SIZE);
+	if(!data) {
+		printf("couldn't allocate memory to fill the disk\n");
+		abort();
+	}
+
+	for(i=0;i<disk_nblocks(d);i+=FILL_EXTENT) {
+		int count = disk_nblocks(d)-i < FILL_EXTENT ? disk_nblocks(d)-i : FILL_EXTENT;
+		for(k=0;k<count;k++) {
+			for(j=0;j<BLOCK_SIZE;j+=16) {
+				data[k*BLOCK_SIZE+j] = (char)fill_value(v,index,i+k);
+			}
+		}
+		disk_write_range(d,i,count,data);
+	}
+	free(data);
+}
+
 void program_fill_disk( struct disk *d )
 {
-	char data[BLOCK_SIZE];
-	int i,j;
-	
-	for(i=0;i<disk_nblocks(d);i++) {
-		for(j=0;j<BLOCK_SIZE;j+=16) {
-			data[j] = (char)i;
+	fill_disk(d,0,0);
+}
+
+void program_fill_volume( struct volume *v )
+{
+	int i;
+	for(i=0;i<volume_ndisks(v);i++) {
+		fill_disk(volume_disk(v,i),v,i);
+	}
+}
+
+/*
+Check that every block of the disk still holds the values written by program_fill_disk.
+The programs only ever overwrite blocks in a way that keeps them, so an image
+left behind by an earlier run can be reused. Returns 1 if the disk is good.
+Blocks that lie outside the volume, or at or beyond "nblocks" in it, are not checked.
+*/
+
+static int check_disk( struct disk *d, struct volume *v, int index, int nblocks )
+{
+	char *data = malloc((size_t)FILL_EXTENT*BLOCK_SIZE);
+	int i,j,k,good=1;
+
+	if(!data) return 0;
+
+	for(i=0;good && i<disk_nblocks(d);i+=FILL_EXTENT) {
+		int count = disk_nblocks(d)-i < FILL_EXTENT ? disk_nblocks(d)-i : FILL_EXTENT;
+		disk_read_range(d,i,count,data);
+		for(k=0;good && k<count;k++) {
+			int value = fill_value(v,index,i+k);
+			if(value<0 || value>=nblocks) continue;
+			for(j=0;j<BLOCK_SIZE;j+=16) {
+				if(data[k*BLOCK_SIZE+j] != (char)value) {
+					good = 0;
+					break;
+				}
+			}
 		}
-		disk_write(d,i,data);
 	}
+	free(data);
+	return good;
+}
+
+int program_check_disk( struct disk *d )
+{
+	return check_disk(d,0,0,disk_nblocks(d));
 }
 
+int program_check_volume( struct volume *v, int nblocks )
+{
+	int i;
+	for(i=0;i<volume_ndisks(v);i++) {
+		if(!check_disk(volume_disk(v,i),v,i,nblocks)) return 0;
+	}
+	return 1;
+}
 
 /*
 The alpha program alternates between accessing the first 10%
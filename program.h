@@ -2,9 +2,16 @@
 #define PROGRAM_H
 
 #include "disk.h"
+#include "volume.h"
 
 void * program_thread( void *bc );
 
 void program_fill_disk( struct disk *d );
 
+int program_check_disk( struct disk *d );
+
+void program_fill_volume( struct volume *v );
+
+int program_check_volume( struct volume *v, int nblocks );
+
 #endif
\ No newline at end of file
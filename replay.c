@@ -0,0 +1,356 @@
+/*
+This is the implementation of access log replay.
+The log is read into one array sorted by time, and each recorded thread gets an
+index array into it, so real replays and the offline model share one copy.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "replay.h"
+#include "admit.h"
+#include "evict.h"
+#include "iosched.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+struct access {
+    int thread;                  // Recorded thread index, renumbered from 0
+    io_type type;                // Read or write
+    int blocknum;                // Block accessed
+    long long time;              // Nanoseconds since recording started
+};
+
+struct trace {
+    struct access *accesses;     // Every access, sorted by time
+    int count;                   // Number of accesses
+    int nthreads;                // Number of distinct threads
+    int nblocks;                 // One more than the highest block accessed
+    int **by_thread;             // Indexes into accesses for each thread, in order
+    int *thread_count;           // Length of each by_thread array
+};
+
+static int by_time(const void *a, const void *b) {
+    const struct access *x = a, *y = b;
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    return x->thread - y->thread;
+}
+
+struct trace *trace_load(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    struct trace *t;
+    char line[256];
+    int capacity = 1024, maxthread = -1, i, *map;
+
+    if (!f) return NULL;
+    t = calloc(1, sizeof(*t));
+    if (!t || !(t->accesses = malloc(sizeof(struct access) * capacity))) {
+        fclose(f);
+        free(t);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        struct access a;
+        char op;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%d %c %d %lld", &a.thread, &op, &a.blocknum, &a.time) != 4 || a.thread < 0 || a.blocknum < 0 || a.time < 0 || (op != 'R' && op != 'W')) {
+            fprintf(stderr, "%s: bad line: %s", filename, line);
+            fclose(f);
+            trace_delete(t);
+            return NULL;
+        }
+        a.type = op == 'R' ? IO_READ : IO_WRITE;
+        if (t->count == capacity) {
+            struct access *n = realloc(t->accesses, sizeof(*n) * capacity * 2);
+            if (!n) {
+                fclose(f);
+                trace_delete(t);
+                return NULL;
+            }
+            t->accesses = n;
+            capacity *= 2;
+        }
+        t->accesses[t->count++] = a;
+        if (a.thread > maxthread) maxthread = a.thread;
+        if (a.blocknum >= t->nblocks) t->nblocks = a.blocknum + 1;
+    }
+    fclose(f);
+
+    // Lines from different threads can be written slightly out of order.
+    qsort(t->accesses, t->count, sizeof(struct access), by_time);
+
+    // Renumber threads densely; a recording may not start at thread 0.
+    map = malloc(sizeof(int) * (maxthread + 1));
+    t->by_thread = calloc(maxthread + 1, sizeof(int *));
+    t->thread_count = calloc(maxthread + 1, sizeof(int));
+    if (!map || !t->by_thread || !t->thread_count) {
+        free(map);
+        trace_delete(t);
+        return NULL;
+    }
+    for (i = 0; i <= maxthread; i++) map[i] = -1;
+    for (i = 0; i < t->count; i++) {
+        struct access *a = &t->accesses[i];
+        if (map[a->thread] < 0) map[a->thread] = t->nthreads++;
+        a->thread = map[a->thread];
+        t->thread_count[a->thread]++;
+    }
+    free(map);
+    for (i = 0; i < t->nthreads; i++) {
+        t->by_thread[i] = malloc(sizeof(int) * t->thread_count[i]);
+        if (!t->by_thread[i]) {
+            trace_delete(t);
+            return NULL;
+        }
+        t->thread_count[i] = 0;
+    }
+    for (i = 0; i < t->count; i++) {
+        int th = t->accesses[i].thread;
+        t->by_thread[th][t->thread_count[th]++] = i;
+    }
+    return t;
+}
+
+int trace_length(struct trace *t) {
+    return t->count;
+}
+
+int trace_nthreads(struct trace *t) {
+    return t->nthreads;
+}
+
+int trace_nblocks(struct trace *t) {
+    return t->nblocks;
+}
+
+struct replay_thread {
+    struct trace *t;
+    struct bcache *bc;
+    int thread;
+    int paced;
+    struct timespec start;       // When the replay started, on the monotonic clock
+};
+
+/* Sleep until "offset" ns after "start".  The offset is never negative, since trace_load rejects such lines. */
+static void sleep_until(const struct timespec *start, long long offset) {
+    struct timespec when = *start;
+    when.tv_sec += offset / 1000000000LL;
+    when.tv_nsec += offset % 1000000000LL;
+    if (when.tv_nsec >= 1000000000L) {
+        when.tv_sec++;
+        when.tv_nsec -= 1000000000L;
+    }
+    // Only a signal cuts the sleep short; any other error would just fail again.
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR);
+}
+
+static void *replay_thread(void *arg) {
+    struct replay_thread *r = arg;
+    char data[BLOCK_SIZE], written[BLOCK_SIZE];
+    int i, j;
+
+    // Writes keep the pattern of program_fill_disk, and never carry along whatever was last read.
+    memset(written, 0, BLOCK_SIZE);
+    for (i = 0; i < r->t->thread_count[r->thread]; i++) {
+        struct access *a = &r->t->accesses[r->t->by_thread[r->thread][i]];
+        if (r->paced) sleep_until(&r->start, a->time);
+        if (a->type == IO_READ) {
+            bcache_read(r->bc, a->blocknum, data);
+        } else {
+            for (j = 0; j < BLOCK_SIZE; j += 16) written[j] = (char)a->blocknum;
+            bcache_write(r->bc, a->blocknum, written);
+        }
+    }
+    return NULL;
+}
+
+void trace_replay(struct trace *t, struct bcache *bc, int paced) {
+    struct replay_thread *threads = malloc(sizeof(*threads) * t->nthreads);
+    pthread_t *tids = malloc(sizeof(*tids) * t->nthreads);
+    struct timespec start;
+    int i;
+
+    if (!threads || !tids) {
+        free(threads);
+        free(tids);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < t->nthreads; i++) {
+        threads[i].t = t;
+        threads[i].bc = bc;
+        threads[i].thread = i;
+        threads[i].paced = paced;
+        threads[i].start = start;
+        pthread_create(&tids[i], 0, replay_thread, &threads[i]);
+    }
+    for (i = 0; i < t->nthreads; i++) {
+        pthread_join(tids[i], 0);
+    }
+    free(threads);
+    free(tids);
+}
+
+/* One frame of the offline model. */
+struct sim_frame {
+    int blocknum;
+    int dirty;
+    int cold;                    // Turned down by the admission policy and not hit since
+    struct evict_node evict;
+};
+
+/* A miss in the model looking for a victim, judged the way claim_block judges one. */
+struct sim_claim {
+    struct admit *adm;
+    int candidate;
+    int verdict;                 // -1 until judged, then whether the candidate won
+};
+
+#define SIM_FRAME(n) ((struct sim_frame *)((char *)(n) - offsetof(struct sim_frame, evict)))
+
+static int sim_any(struct evict_node *n, void *arg) {
+    (void)n;
+    (void)arg;
+    return 1;
+}
+
+static int sim_cold(struct evict_node *n, void *arg) {
+    (void)arg;
+    return SIM_FRAME(n)->cold;
+}
+
+/* Judge the candidate against the first admitted frame, and stop there. */
+static int sim_judge(struct evict_node *n, void *arg) {
+    struct sim_claim *c = arg;
+    struct sim_frame *f = SIM_FRAME(n);
+    if (f->cold) return 0;
+    c->verdict = admit_allow(c->adm, c->candidate, f->blocknum);
+    return 1;
+}
+
+/* Pass over admitted frames that rate above the candidate, as the cache does. */
+static int sim_admitted(struct evict_node *n, void *arg) {
+    struct sim_claim *c = arg;
+    struct sim_frame *f = SIM_FRAME(n);
+    if (f->cold) return 1;
+    if (c->verdict < 0) c->verdict = admit_allow(c->adm, c->candidate, f->blocknum);
+    return c->verdict;
+}
+
+/* Charge one transfer the way disk.c does: 10ms plus 0.1ms per block the head moves. */
+static void sim_transfer(struct trace_sim *sim, int *head, int blocknum) {
+    long long moved = blocknum > *head ? blocknum - *head : *head - blocknum;
+    sim->seek += moved;
+    sim->disk_seconds += 0.010 + 0.0001 * moved;
+    *head = blocknum;
+}
+
+void trace_simulate(struct trace *t, const struct bcache_config *cfg, struct trace_sim *sim) {
+    int nframes = cfg->memory_blocks > 0 ? cfg->memory_blocks : 1;
+    struct sim_frame *frames = calloc(nframes, sizeof(*frames));
+    int *where = malloc(sizeof(int) * (t->nblocks > 0 ? t->nblocks : 1));
+    struct evict_policy *p = evict_create(cfg->evict_policy, nframes);
+    struct admit *adm = admit_create(cfg->admit_policy, nframes);
+    struct iosched *q = iosched_create(cfg->sched_policy);
+    struct io_request r;
+    int i, used = 0, head = 0, cold = 0;
+
+    memset(sim, 0, sizeof(*sim));
+    if (!frames || !where || !p || !adm || !q) goto out;
+    for (i = 0; i < t->nblocks; i++) where[i] = -1;
+
+    for (i = 0; i < t->count; i++) {
+        struct access *a = &t->accesses[i];
+        struct sim_frame *f;
+        int admitted = 1;
+
+        admit_record(adm, a->blocknum);
+        if (where[a->blocknum] >= 0) {
+            f = &frames[where[a->blocknum]];
+            cold -= f->cold;
+            f->cold = 0;
+            // Like a hit in the cache, only set the reference bit for the next victim scan to apply.
+            evict_touch_later(&f->evict);
+            sim->hits++;
+        } else {
+            sim->misses++;
+            if (used < nframes) {
+                f = &frames[used++];
+            } else {
+                struct sim_claim c = { adm, a->blocknum, -1 };
+                // Like claim_block, recycle a frame turned down before, and judge against the policy's choice.
+                struct evict_node *victim = cold > 0 ? evict_victim(p, sim_cold, NULL) : NULL;
+                if (victim) {
+                    evict_victim(p, sim_judge, &c);
+                } else {
+                    victim = evict_victim(p, sim_admitted, &c);
+                    // With no frame turned down before to recycle, the miss still needs one.
+                    if (!victim) victim = evict_victim(p, sim_any, NULL);
+                }
+                f = SIM_FRAME(victim);
+                cold -= f->cold;
+                evict_remove(p, &f->evict);
+                if (f->dirty) {
+                    sim_transfer(sim, &head, f->blocknum);
+                    sim->disk_writes++;
+                }
+                where[f->blocknum] = -1;
+                admitted = c.verdict < 0 ? admit_allow(adm, a->blocknum, f->blocknum) : c.verdict;
+                if (!admitted) sim->rejected++;
+            }
+            f->blocknum = a->blocknum;
+            f->dirty = 0;
+            f->cold = !admitted;
+            cold += f->cold;
+            where[a->blocknum] = f - frames;
+            if (admitted) evict_insert(p, &f->evict);
+            else evict_insert_cold(p, &f->evict);
+            // A write replaces the whole block, so only a read has to fetch it.
+            if (a->type == IO_READ) {
+                sim_transfer(sim, &head, a->blocknum);
+                sim->disk_reads++;
+            }
+        }
+        if (a->type == IO_WRITE) f->dirty = 1;
+    }
+
+    for (i = 0; i < used; i++) {
+        if (frames[i].dirty) {
+            r.blocknum = frames[i].blocknum;
+            r.type = IO_WRITE;
+            r.prio = IOPRIO_WRITEBACK;
+            r.owner = &frames[i];
+            r.queued = 0;
+            iosched_push(q, &r);
+        }
+    }
+    while (iosched_pop(q, head, IOPRIO_ALL, 0, 0, &r)) {
+        sim_transfer(sim, &head, r.blocknum);
+        sim->disk_writes++;
+    }
+
+out:
+    if (q) iosched_delete(q);
+    if (p) evict_delete(p);
+    if (adm) admit_delete(adm);
+    free(where);
+    free(frames);
+}
+
+void trace_delete(struct trace *t) {
+    int i;
+    if (!t) return;
+    if (t->by_thread) {
+        for (i = 0; i < t->nthreads; i++) free(t->by_thread[i]);
+    }
+    free(t->by_thread);
+    free(t->thread_count);
+    free(t->accesses);
+    free(t);
+}
@@ -0,0 +1,55 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+/*
+The interface to replaying block access logs recorded with bcache_record_open.
+A log can be replayed against a real buffer cache, with one thread per recorded
+thread, or run through an offline model of the cache that only counts the disk
+transfers and head movement the accesses would cause, without any real I/O.
+*/
+
+#include "bcache.h"
+
+/* Load a log written by bcache_record_open. Returns null if it cannot be read or has a malformed or negative field. */
+struct trace * trace_load( const char *filename );
+
+/* Return the number of accesses in the log. */
+int trace_length( struct trace *t );
+
+/* Return the number of distinct threads that made the accesses. */
+int trace_nthreads( struct trace *t );
+
+/* Return one more than the highest block number accessed. */
+int trace_nblocks( struct trace *t );
+
+/*
+Replay the log against "bc", which must have its scheduler running.
+With "paced" set, each thread issues its accesses at their recorded times;
+otherwise every thread goes as fast as the cache allows.
+Written blocks are given the fill pattern of program_fill_disk.
+*/
+void trace_replay( struct trace *t, struct bcache *bc, int paced );
+
+/* What the offline model saw while simulating a log. */
+struct trace_sim {
+    long long hits;              // Accesses to a block already in memory.
+    long long misses;            // Accesses that needed a frame.
+    long long rejected;          // Misses the admission policy held as cold rather than let in.
+    long long disk_reads;        // Blocks read from disk.
+    long long disk_writes;       // Dirty blocks written to disk, on eviction or at the final sync.
+    long long seek;              // Total head movement in blocks.
+    double disk_seconds;         // Disk time the transfers would take, by the model in disk.c.
+};
+
+/*
+Run the log, in time order, through a model of a cache of "cfg->memory_blocks" frames
+managed by "cfg->evict_policy" and "cfg->admit_policy".  Misses are read and dirty victims are written back
+on the spot, and the dirty blocks left at the end are flushed in the order of
+"cfg->sched_policy", as bcache_sync would leave them to the scheduler.
+*/
+void trace_simulate( struct trace *t, const struct bcache_config *cfg, struct trace_sim *sim );
+
+/* Release the log. */
+void trace_delete( struct trace *t );
+
+#endif
@@ -0,0 +1,60 @@
+/*
+This is a test of the admission policy's resistance to scans.
+A working set that fills the cache exactly is read a few times, so the
+admission policy has seen each of its blocks more often than any block of
+a scan that follows and reads every block once.  The scan must take the
+frames of its own earlier blocks rather than the working set's: the misses
+when the working set is read again may be at most the one block the scan's
+first miss had to take, since no frame of a turned-down block existed yet.
+2Q makes this a real test, since it prefers to evict from its main queue,
+where the working set sits, until its probation queue has filled up.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "testutil.h"
+
+#include <stdio.h>
+
+#define DISK_BLOCKS 1024
+#define MEMORY_BLOCKS 64
+#define WORKING_READS 4          // Times each working set block is read before the scan.
+#define SCAN_BLOCKS 256          // Blocks the scan reads once each, after the working set.
+#define ALLOWED_MISSES 1         // The scan's first miss has nothing turned down to recycle.
+
+int main(void) {
+    struct bcache_config cfg;
+    struct bcache_stats stats;
+    char data[BLOCK_SIZE];
+    long long misses;
+    int i, round;
+
+    struct disk *d = test_open_disk("scanresistdisk", DISK_BLOCKS);
+    test_config(&cfg, MEMORY_BLOCKS);
+    cfg.evict_policy = EVICT_2Q;
+    cfg.admit_policy = ADMIT_TINYLFU;
+    cfg.shards = 1;
+    cfg.ztier_kb = 0;
+    struct bcache *bc = test_start_cache(d, &cfg);
+    if (!bc) return 1;
+
+    for (round = 0; round < WORKING_READS; round++) {
+        for (i = 0; i < MEMORY_BLOCKS; i++) bcache_read(bc, i, data);
+    }
+    for (i = 0; i < SCAN_BLOCKS; i++) bcache_read(bc, MEMORY_BLOCKS + i, data);
+
+    bcache_get_stats(bc, &stats);
+    misses = stats.misses;
+    for (i = 0; i < MEMORY_BLOCKS; i++) bcache_read(bc, i, data);
+    bcache_get_stats(bc, &stats);
+    misses = stats.misses - misses;
+
+    printf("a scan of %d blocks cost the working set %lld of %d blocks\n", SCAN_BLOCKS, misses, MEMORY_BLOCKS);
+    if (misses > ALLOWED_MISSES) {
+        printf("FAILED: the scan evicted more than %d block of the working set\n", ALLOWED_MISSES);
+        return 1;
+    }
+    disk_close(d);
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+This is a test of syncing part of the cache.
+Every other block of two runs far apart is dirtied, with background writeback
+held off for good, so that a block reaches the disk only if a sync writes it.
+The gaps matter: a queued writeback next to one a sync needs rides along in
+the same transfer, which is free, and so not something to test against.
+A sync of a few blocks, narrower than the cache, then one wider than the cache,
+must each write exactly the dirty blocks in their range and leave the rest dirty;
+the disk is checked directly after each.  A full sync writes what is left.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "testutil.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define DISK_BLOCKS 512
+#define MEMORY_BLOCKS 128
+#define RUN 32                   // Blocks in each run, every other one dirtied.
+#define LOW_RUN 0                // First block of the run the range syncs cover.
+#define HIGH_RUN 300             // First block of the run they leave out.
+#define NARROW_LO 8              // A sync narrower than the cache, looked up block by block.
+#define NARROW_HI 16
+#define WIDE_LO 0                // A sync wider than the cache, which walks every frame.
+#define WIDE_HI 256
+
+static int dirtied(int blocknum) {
+    return blocknum % 2 == 0
+        && ((blocknum >= LOW_RUN && blocknum < LOW_RUN + RUN) || (blocknum >= HIGH_RUN && blocknum < HIGH_RUN + RUN));
+}
+
+/* Check that every dirtied block in lo..hi-1 is on disk, and every other one is not. */
+static int check_disk(struct disk *d, int lo, int hi, const char *what) {
+    char home[BLOCK_SIZE];
+    int i;
+
+    for (i = 0; i < DISK_BLOCKS; i++) {
+        int written;
+        if (!dirtied(i)) continue;
+        disk_read(d, i, home);
+        written = home[0] == (char)(i % 127 + 1);
+        if (written != (i >= lo && i < hi)) {
+            printf("after the %s sync, block %d is %s\n", what, i, written ? "on disk but was out of range" : "still dirty but was in range");
+            printf("FAILED\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(void) {
+    struct bcache_config cfg;
+    char data[BLOCK_SIZE];
+    struct bcache_stats stats;
+    int i;
+
+    struct disk *d = test_open_disk("syncrangedisk", DISK_BLOCKS);
+    memset(data, 0, sizeof(data));
+    for (i = 0; i < DISK_BLOCKS; i++) disk_write(d, i, data);
+
+    // Writeback waits for a batch that never fills and has no age limit, however much is dirty.
+    test_config(&cfg, MEMORY_BLOCKS);
+    cfg.batch_blocks = DISK_BLOCKS;
+    cfg.batch_ms = 0;
+    cfg.dirty_age_ms = 0;
+    cfg.dirty_low = 100;
+    cfg.dirty_high = 100;
+    struct bcache *bc = test_start_cache(d, &cfg);
+    if (!bc) return 1;
+
+    for (i = 0; i < DISK_BLOCKS; i++) {
+        if (!dirtied(i)) continue;
+        data[0] = (char)(i % 127 + 1);
+        bcache_write(bc, i, data);
+    }
+
+    bcache_sync_range(bc, NARROW_LO, NARROW_HI);
+    if (!check_disk(d, NARROW_LO, NARROW_HI, "narrow")) return 1;
+    bcache_sync_range(bc, WIDE_LO, WIDE_HI);
+    if (!check_disk(d, WIDE_LO, WIDE_HI, "wide")) return 1;
+    bcache_get_stats(bc, &stats);
+    if (stats.writebacks != RUN / 2 || stats.dirty != RUN / 2) {
+        printf("the range syncs wrote back %lld blocks and left %d dirty, rather than %d of each\n", stats.writebacks, stats.dirty, RUN / 2);
+        printf("FAILED\n");
+        return 1;
+    }
+    bcache_sync(bc);
+    if (!check_disk(d, 0, DISK_BLOCKS, "full")) return 1;
+
+    printf("range syncs wrote only the %d dirty blocks in range\n", RUN / 2);
+    disk_close(d);
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+This is a test of cache hits while the cache is being synced.
+One thread keeps dirtying blocks scattered over the disk, so that no two merge
+into one transfer, and syncing them, while reader threads hit a small set of
+blocks that stay resident.  The readers pause between hits, so that even on one
+CPU their time goes to the cache rather than to waiting for their turn.
+A sync may take as long as its disk writes, but no hit should wait for them:
+the test fails if the worst hit seen while a sync was running took longer than
+the bound, which is well under one disk delay.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "bcache.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DISK_BLOCKS 1024
+#define MEMORY_BLOCKS 256
+#define HOT_BLOCKS 32            // Blocks the readers hit, read once up front.
+#define STORM_BLOCKS 64          // Blocks dirtied before each sync.
+#define STORM_STRIDE 3           // Gap between dirtied blocks, so each is its own transfer.
+#define SYNCS 3                  // Syncs the storm runs before the readers stop.
+#define READERS 2
+#define READER_PAUSE_NS 100000   // Readers rest between hits, so they are not just waiting for a CPU.
+#define DEFAULT_BOUND_MS 5.0     // A disk transfer takes at least 10ms.
+
+struct storm {
+    struct bcache *bc;
+    volatile int syncing;        // A sync is running right now.
+    volatile int done;           // The storm is over.
+};
+
+struct reader {
+    struct storm *storm;
+    int id;
+    long long hits;              // Hits timed while a sync was running.
+    double worst;                // Slowest of them, in seconds.
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *storm_thread(void *arg) {
+    struct storm *s = arg;
+    char data[BLOCK_SIZE];
+    int round, i;
+
+    memset(data, 0, sizeof(data));
+    for (round = 0; round < SYNCS; round++) {
+        for (i = 0; i < STORM_BLOCKS; i++) {
+            int blocknum = HOT_BLOCKS + (round * STORM_BLOCKS + i) * STORM_STRIDE % (DISK_BLOCKS - HOT_BLOCKS);
+            data[0] = (char)round;
+            bcache_write(s->bc, blocknum, data);
+        }
+        __atomic_store_n(&s->syncing, 1, __ATOMIC_SEQ_CST);
+        bcache_sync(s->bc);
+        __atomic_store_n(&s->syncing, 0, __ATOMIC_SEQ_CST);
+    }
+    __atomic_store_n(&s->done, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void *reader_thread(void *arg) {
+    struct reader *r = arg;
+    char data[BLOCK_SIZE];
+    unsigned blocknum = r->id;
+    struct timespec pause = { 0, READER_PAUSE_NS };
+
+    while (!__atomic_load_n(&r->storm->done, __ATOMIC_SEQ_CST)) {
+        int during = __atomic_load_n(&r->storm->syncing, __ATOMIC_SEQ_CST);
+        double start = now_seconds(), took;
+        bcache_read(r->storm->bc, blocknum % HOT_BLOCKS, data);
+        took = now_seconds() - start;
+        // Only count hits that ran from start to end inside one sync.
+        if (during && __atomic_load_n(&r->storm->syncing, __ATOMIC_SEQ_CST)) {
+            r->hits++;
+            if (took > r->worst) r->worst = took;
+        }
+        blocknum = blocknum * 1103515245u + 12345u;
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    double bound = argc > 1 ? atof(argv[1]) : DEFAULT_BOUND_MS, worst = 0;
+    struct reader readers[READERS];
+    pthread_t scheduler, storm, tids[READERS];
+    struct storm s;
+    char data[BLOCK_SIZE];
+    long long hits = 0, misses;
+    struct bcache_stats stats;
+    int i;
+
+    if (bound <= 0) {
+        printf("use: %s [bound-ms]\n", argv[0]);
+        return 1;
+    }
+
+    struct disk *d = disk_open("syncstormdisk", DISK_BLOCKS);
+    if (!d) {
+        fprintf(stderr, "couldn't open syncstormdisk\n");
+        return 1;
+    }
+    struct bcache *bc = bcache_create(d, MEMORY_BLOCKS);
+    if (!bc) return 1;
+    pthread_create(&scheduler, 0, bcache_io_scheduler, bc);
+
+    for (i = 0; i < HOT_BLOCKS; i++) bcache_read(bc, i, data);
+    bcache_get_stats(bc, &stats);
+    misses = stats.misses;
+
+    s.bc = bc;
+    s.syncing = 0;
+    s.done = 0;
+    for (i = 0; i < READERS; i++) {
+        readers[i].storm = &s;
+        readers[i].id = i;
+        readers[i].hits = 0;
+        readers[i].worst = 0;
+        pthread_create(&tids[i], 0, reader_thread, &readers[i]);
+    }
+    pthread_create(&storm, 0, storm_thread, &s);
+    pthread_join(storm, 0);
+    for (i = 0; i < READERS; i++) {
+        pthread_join(tids[i], 0);
+        hits += readers[i].hits;
+        if (readers[i].worst > worst) worst = readers[i].worst;
+    }
+
+    bcache_get_stats(bc, &stats);
+    printf("%lld hits during %d syncs, worst %.3f ms, bound %.3f ms\n", hits, SYNCS, worst * 1e3, bound);
+    disk_close(d);
+
+    if (stats.misses != misses) {
+        printf("FAILED: the hot blocks were not all resident\n");
+        return 1;
+    }
+    if (hits == 0) {
+        printf("FAILED: no hits ran while a sync was in progress\n");
+        return 1;
+    }
+    if (worst * 1e3 > bound) {
+        printf("FAILED: a hit waited for the sync\n");
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
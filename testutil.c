@@ -0,0 +1,61 @@
+/*
+This is the implementation of the fixture shared by the test programs.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "testutil.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct disk *test_open_disk(const char *name, int blocks) {
+    struct disk *d = disk_open(name, blocks);
+    if (!d) {
+        fprintf(stderr, "couldn't open %s\n", name);
+        exit(1);
+    }
+    disk_set_delay(d, 0);
+    return d;
+}
+
+void test_fill_block(int blocknum, int version, char *data) {
+    memset(data, blocknum * 7 + version, BLOCK_SIZE);
+    snprintf(data, BLOCK_SIZE, "block %d version %d", blocknum, version);
+}
+
+void test_fill_disk(struct disk *d, int blocks) {
+    char data[BLOCK_SIZE];
+    int i;
+
+    for (i = 0; i < blocks; i++) {
+        test_fill_block(i, 0, data);
+        disk_write(d, i, data);
+    }
+}
+
+int test_check_block(const char *what, int blocknum, int version, const char *data) {
+    char expect[BLOCK_SIZE];
+
+    test_fill_block(blocknum, version, expect);
+    if (memcmp(data, expect, BLOCK_SIZE) == 0) return 1;
+    printf("FAILED: %s of block %d gave \"%.32s\" rather than \"%s\"\n", what, blocknum, data, expect);
+    return 0;
+}
+
+void test_config(struct bcache_config *cfg, int memoryblocks) {
+    bcache_config_init(cfg, memoryblocks);
+    cfg->readahead_max = 0;
+}
+
+struct bcache *test_start_cache(struct disk *d, const struct bcache_config *cfg) {
+    pthread_t scheduler;
+    struct bcache *bc = bcache_create_config(d, cfg);
+
+    if (!bc) return NULL;
+    pthread_create(&scheduler, 0, bcache_io_scheduler, bc);
+    pthread_detach(scheduler);
+    return bc;
+}
@@ -0,0 +1,44 @@
+#ifndef TESTUTIL_H
+#define TESTUTIL_H
+
+/*
+The fixture shared by the test programs.
+Most tests fill a disk with known data, run a cache over it with a scheduler,
+and check what comes back block by block; only what they do in between differs.
+A block's contents are made from its number and a version, so a test needs to
+remember only which version it last wrote, and a wrong block says which it is.
+*/
+
+#include "bcache.h"
+#include "disk.h"
+
+/*
+Open the disk image "name" of "blocks" blocks, with the simulated delay switched
+off, since the tests check what the blocks hold rather than how long that takes.
+Reports the failure and exits if the image cannot be opened.
+*/
+struct disk * test_open_disk( const char *name, int blocks );
+
+/* Fill "data" with what the "version"th write of block "blocknum" puts there. */
+void test_fill_block( int blocknum, int version, char *data );
+
+/* Write version 0 of blocks 0..blocks-1 straight to disk "d". */
+void test_fill_disk( struct disk *d, int blocks );
+
+/*
+Return 1 if "data" holds the "version"th write of block "blocknum".
+Otherwise report it as the result of "what", e.g. "readv", and return 0.
+*/
+int test_check_block( const char *what, int blocknum, int version, const char *data );
+
+/*
+Fill in "cfg" for a cache of "memoryblocks" blocks with read-ahead off.
+Read-ahead would bring in blocks nobody asked for, turning misses into hits,
+and would still be using the disk when a test reads it directly.
+*/
+void test_config( struct bcache_config *cfg, int memoryblocks );
+
+/* Create a cache over "d" with "cfg" and start its scheduler thread. Returns null if the cache cannot be created. */
+struct bcache * test_start_cache( struct disk *d, const struct bcache_config *cfg );
+
+#endif
@@ -0,0 +1,76 @@
+/*
+This is the implementation of the memory node interface.
+The node layout comes from sysfs as lists like "0-3,8-11", and memory is placed
+with the mbind system call directly, so nothing beyond libc is needed.
+*/
+
+#define _GNU_SOURCE
+
+#include "topology.h"
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+#define MAX_NODES 1024           // Size of the node mask handed to mbind
+
+/*
+Read a list of ranges from "path", calling "each" on every number in them.
+Returns the largest number seen, or -1 if the file could not be read.
+*/
+static int read_list(const char *path, void (*each)(int, void *), void *arg) {
+    FILE *f = fopen(path, "r");
+    int lo, hi, i, largest = -1;
+    char sep;
+
+    if (!f) return -1;
+    while (fscanf(f, "%d", &lo) == 1) {
+        hi = lo;
+        sep = (char)fgetc(f);
+        if (sep == '-') {
+            if (fscanf(f, "%d", &hi) != 1) break;
+            sep = (char)fgetc(f);
+        }
+        for (i = lo; i <= hi; i++) {
+            if (each) each(i, arg);
+        }
+        if (hi > largest) largest = hi;
+        if (sep != ',') break;
+    }
+    fclose(f);
+    return largest;
+}
+
+int topology_nodes(void) {
+    int largest = read_list(NODE_DIR "/online", NULL, NULL);
+    return largest >= 0 ? largest + 1 : 1;
+}
+
+int topology_bind_memory(void *addr, size_t len, int node) {
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    int bits = 8 * sizeof(unsigned long);
+
+    if (node < 0 || node >= MAX_NODES) return -1;
+    mask[node / bits] |= 1UL << (node % bits);
+    // Preferred rather than bound, so a full node spills over instead of failing allocations.
+    return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, MAX_NODES + 1, MPOL_MF_MOVE) == 0 ? 0 : -1;
+}
+
+static void add_cpu(int cpu, void *set) {
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, (cpu_set_t *)set);
+}
+
+int topology_bind_thread(int node) {
+    char path[64];
+    cpu_set_t set;
+
+    if (node < 0) return -1;
+    CPU_ZERO(&set);
+    snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", node);
+    if (read_list(path, add_cpu, &set) < 0 || CPU_COUNT(&set) == 0) return -1;
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
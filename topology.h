@@ -0,0 +1,26 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+/*
+The interface to the machine's memory nodes, as the buffer cache uses them to keep
+each shard's memory next to the CPUs that work on it.  Everything here is advisory:
+on a machine without NUMA every call still succeeds for node 0 or fails harmlessly,
+and the cache works the same either way, only slower across sockets.
+*/
+
+#include <stddef.h>
+
+/* Return the number of memory nodes in the machine; 1 if it cannot be told. */
+int topology_nodes( void );
+
+/*
+Ask for the pages of the "len" bytes at "addr", which must be page-aligned,
+to be placed on memory node "node", moving any already placed elsewhere.
+Returns 0 on success, -1 otherwise.
+*/
+int topology_bind_memory( void *addr, size_t len, int node );
+
+/* Let the calling thread run only on the CPUs of memory node "node". Returns 0 on success, -1 otherwise. */
+int topology_bind_thread( int node );
+
+#endif
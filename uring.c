@@ -0,0 +1,173 @@
+/*
+This is the implementation of the minimal io_uring.
+The submission and completion rings are mapped once when the ring is created.
+uring_transfer fills the submission ring with vectored reads and writes, enters
+the kernel to submit them and wait for at least one to complete, and then reaps
+every completion there is, putting any short transfer back in line for the
+rest, until nothing is left in flight.
+*/
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct uring {
+    int fd;                      // The ring itself
+    unsigned entries;            // Submission queue entries
+    void *sq_ring;               // Mapped submission ring, or MAP_FAILED
+    size_t sq_len;
+    void *cq_ring;               // Mapped completion ring, which may be the same mapping
+    size_t cq_len;
+    struct io_uring_sqe *sqes;   // Mapped submission queue entries, or MAP_FAILED
+    size_t sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    int *retry;                  // Ops that came back short, waiting to go round again
+};
+
+struct uring *uring_create(unsigned entries) {
+    struct io_uring_params p;
+    struct uring *u = calloc(1, sizeof(*u));
+    char *sq, *cq;
+
+    if (!u) return NULL;
+    u->sq_ring = u->cq_ring = u->sqes = MAP_FAILED;
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries > 0 ? entries : 1, &p);
+    if (u->fd < 0) {
+        free(u);
+        return NULL;
+    }
+    u->entries = p.sq_entries;
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len) u->sq_len = u->cq_len;
+        u->cq_len = u->sq_len;
+    }
+    u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) u->cq_ring = u->sq_ring;
+    else u->cq_ring = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, IORING_OFF_CQ_RING);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, IORING_OFF_SQES);
+    u->retry = malloc(sizeof(int) * u->entries);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED || !u->retry) {
+        uring_delete(u);
+        return NULL;
+    }
+
+    sq = u->sq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    cq = u->cq_ring;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return u;
+}
+
+unsigned uring_entries(struct uring *u) {
+    return u->entries;
+}
+
+/* Step "op" past "done" bytes, which may end part way through a buffer. */
+static void op_advance(struct uring_op *op, size_t done) {
+    op->offset += done;
+    while (op->iovcnt > 0 && done >= op->iov->iov_len) {
+        done -= op->iov->iov_len;
+        op->iov++;
+        op->iovcnt--;
+    }
+    if (op->iovcnt > 0) {
+        op->iov->iov_base = (char *)op->iov->iov_base + done;
+        op->iov->iov_len -= done;
+    }
+}
+
+/* Queue op number "index" of "ops" in the next free submission entry. */
+static void op_queue(struct uring *u, int fd, struct uring_op *ops, int index, unsigned *tail) {
+    unsigned slot = *tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[slot];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ops[index].write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)ops[index].iov;
+    sqe->len = ops[index].iovcnt;
+    sqe->off = ops[index].offset;
+    sqe->user_data = index;
+    u->sq_array[slot] = slot;
+    (*tail)++;
+}
+
+int uring_transfer(struct uring *u, int fd, struct uring_op *ops, int n) {
+    unsigned tail = *u->sq_tail, inflight = 0, unsubmitted = 0;
+    int next = 0, nretry = 0, error = 0;
+
+    while (next < n || nretry > 0 || inflight > 0) {
+        unsigned head;
+        int ret;
+
+        // After a failure nothing new goes out; the rest in flight are only waited for.
+        while (!error && inflight + unsubmitted < u->entries && (nretry > 0 || next < n)) {
+            op_queue(u, fd, ops, nretry > 0 ? u->retry[--nretry] : next++, &tail);
+            unsubmitted++;
+        }
+        __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+        if (inflight + unsubmitted == 0) break;
+        ret = syscall(__NR_io_uring_enter, u->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            // Take back what the kernel never picked up, so a later call cannot submit it.
+            error = errno;
+            tail = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+            __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+            unsubmitted = 0;
+        } else if (ret > 0) {
+            unsubmitted -= ret;
+            inflight += ret;
+        }
+
+        head = *u->cq_head;
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            struct uring_op *op = &ops[cqe->user_data];
+            if (cqe->res <= 0) {
+                if (!error) error = cqe->res < 0 ? -cqe->res : EIO;
+            } else {
+                op_advance(op, cqe->res);
+                if (op->iovcnt > 0) u->retry[nretry++] = (int)cqe->user_data;
+            }
+            inflight--;
+            head++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+void uring_delete(struct uring *u) {
+    if (u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_len);
+    if (u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_len);
+    close(u->fd);
+    free(u->retry);
+    free(u);
+}
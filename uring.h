@@ -0,0 +1,39 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+The interface to a minimal io_uring, used by the disk's direct backend to keep
+several transfers in flight at once.  It talks to the kernel with the raw
+io_uring_setup and io_uring_enter system calls, so nothing beyond libc is needed,
+and on a kernel without io_uring uring_create just fails and the caller falls back.
+A ring must only be used by one thread at a time.
+*/
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* One vectored transfer to or from a file. */
+struct uring_op {
+    struct iovec *iov;           // Buffers, in file order; advanced past whatever has been transferred
+    int iovcnt;                  // Number of buffers left
+    off_t offset;                // Where in the file the first buffer goes
+    int write;                   // Non-zero to write the buffers, zero to read into them
+};
+
+/* Create a ring that can have "entries" transfers in flight. Returns null if io_uring is unavailable. */
+struct uring * uring_create( unsigned entries );
+
+/* Return how many transfers the ring can have in flight, which may be more than asked for. */
+unsigned uring_entries( struct uring *u );
+
+/*
+Perform the "n" transfers of "ops" on file "fd", as many at a time as the ring allows,
+resubmitting the rest of any transfer that comes back short.  The ops are used up.
+Returns 0 once all are done, or -1 with errno set if one fails or reaches the end of the file.
+*/
+int uring_transfer( struct uring *u, int fd, struct uring_op *ops, int n );
+
+/* Release the ring. */
+void uring_delete( struct uring *u );
+
+#endif
@@ -0,0 +1,90 @@
+/*
+This is a test of the vectored calls' round trip.
+Blocks are written with bcache_writev in a scattered order and with
+bcache_write_range in a run, some of them over blocks already cached and some
+not, in a cache smaller than all of them.  They are read back with
+bcache_readv in another order and with bcache_read_range across both sets,
+which mixes hits and misses in one call, and each must hold what was last
+written to it.  After a sync, the disk itself must hold the same.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "testutil.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define DISK_BLOCKS 512
+#define MEMORY_BLOCKS 48
+#define SCATTERED 96             // Blocks written one by one in a scattered order.
+#define RUN_FIRST 200            // First block of the run written as a range.
+#define RUN_BLOCKS 80
+
+static int versions[DISK_BLOCKS];  // The version each block should hold.
+
+/* Check one block read back against the version last written to it. */
+static int check_block(const char *what, int blocknum, const char *data) {
+    return test_check_block(what, blocknum, versions[blocknum], data);
+}
+
+int main(void) {
+    static char run[RUN_BLOCKS * BLOCK_SIZE], buffers[SCATTERED][BLOCK_SIZE];
+    int numbers[SCATTERED];
+    char *bufs[SCATTERED];
+    const char *cbufs[SCATTERED];
+    struct bcache_config cfg;
+    char data[BLOCK_SIZE];
+    int i;
+
+    struct disk *d = test_open_disk("vectortripdisk", DISK_BLOCKS);
+    test_fill_disk(d, DISK_BLOCKS);
+    test_config(&cfg, MEMORY_BLOCKS);
+    struct bcache *bc = test_start_cache(d, &cfg);
+    if (!bc) return 1;
+
+    // Cache a few blocks of each set first, so the writes below meet both hits and misses.
+    for (i = 0; i < DISK_BLOCKS; i += 9) bcache_read(bc, i, data);
+
+    // Every fifth block down from the end, wrapping round, so no two are neighbours in the call.
+    for (i = 0; i < SCATTERED; i++) {
+        numbers[i] = (DISK_BLOCKS - 1 - i * 5 + DISK_BLOCKS) % DISK_BLOCKS;
+        versions[numbers[i]] = 1;
+        test_fill_block(numbers[i], 1, buffers[i]);
+        cbufs[i] = buffers[i];
+    }
+    bcache_writev(bc, numbers, cbufs, SCATTERED);
+
+    for (i = 0; i < RUN_BLOCKS; i++) {
+        versions[RUN_FIRST + i] = 2;
+        test_fill_block(RUN_FIRST + i, 2, run + (size_t)i * BLOCK_SIZE);
+    }
+    bcache_write_range(bc, RUN_FIRST, RUN_BLOCKS, run);
+
+    // The scattered blocks again, in the opposite order.
+    for (i = 0; i < SCATTERED; i++) {
+        numbers[i] = (DISK_BLOCKS - 1 - (SCATTERED - 1 - i) * 5 + DISK_BLOCKS) % DISK_BLOCKS;
+        bufs[i] = buffers[i];
+    }
+    bcache_readv(bc, numbers, bufs, SCATTERED);
+    for (i = 0; i < SCATTERED; i++) {
+        if (!check_block("readv", numbers[i], buffers[i])) return 1;
+    }
+
+    // A range running over the end of the run, into blocks only ever written to the disk.
+    bcache_read_range(bc, RUN_FIRST + RUN_BLOCKS / 2, RUN_BLOCKS, run);
+    for (i = 0; i < RUN_BLOCKS; i++) {
+        if (!check_block("read_range", RUN_FIRST + RUN_BLOCKS / 2 + i, run + (size_t)i * BLOCK_SIZE)) return 1;
+    }
+
+    bcache_sync(bc);
+    for (i = 0; i < DISK_BLOCKS; i++) {
+        disk_read(d, i, data);
+        if (!check_block("the disk's copy", i, data)) return 1;
+    }
+
+    printf("%d scattered and %d ranged blocks came back as written\n", SCATTERED, RUN_BLOCKS);
+    disk_close(d);
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+This is the implementation of volumes.
+A concatenation keeps the first volume block of each disk in "start",
+so a lookup is a short scan over the disks.  A stripe maps block b to stripe
+unit b/unit, which lives on disk (b/unit)%ndisks at row (b/unit)/ndisks.
+*/
+
+#include "volume.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct volume {
+    volume_kind kind;            // Layout of the blocks
+    int ndisks;                  // Number of disks
+    struct disk **disks;         // The disks, in layout order
+    int *start;                  // CONCAT: first volume block held by each disk
+    int unit;                    // STRIPE: blocks per stripe unit
+    int nblocks;                 // Usable blocks in the volume
+};
+
+struct volume *volume_create(struct disk **disks, int ndisks, volume_kind kind, int stripe_blocks) {
+    struct volume *v;
+    int i, smallest;
+
+    if (ndisks < 1) return NULL;
+    v = calloc(1, sizeof(*v));
+    if (!v) return NULL;
+    v->kind = kind;
+    v->ndisks = ndisks;
+    v->unit = stripe_blocks > 0 ? stripe_blocks : 1;
+    v->disks = malloc(sizeof(*v->disks) * ndisks);
+    v->start = malloc(sizeof(*v->start) * ndisks);
+    if (!v->disks || !v->start) {
+        volume_delete(v);
+        return NULL;
+    }
+    memcpy(v->disks, disks, sizeof(*v->disks) * ndisks);
+
+    smallest = disk_nblocks(disks[0]);
+    for (i = 0; i < ndisks; i++) {
+        v->start[i] = v->nblocks;
+        v->nblocks += disk_nblocks(disks[i]);
+        if (disk_nblocks(disks[i]) < smallest) smallest = disk_nblocks(disks[i]);
+    }
+    if (kind == VOLUME_STRIPE) v->nblocks = smallest / v->unit * v->unit * ndisks;
+    return v;
+}
+
+void volume_delete(struct volume *v) {
+    free(v->disks);
+    free(v->start);
+    free(v);
+}
+
+int volume_nblocks(struct volume *v) {
+    return v->nblocks;
+}
+
+int volume_ndisks(struct volume *v) {
+    return v->ndisks;
+}
+
+struct disk *volume_disk(struct volume *v, int index) {
+    return v->disks[index];
+}
+
+volume_kind volume_layout(struct volume *v) {
+    return v->kind;
+}
+
+void volume_map(struct volume *v, int block, int *disk, int *pblock) {
+    int i;
+
+    if (v->kind == VOLUME_STRIPE) {
+        int stripe = block / v->unit;
+        *disk = stripe % v->ndisks;
+        *pblock = stripe / v->ndisks * v->unit + block % v->unit;
+        return;
+    }
+    for (i = v->ndisks - 1; i > 0 && block < v->start[i]; i--) {}
+    *disk = i;
+    *pblock = block - v->start[i];
+}
+
+int volume_logical(struct volume *v, int disk, int pblock) {
+    int block;
+
+    if (v->kind == VOLUME_STRIPE) {
+        block = (pblock / v->unit * v->ndisks + disk) * v->unit + pblock % v->unit;
+    } else {
+        block = v->start[disk] + pblock;
+    }
+    return pblock >= 0 && pblock < disk_nblocks(v->disks[disk]) && block < v->nblocks ? block : -1;
+}
+
+static const char *volume_names[] = { "concat", "stripe" };
+
+const char *volume_name(volume_kind kind) {
+    if (kind < VOLUME_CONCAT || kind > VOLUME_STRIPE) return "unknown";
+    return volume_names[kind];
+}
+
+int volume_parse(const char *name, volume_kind *kind) {
+    int i;
+    for (i = VOLUME_CONCAT; i <= VOLUME_STRIPE; i++) {
+        if (!strcmp(name, volume_names[i])) {
+            *kind = (volume_kind)i;
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,56 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+/*
+The interface to volumes: several disks presented as one range of blocks.
+A volume only translates block numbers; it never performs I/O itself, so the
+buffer cache can keep a separate queue and scheduler for every disk.
+Within one disk, logical order always follows physical order.
+*/
+
+#include "disk.h"
+
+/* The ways a volume may lay its blocks out over the disks. */
+typedef enum {
+    VOLUME_CONCAT,   // Each disk holds one contiguous range, one after the other.
+    VOLUME_STRIPE    // Consecutive stripe units go round-robin over the disks.
+} volume_kind;
+
+/*
+Create a volume over "ndisks" disks. "stripe_blocks" is the stripe unit of a
+striped volume, and is ignored for a concatenation. The disks stay owned by
+the caller, and must outlive the volume. Returns null on failure.
+*/
+struct volume * volume_create( struct disk **disks, int ndisks, volume_kind kind, int stripe_blocks );
+
+/* Release the volume, but not its disks. */
+void volume_delete( struct volume *v );
+
+/*
+Return the number of blocks in the volume. A striped volume only uses
+as many whole stripe units of each disk as the smallest disk holds.
+*/
+int volume_nblocks( struct volume *v );
+
+/* Return the number of disks in the volume. */
+int volume_ndisks( struct volume *v );
+
+/* Return disk "index" of the volume. */
+struct disk * volume_disk( struct volume *v, int index );
+
+/* Return the layout of the volume. */
+volume_kind volume_layout( struct volume *v );
+
+/* Find where volume block "block" lives: the index of its disk, and the block on that disk. */
+void volume_map( struct volume *v, int block, int *disk, int *pblock );
+
+/* Return the volume block stored at block "pblock" of disk "disk", or -1 if that block is unused. */
+int volume_logical( struct volume *v, int disk, int pblock );
+
+/* Return the printable name of a layout. */
+const char * volume_name( volume_kind kind );
+
+/* Parse a layout name ("concat", "stripe"). Returns 0 on success, -1 otherwise. */
+int volume_parse( const char *name, volume_kind *kind );
+
+#endif
@@ -0,0 +1,102 @@
+/*
+This is a test of saving a cache's state and warming another with it.
+A cache reads a scattered set of blocks, and saves its state.  A new cache of
+the same size loads it, and must then find every one of those blocks without a
+miss, holding the disk's data, having written nothing.  A cache too small for
+them all must take the blocks the first cache would have kept longest, and a
+file that is not a saved state must be refused.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "testutil.h"
+
+#include <stdio.h>
+
+#define DISK_BLOCKS 512
+#define MEMORY_BLOCKS 64
+#define SMALL_BLOCKS 16          // A cache too small for the saved blocks.
+#define HOT_BLOCKS 48            // Blocks read before the state is saved.
+#define HOT_STRIDE 7             // Gap between them, so no two are neighbours.
+#define HOT_READS 3              // Times each is read.
+#define STATE_FILE "warmtripstate"
+
+/* Make a cache of "frames" blocks over "d", with nothing read ahead but what is loaded. */
+static struct bcache *make_cache(struct disk *d, int frames) {
+    struct bcache_config cfg;
+    test_config(&cfg, frames);
+    return test_start_cache(d, &cfg);
+}
+
+/* Read hot blocks first..HOT_BLOCKS-1 from "bc", check them, and return how many missed, or -1 if any was wrong. */
+static long long read_hot(struct bcache *bc, int first) {
+    struct bcache_stats stats;
+    char data[BLOCK_SIZE];
+    long long misses;
+    int i;
+
+    bcache_get_stats(bc, &stats);
+    misses = stats.misses;
+    for (i = first; i < HOT_BLOCKS; i++) {
+        bcache_read(bc, i * HOT_STRIDE, data);
+        if (!test_check_block("read", i * HOT_STRIDE, 0, data)) return -1;
+    }
+    bcache_get_stats(bc, &stats);
+    return stats.misses - misses;
+}
+
+int main(void) {
+    struct bcache_stats stats;
+    struct bcache *bc;
+    long long misses;
+    int i, saved, loaded;
+    FILE *f;
+
+    struct disk *d = test_open_disk("warmtripdisk", DISK_BLOCKS);
+    test_fill_disk(d, DISK_BLOCKS);
+
+    bc = make_cache(d, MEMORY_BLOCKS);
+    if (!bc) return 1;
+    for (i = 0; i < HOT_READS; i++) {
+        if (read_hot(bc, 0) < 0) return 1;
+    }
+    saved = bcache_save_state(bc, STATE_FILE);
+    if (saved != HOT_BLOCKS) {
+        printf("FAILED: saved %d blocks rather than %d\n", saved, HOT_BLOCKS);
+        return 1;
+    }
+
+    bc = make_cache(d, MEMORY_BLOCKS);
+    if (!bc) return 1;
+    loaded = bcache_load_state(bc, STATE_FILE);
+    misses = read_hot(bc, 0);
+    bcache_get_stats(bc, &stats);
+    if (loaded != HOT_BLOCKS || misses != 0 || stats.writebacks != 0) {
+        printf("FAILED: loaded %d blocks, then %lld of %d missed and %lld were written\n", loaded, misses, HOT_BLOCKS, stats.writebacks);
+        return 1;
+    }
+
+    // The blocks read first went in first, and are the first the saved cache would give up.
+    bc = make_cache(d, SMALL_BLOCKS);
+    if (!bc) return 1;
+    loaded = bcache_load_state(bc, STATE_FILE);
+    misses = read_hot(bc, HOT_BLOCKS - SMALL_BLOCKS);
+    if (loaded != SMALL_BLOCKS || misses != 0) {
+        printf("FAILED: a small cache loaded %d blocks, then %lld of its %d missed\n", loaded, misses, SMALL_BLOCKS);
+        return 1;
+    }
+
+    f = fopen(STATE_FILE, "w");
+    if (!f) return 1;
+    fputs("not a saved state\n", f);
+    fclose(f);
+    if (bcache_load_state(bc, STATE_FILE) != -1) {
+        printf("FAILED: loaded a file that is not a saved state\n");
+        return 1;
+    }
+
+    printf("%d saved blocks warmed a new cache without a miss\n", HOT_BLOCKS);
+    disk_close(d);
+    printf("ok\n");
+    return 0;
+}
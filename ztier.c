@@ -0,0 +1,272 @@
+/*
+This is the implementation of the compressed tier of the buffer cache.
+Blocks are held in a hash table by block number, each in its own allocation
+just big enough for its compressed data, and on a list in the order they were
+stored; the oldest are dropped first when the budget runs out.
+
+The compressor is a small LZ77 in the style of LZ4's block format, so a block
+decompresses with nothing but byte copies.  The output is a series of sequences,
+each a token byte, a run of literal bytes, and a match that copies earlier output:
+the token's high nibble is the number of literals and its low nibble the match
+length less ZTIER_MIN_MATCH, either of which continues in following bytes, each
+adding up to 255, when it is 15.  The literals come next, then the match's distance
+back as two little-endian bytes.  The last sequence has literals only.
+Matches are found through a table of the most recent position of each hash of
+ZTIER_MIN_MATCH bytes, so blocks must be no longer than the greatest distance.
+*/
+
+#include "ztier.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ZTIER_MIN_MATCH 4        // Shortest match worth encoding
+#define ZTIER_MAX_DISTANCE 65535 // Farthest back a match may reach
+#define ZTIER_HASH_BITS 12       // Entries in the match finder's table, as a power of two
+#define ZTIER_KEEP_PERCENT 75    // A block is only kept if it compresses to at most this much of its size
+#define ZTIER_BUCKET_BYTES 256   // Bytes of budget per hash bucket
+
+struct zentry {
+    int blocknum;
+    int len;                     // Bytes of compressed data
+    struct zentry *hash_next;    // Next entry in the same bucket
+    struct zentry *older;        // Entry stored before this one, or null
+    struct zentry *newer;        // Entry stored after this one, or null
+    char data[];
+};
+
+struct ztier {
+    pthread_mutex_t lock;        // Protects everything below
+    int block_size;
+    struct zentry **buckets;
+    unsigned bucket_mask;
+    struct zentry *oldest;       // First to be dropped
+    struct zentry *newest;
+    struct ztier_stats stats;
+};
+
+struct ztier *ztier_create(long budget, int block_size) {
+    struct ztier *t;
+    unsigned nbuckets = 16;
+
+    if (block_size > ZTIER_MAX_DISTANCE) return NULL;
+    t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    while (nbuckets < budget / ZTIER_BUCKET_BYTES) nbuckets <<= 1;
+    t->buckets = calloc(nbuckets, sizeof(struct zentry *));
+    if (!t->buckets) {
+        free(t);
+        return NULL;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    t->block_size = block_size;
+    t->bucket_mask = nbuckets - 1;
+    t->stats.budget = budget;
+    return t;
+}
+
+static struct zentry **bucket_of(struct ztier *t, int blocknum) {
+    return &t->buckets[((unsigned)blocknum * 2654435761u) & t->bucket_mask];
+}
+
+/* Take "e" out of the table and the list, and free it. Called with the lock held. */
+static void remove_entry(struct ztier *t, struct zentry *e) {
+    struct zentry **p = bucket_of(t, e->blocknum);
+    while (*p != e) p = &(*p)->hash_next;
+    *p = e->hash_next;
+    if (e->older) e->older->newer = e->newer;
+    else t->oldest = e->newer;
+    if (e->newer) e->newer->older = e->older;
+    else t->newest = e->older;
+    t->stats.blocks--;
+    t->stats.bytes -= sizeof(*e) + e->len;
+    free(e);
+}
+
+/* Return the entry of block "blocknum", or null. Called with the lock held. */
+static struct zentry *find_entry(struct ztier *t, int blocknum) {
+    struct zentry *e = *bucket_of(t, blocknum);
+    while (e && e->blocknum != blocknum) e = e->hash_next;
+    return e;
+}
+
+int ztier_pack(struct ztier *t, const char *data, char *packed) {
+    return ztier_compress(data, t->block_size, packed, t->block_size * ZTIER_KEEP_PERCENT / 100);
+}
+
+int ztier_put_packed(struct ztier *t, int blocknum, const char *packed, int len) {
+    struct zentry *e, *old;
+    long size = sizeof(*e) + len;
+
+    pthread_mutex_lock(&t->lock);
+    old = find_entry(t, blocknum);
+    if (old) remove_entry(t, old);
+    if (len == 0 || size > t->stats.budget) {
+        t->stats.incompressible += len == 0;
+        pthread_mutex_unlock(&t->lock);
+        return 0;
+    }
+    while (t->stats.bytes + size > t->stats.budget) {
+        remove_entry(t, t->oldest);
+        t->stats.dropped++;
+    }
+    e = malloc(size);
+    if (!e) {
+        pthread_mutex_unlock(&t->lock);
+        return 0;
+    }
+    e->blocknum = blocknum;
+    e->len = len;
+    memcpy(e->data, packed, len);
+    e->hash_next = *bucket_of(t, blocknum);
+    *bucket_of(t, blocknum) = e;
+    e->older = t->newest;
+    e->newer = NULL;
+    if (t->newest) t->newest->newer = e;
+    else t->oldest = e;
+    t->newest = e;
+    t->stats.blocks++;
+    t->stats.bytes += size;
+    t->stats.stored++;
+    t->stats.raw_bytes += t->block_size;
+    t->stats.packed_bytes += len;
+    pthread_mutex_unlock(&t->lock);
+    return 1;
+}
+
+int ztier_take(struct ztier *t, int blocknum, char *data) {
+    struct zentry *e;
+    int found = 0;
+
+    pthread_mutex_lock(&t->lock);
+    e = find_entry(t, blocknum);
+    // A copy that fails to decompress is dropped like any other, and the block is read from disk.
+    if (e) found = ztier_decompress(e->data, e->len, data, t->block_size) == 0;
+    if (e) remove_entry(t, e);
+    if (found) t->stats.hits++;
+    else t->stats.misses++;
+    pthread_mutex_unlock(&t->lock);
+    return found;
+}
+
+void ztier_get_stats(struct ztier *t, struct ztier_stats *stats) {
+    pthread_mutex_lock(&t->lock);
+    *stats = t->stats;
+    pthread_mutex_unlock(&t->lock);
+}
+
+void ztier_delete(struct ztier *t) {
+    while (t->oldest) remove_entry(t, t->oldest);
+    pthread_mutex_destroy(&t->lock);
+    free(t->buckets);
+    free(t);
+}
+
+static unsigned read32(const char *p) {
+    unsigned v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned hash32(unsigned v) {
+    return (v * 2654435761u) >> (32 - ZTIER_HASH_BITS);
+}
+
+/* Append a length beyond the 15 its nibble holds. Returns the new output position, or null if out of room. */
+static char *put_length(char *op, const char *end, int n) {
+    for (; n >= 255; n -= 255) {
+        if (op >= end) return NULL;
+        *op++ = (char)255;
+    }
+    if (op >= end) return NULL;
+    *op++ = (char)n;
+    return op;
+}
+
+/*
+Append one sequence: "nlit" literals from "lit", then a match of "mlen" bytes "distance"
+back, unless "mlen" is 0.  Returns the new output position, or null if out of room.
+*/
+static char *put_sequence(char *op, const char *end, const char *lit, int nlit, int distance, int mlen) {
+    int mcode = mlen > 0 ? mlen - ZTIER_MIN_MATCH : 0;
+
+    if (op >= end) return NULL;
+    *op++ = (char)(((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15));
+    if (nlit >= 15 && !(op = put_length(op, end, nlit - 15))) return NULL;
+    if (end - op < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) return op;
+    if (end - op < 2) return NULL;
+    *op++ = (char)(distance & 0xff);
+    *op++ = (char)(distance >> 8);
+    if (mcode >= 15 && !(op = put_length(op, end, mcode - 15))) return NULL;
+    return op;
+}
+
+int ztier_compress(const char *src, int len, char *dst, int cap) {
+    int table[1 << ZTIER_HASH_BITS];
+    const char *end = dst + cap;
+    char *op = dst;
+    int ip = 0, anchor = 0, i;
+
+    for (i = 0; i < 1 << ZTIER_HASH_BITS; i++) table[i] = -1;
+
+    while (ip + ZTIER_MIN_MATCH <= len) {
+        unsigned h = hash32(read32(src + ip));
+        int ref = table[h], mlen;
+        table[h] = ip;
+        if (ref < 0 || ip - ref > ZTIER_MAX_DISTANCE || read32(src + ref) != read32(src + ip)) {
+            ip++;
+            continue;
+        }
+        mlen = ZTIER_MIN_MATCH;
+        while (ip + mlen < len && src[ref + mlen] == src[ip + mlen]) mlen++;
+        op = put_sequence(op, end, src + anchor, ip - anchor, ip - ref, mlen);
+        if (!op) return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, end, src + anchor, len - anchor, 0, 0);
+    return op ? (int)(op - dst) : 0;
+}
+
+/* Read a length that continues past its nibble. Returns the new input position, or null if the input ends. */
+static const unsigned char *get_length(const unsigned char *ip, const unsigned char *end, int *n) {
+    unsigned char b;
+    do {
+        if (ip >= end) return NULL;
+        b = *ip++;
+        *n += b;
+    } while (b == 255);
+    return ip;
+}
+
+int ztier_decompress(const char *src, int len, char *dst, int size) {
+    const unsigned char *ip = (const unsigned char *)src, *end = ip + len;
+    int op = 0;
+
+    while (ip < end) {
+        int token = *ip++;
+        int nlit = token >> 4, mlen = token & 15, distance;
+
+        if (nlit == 15 && !(ip = get_length(ip, end, &nlit))) return -1;
+        if (end - ip < nlit || size - op < nlit) return -1;
+        memcpy(dst + op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == end) break;
+
+        if (end - ip < 2) return -1;
+        distance = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (mlen == 15 && !(ip = get_length(ip, end, &mlen))) return -1;
+        mlen += ZTIER_MIN_MATCH;
+        if (distance == 0 || distance > op || size - op < mlen) return -1;
+        // Byte by byte, since a match may overlap the bytes it produces.
+        for (; mlen > 0; mlen--, op++) dst[op] = dst[op - distance];
+    }
+    return op == size ? 0 : -1;
+}
@@ -0,0 +1,70 @@
+#ifndef ZTIER_H
+#define ZTIER_H
+
+/*
+The interface to the compressed tier of the buffer cache.
+When a clean block is evicted from the frames, a copy of its data may be kept
+here compressed, within a fixed budget of memory, so that a later miss on it
+costs a decompression instead of a disk read.  The tier only ever holds blocks
+that are not in the frames: a block leaves it as soon as it is looked up, so a
+write to the frame cannot leave a stale copy behind.  Blocks that do not shrink
+enough to be worth their space are not kept, and the least recently stored
+blocks are dropped to make room for new ones.
+Every function may be called from any thread; the tier has its own lock.
+*/
+
+/* The activity of a compressed tier. */
+struct ztier_stats {
+    long long hits;              // Lookups that found the block.
+    long long misses;            // Lookups that did not.
+    long long stored;            // Blocks compressed and kept.
+    long long incompressible;    // Blocks not kept because they did not shrink enough.
+    long long dropped;           // Blocks pushed out to make room for others.
+    long long raw_bytes;         // Bytes of all the blocks stored, before compression.
+    long long packed_bytes;      // The same blocks' bytes after compression.
+    int blocks;                  // Blocks held right now.
+    long bytes;                  // Memory those blocks take right now, counting their bookkeeping.
+    long budget;                 // The most memory the tier may take.
+};
+
+/* Create a tier of blocks of "block_size" bytes taking at most "budget" bytes. Returns null if out of memory. */
+struct ztier * ztier_create( long budget, int block_size );
+
+/*
+Compress block data for ztier_put_packed into "packed", which must hold a whole block.
+Returns the compressed length, or 0 if the block does not shrink enough to be kept.
+Takes no lock, so the costly part of storing a block can run outside the caller's locks.
+*/
+int ztier_pack( struct ztier *t, const char *data, char *packed );
+
+/*
+Keep block "blocknum" as "len" bytes of data from ztier_pack, replacing any copy held
+already; a length of 0 only drops that copy.  Returns 1 if the block was kept, 0 if not.
+*/
+int ztier_put_packed( struct ztier *t, int blocknum, const char *packed, int len );
+
+/*
+Look up block "blocknum" and, if it is held, decompress it into "data" and drop it from the tier.
+Returns 1 if the block was found, 0 if not.
+*/
+int ztier_take( struct ztier *t, int blocknum, char *data );
+
+/* Fill in "stats" with the counters of the tier. */
+void ztier_get_stats( struct ztier *t, struct ztier_stats *stats );
+
+/* Release the tier and every block it holds. */
+void ztier_delete( struct ztier *t );
+
+/*
+Compress the "len" bytes at "src" into at most "cap" bytes at "dst".
+Returns the compressed length, or 0 if it would not fit.
+*/
+int ztier_compress( const char *src, int len, char *dst, int cap );
+
+/*
+Decompress the "len" bytes at "src", made by ztier_compress, into exactly "size" bytes at "dst".
+Returns 0 on success, or -1 if the data is corrupt.
+*/
+int ztier_decompress( const char *src, int len, char *dst, int size );
+
+#endif
@@ -0,0 +1,156 @@
+/*
+This is a test of the compressed tier's round trip.
+First the compressor itself: blocks of zeros, of text, of long runs and of
+noise, whole and cut short, must each decompress to exactly what went in, and
+a copy cut off half way must be refused rather than decoded into garbage.
+Then the tier inside a cache: blocks of text are written straight to the disk
+and read through a cache far smaller than them, twice over, so that the second
+pass finds most of them in the tier where the first pass's evictions left them.
+Two threads then read them all again at once, racing evictions into the tier
+against misses taking blocks out of it.  Every read must return the disk's data.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include "testutil.h"
+#include "ztier.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define DISK_BLOCKS 256
+#define MEMORY_BLOCKS 16
+#define ZTIER_KB 512             // Room for every block of text, so the second pass can find them all.
+#define READERS 2
+#define PACKED_MAX (BLOCK_SIZE + BLOCK_SIZE / 255 + 16) // Room for a block that does not shrink at all.
+
+/* Fill "data" with the text block "blocknum" holds on disk, which compresses like text rather than like a run of one byte. */
+static void fill_block(int blocknum, char *data) {
+    int used = 0, line = 0;
+    while (used < BLOCK_SIZE) {
+        char text[64];
+        int n = snprintf(text, sizeof(text), "block %d line %d\n", blocknum, line++);
+        if (n > BLOCK_SIZE - used) n = BLOCK_SIZE - used;
+        memcpy(data + used, text, n);
+        used += n;
+    }
+}
+
+/* Compress and decompress the first "len" bytes of "data", and check they come back. */
+static int round_trip(const char *what, const char *data, int len) {
+    char packed[PACKED_MAX], out[BLOCK_SIZE];
+    int n = ztier_compress(data, len, packed, sizeof(packed));
+
+    if (n == 0 || ztier_decompress(packed, n, out, len) != 0 || memcmp(out, data, len) != 0) {
+        printf("FAILED: %s of %d bytes did not come back from %d compressed bytes\n", what, len, n);
+        return 0;
+    }
+    // Half the copy cannot make the whole block.
+    if (n > 1 && ztier_decompress(packed, n / 2, out, len) == 0) {
+        printf("FAILED: %s of %d bytes decoded from a truncated copy\n", what, len);
+        return 0;
+    }
+    return 1;
+}
+
+static int check_codec(void) {
+    static const int lengths[] = { BLOCK_SIZE, BLOCK_SIZE - 1, 100, 17, 5, 1 };
+    char data[BLOCK_SIZE];
+    unsigned x = 12345;
+    int i, j;
+
+    for (j = 0; j < (int)(sizeof(lengths) / sizeof(lengths[0])); j++) {
+        memset(data, 0, sizeof(data));
+        if (!round_trip("zeros", data, lengths[j])) return 0;
+        fill_block(j, data);
+        if (!round_trip("text", data, lengths[j])) return 0;
+        for (i = 0; i < BLOCK_SIZE; i++) data[i] = i < BLOCK_SIZE / 2 ? 'a' : (char)(i / 300);
+        if (!round_trip("runs", data, lengths[j])) return 0;
+        for (i = 0; i < BLOCK_SIZE; i++) {
+            x = x * 1103515245u + 12345u;
+            data[i] = (char)(x >> 16);
+        }
+        if (!round_trip("noise", data, lengths[j])) return 0;
+    }
+    return 1;
+}
+
+/* Read every block through the cache and check it, returning the number that were wrong. */
+static int read_all(struct bcache *bc, int first) {
+    char data[BLOCK_SIZE], expect[BLOCK_SIZE];
+    int i, wrong = 0;
+
+    for (i = 0; i < DISK_BLOCKS; i++) {
+        int blocknum = (first + i) % DISK_BLOCKS;
+        bcache_read(bc, blocknum, data);
+        fill_block(blocknum, expect);
+        if (memcmp(data, expect, BLOCK_SIZE) != 0) {
+            printf("block %d read back wrong\n", blocknum);
+            wrong++;
+        }
+    }
+    return wrong;
+}
+
+struct reader {
+    struct bcache *bc;
+    int first;
+    int wrong;
+};
+
+static void *reader_thread(void *arg) {
+    struct reader *r = arg;
+    r->wrong = read_all(r->bc, r->first);
+    return NULL;
+}
+
+int main(void) {
+    struct bcache_config cfg;
+    struct bcache_stats stats;
+    struct reader readers[READERS];
+    pthread_t tids[READERS];
+    char data[BLOCK_SIZE];
+    int i, wrong = 0;
+
+    if (!check_codec()) return 1;
+
+    struct disk *d = test_open_disk("ztiertripdisk", DISK_BLOCKS);
+    for (i = 0; i < DISK_BLOCKS; i++) {
+        fill_block(i, data);
+        disk_write(d, i, data);
+    }
+
+    test_config(&cfg, MEMORY_BLOCKS);
+    cfg.ztier_kb = ZTIER_KB;
+    struct bcache *bc = test_start_cache(d, &cfg);
+    if (!bc) return 1;
+
+    wrong += read_all(bc, 0);
+    wrong += read_all(bc, 0);
+    bcache_get_stats(bc, &stats);
+    if (stats.ztier.hits < DISK_BLOCKS - MEMORY_BLOCKS) {
+        printf("FAILED: the second pass found only %lld of %d blocks in the tier\n", stats.ztier.hits, DISK_BLOCKS - MEMORY_BLOCKS);
+        return 1;
+    }
+
+    for (i = 0; i < READERS; i++) {
+        readers[i].bc = bc;
+        readers[i].first = i * DISK_BLOCKS / READERS;
+        pthread_create(&tids[i], 0, reader_thread, &readers[i]);
+    }
+    for (i = 0; i < READERS; i++) {
+        pthread_join(tids[i], 0);
+        wrong += readers[i].wrong;
+    }
+    if (wrong > 0) {
+        printf("FAILED: %d reads returned the wrong data\n", wrong);
+        return 1;
+    }
+
+    bcache_get_stats(bc, &stats);
+    printf("%lld blocks came back from the compressed tier, all intact\n", stats.ztier.hits);
+    disk_close(d);
+    printf("ok\n");
+    return 0;
+}